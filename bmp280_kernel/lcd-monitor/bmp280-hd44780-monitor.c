@@ -1,19 +1,29 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/align.h>
+#include <linux/compiler.h>
 #include <linux/container_of.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/errno.h>
 #include <linux/iio/consumer.h>
+#include <linux/iio/iio.h>
 #include <linux/iio/types.h>
 #include <linux/jiffies.h>
 #include <linux/kstrtox.h>
+#include <linux/math.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
 #include <linux/mod_devicetable.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
 #include <linux/printk.h>
+#include <linux/property.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/sprintf.h>
 #include <linux/string.h>
 #include <linux/types.h>
@@ -30,6 +40,102 @@ MODULE_DESCRIPTION("BMP280 live monitoring module "
  */
 MODULE_SOFTDEP("pre: bmp280-iio hd44780");
 
+/**
+ * Whether monitors run their worker on a workqueue of their own, with high
+ * priority and not bound to any CPU, instead of the system one. Writing to
+ * the display bit-bangs GPIOs for a while, so this keeps refreshes from
+ * waiting behind unrelated system work, and the other way around.
+ * E.g. `sudo insmod bmp280-hd44780-monitor.ko dedicated_workqueue=1`.
+ */
+static bool dedicated_workqueue;
+module_param(dedicated_workqueue, bool, 0444);
+MODULE_PARM_DESC(dedicated_workqueue,
+		 "Run the monitor on its own high priority, unbound workqueue");
+
+/**
+ * Units of the processed values in BMP280 scans: 1/100 degrees Celcius, and
+ * 1/256 Pascal. These are the same scales bmp280-iio returns along with
+ * processed sysfs reads.
+ */
+#define BMP280_TEMPERATURE_SCALE 100
+#define BMP280_PRESSURE_SCALE 256
+
+/**
+ * Processed values bmp280-iio pushes for scans it failed to read.
+ */
+#define BMP280_GAP_TEMPERATURE S32_MIN
+#define BMP280_GAP_PRESSURE 0
+
+/**
+ * Most sensors and displays a monitor handles.
+ */
+#define BMP280_MONITOR_MAX_SENSORS 8
+#define BMP280_MONITOR_MAX_DISPLAYS 4
+
+/**
+ * Characters per line on the display.
+ */
+#define BMP280_MONITOR_LINE_LENGTH 16
+
+/**
+ * Number of history entries we keep for each sensor. They are spread evenly
+ * over the statistics window.
+ */
+#define BMP280_MONITOR_HISTORY 32
+
+/**
+ * Longest statistics window, in seconds: one day.
+ */
+#define BMP280_MONITOR_MAX_WINDOW_S 86400
+
+/**
+ * Pressure change over the statistics window, in 1/256 Pascal, above which
+ * the trend arrow shows rising or falling pressure: 0.5 hPa.
+ */
+#define BMP280_MONITOR_TREND_THRESHOLD (50 * BMP280_PRESSURE_SCALE)
+
+struct bmp280_hd44780_monitor;
+
+/**
+ * Values of one sensor, recorded by the worker, for the window statistics.
+ * Either value can be a gap.
+ */
+struct bmp280_hd44780_monitor_entry {
+  unsigned long when;
+  s32 temperature;
+  u32 pressure;
+};
+
+/**
+ * One BMP280 sensor we display.
+ *
+ * consumer is the device whose io-channels we consume: the monitor device
+ * itself, in the single sensor layout, or a child device carrying one of its
+ * sensor child nodes. Callback buffers only take channels of one IIO device,
+ * so each sensor gets its own.
+ *
+ * The latest values are protected by the monitor's latest_lock. The history
+ * is only touched with the monitor's monitor_mutex held.
+ */
+struct bmp280_hd44780_monitor_sensor {
+  struct bmp280_hd44780_monitor *monitor;
+  struct device *consumer;
+  // Callback buffer on the channels of this sensor
+  struct iio_cb_buffer *cb_buffer;
+  // Where the processed temperature and pressure are within each scan
+  size_t temperature_offset;
+  size_t pressure_offset;
+  // Latest values pushed by the BMP280 driver
+  s32 latest_temperature;
+  u32 latest_pressure;
+  bool latest_valid;
+  // Ring of recorded values: history_count entries, the newest one at
+  // history_head.
+  struct bmp280_hd44780_monitor_entry history[BMP280_MONITOR_HISTORY];
+  unsigned int history_head;
+  unsigned int history_count;
+};
+
 /**
  * Monitor context structure.
  *
@@ -37,20 +143,58 @@ MODULE_SOFTDEP("pre: bmp280-iio hd44780");
  *
  * Must be initialized before being used, and de-initialized after no longer
  * needed, through calls to monitor_init and monitor_teardown, respectively.
+ *
+ * We are an in-kernel consumer of the BMP280 IIO buffers: each sensor's
+ * cb_buffer gets every scan its driver pushes, and bmp280_hd44780_monitor_scan
+ * keeps the latest values, under latest_lock. The worker takes those, for all
+ * sensors at once, and records them into their history every so often. It
+ * then renders pages out of them, one for each display, and never talks with
+ * the sensors. It also remembers what it last wrote, so refreshes that would
+ * show the same text leave the displays alone.
+ *
+ * Pages show either the current values of a sensor, or their minimum, average
+ * and maximum over window_s. Every page_period_ms, each display moves on to
+ * the next page.
+ *
+ * The worker either polls, every refresh_period_ms, or, when event_driven is
+ * set, gets queued by bmp280_hd44780_monitor_scan for every new scan. The
+ * latter reads running and event_driven without the mutex.
  */
 struct bmp280_hd44780_monitor {
   struct mutex monitor_mutex;
-  // References to BMP280 IIO channels
-  struct iio_channel *temperature_channel;
-  struct iio_channel *pressure_channel;
-  // Work structure for the periodic data refresh
+  // Sensors we display, and whether their callback buffers are started
+  struct bmp280_hd44780_monitor_sensor *sensors;
+  unsigned int sensor_count;
+  bool capturing;
+  // Protects the latest values of all sensors
+  spinlock_t latest_lock;
+  // When the worker records the next history entries
+  unsigned long next_history;
+  // Page the first display shows, and when it moves on to the next one
+  unsigned int page;
+  unsigned long next_page;
+  // Lines last written to each display, and whether they are still showing
+  char shown[BMP280_MONITOR_MAX_DISPLAYS][2][BMP280_MONITOR_LINE_LENGTH + 1];
+  bool shown_valid[BMP280_MONITOR_MAX_DISPLAYS];
+  // Work structure for the data refresh, and the workqueue it runs on
   struct delayed_work dwork;
-  // ID of display we are writing to. Default to 0.
+  struct workqueue_struct *wq;
+  // ID of the first display we are writing to. Default to 0.
   s32 display_index;
+  // How many displays we write to, with consecutive IDs. Default to 1.
+  u32 display_count;
   // How often do we update the display with new values. Default to 2 seconds.
   u32 refresh_period_ms;
+  // How long each page shows, 0 to only show current values, without
+  // rotating. Default to 5 seconds.
+  u32 page_period_ms;
+  // Window of the statistics pages. Default to 10 minutes.
+  u32 window_s;
   // Whether we are running or not. Default to true.
   bool running;
+  // Whether new scans, rather than a timer, trigger refreshes. Default to
+  // false.
+  bool event_driven;
 };
 
 /**
@@ -75,116 +219,565 @@ static void bmp280_hd44780_monitor_work(struct work_struct *work);
  */
 static void monitor_init(struct bmp280_hd44780_monitor *monitor) {
   mutex_init(&monitor->monitor_mutex);
+  spin_lock_init(&monitor->latest_lock);
   // Set up workqueue entry for our running worker function
   INIT_DELAYED_WORK(&monitor->dwork, &bmp280_hd44780_monitor_work);
+  monitor->wq = system_wq;
+  monitor->next_history = jiffies;
   // Assign default parameter values
   monitor->display_index = 0;
+  monitor->display_count = 1;
   monitor->refresh_period_ms = 2000;
+  monitor->page_period_ms = 5000;
+  monitor->window_s = 600;
   monitor->running = true;
+  monitor->next_page = jiffies + msecs_to_jiffies(monitor->page_period_ms);
+}
+
+/**
+ * Starts or stops consuming the BMP280 buffers. While capturing, each BMP280
+ * driver keeps its triggered buffer enabled, and pushes a scan to us for
+ * every sample it reads.
+ * Must be called with monitor_mutex held.
+ */
+static int monitor_set_capturing(struct bmp280_hd44780_monitor *monitor,
+				 bool capturing) {
+  if (capturing == monitor->capturing) {
+    return 0;
+  }
+  if (capturing) {
+    for (unsigned int started = 0; started < monitor->sensor_count;
+	 started++) {
+      int status =
+	iio_channel_start_all_cb(monitor->sensors[started].cb_buffer);
+      if (status) {
+	pr_err("Failed to start IIO callback buffer: %d\n", status);
+	while (started--) {
+	  iio_channel_stop_all_cb(monitor->sensors[started].cb_buffer);
+	}
+	return status;
+      }
+    }
+  } else {
+    for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+      iio_channel_stop_all_cb(monitor->sensors[i].cb_buffer);
+    }
+    // Do not show stale values when we start again.
+    spin_lock_irq(&monitor->latest_lock);
+    for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+      monitor->sensors[i].latest_valid = false;
+    }
+    spin_unlock_irq(&monitor->latest_lock);
+  }
+  monitor->capturing = capturing;
+  return 0;
+}
+
+/**
+ * Forgets the history of all sensors, e.g. when the window changes.
+ * Must be called with monitor_mutex held.
+ */
+static void monitor_clear_history(struct bmp280_hd44780_monitor *monitor) {
+  for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+    monitor->sensors[i].history_count = 0;
+  }
+  monitor->next_history = jiffies;
+}
+
+/**
+ * Release function of the child devices carrying sensor child nodes.
+ */
+static void monitor_release_consumer(struct device *dev) {
+  fwnode_handle_put(dev_fwnode(dev));
+  kfree(dev);
+}
+
+/**
+ * Creates a child device of parent, carrying the sensor child node, so we can
+ * look its io-channels up like those of any other consumer device.
+ */
+static struct device *monitor_add_consumer(struct device *parent,
+					   struct fwnode_handle *child,
+					   unsigned int index) {
+  struct device *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+  if (!dev) {
+    return ERR_PTR(-ENOMEM);
+  }
+  device_initialize(dev);
+  dev->parent = parent;
+  dev->release = monitor_release_consumer;
+  device_set_node(dev, fwnode_handle_get(child));
+  int ret = dev_set_name(dev, "%s.sensor%u", dev_name(parent), index);
+  if (!ret) {
+    ret = device_add(dev);
+  }
+  if (ret) {
+    put_device(dev);
+    return ERR_PTR(ret);
+  }
+  return dev;
 }
 
 /**
  * Monitor context structure teardown.
  *
- * Counterpart to monitor_init. Cancels (synchronously) the monitor worker, and
- * destroys the mutex.
+ * Counterpart to monitor_init. Stops consuming the BMP280 buffers, cancels
+ * (synchronously) the monitor worker, destroys our own workqueue if we have
+ * one, releases the sensors, and destroys the mutex.
  */
-static void monitor_teardown(struct bmp280_hd44780_monitor *monitor) {
+static void monitor_teardown(struct bmp280_hd44780_monitor *monitor,
+			     struct device *dev) {
   // In case the worker is still running, make it stop.
   mutex_lock(&monitor->monitor_mutex);
-  monitor->running = false;
+  WRITE_ONCE(monitor->running, false);
+  monitor_set_capturing(monitor, false);
   mutex_unlock(&monitor->monitor_mutex);
   // In case the worker is still scheduled, cancel it.
   cancel_delayed_work_sync(&monitor->dwork);
+  if (monitor->wq != system_wq) {
+    destroy_workqueue(monitor->wq);
+    monitor->wq = system_wq;
+  }
+  for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+    struct bmp280_hd44780_monitor_sensor *sensor = &monitor->sensors[i];
+    if (sensor->cb_buffer) {
+      iio_channel_release_all_cb(sensor->cb_buffer);
+      sensor->cb_buffer = NULL;
+    }
+    if (sensor->consumer && sensor->consumer != dev) {
+      device_unregister(sensor->consumer);
+    }
+    sensor->consumer = NULL;
+  }
+  monitor->sensor_count = 0;
   mutex_destroy(&monitor->monitor_mutex);
 }
 
+/**
+ * IIO callback buffer function, called with every scan a BMP280 driver
+ * pushes, from its trigger handler. Only copies the values we display, and,
+ * in event driven mode, queues a refresh. If one is already queued, it will
+ * pick these values up too, so sensors sharing a trigger still cause one
+ * refresh.
+ */
+static int bmp280_hd44780_monitor_scan(const void *data, void *private) {
+  struct bmp280_hd44780_monitor_sensor *sensor = private;
+  struct bmp280_hd44780_monitor *monitor = sensor->monitor;
+  const u8 *scan = data;
+  s32 temperature;
+  u32 pressure;
+  memcpy(&temperature, scan + sensor->temperature_offset,
+	 sizeof(temperature));
+  memcpy(&pressure, scan + sensor->pressure_offset, sizeof(pressure));
+  unsigned long flags;
+  spin_lock_irqsave(&monitor->latest_lock, flags);
+  sensor->latest_temperature = temperature;
+  sensor->latest_pressure = pressure;
+  sensor->latest_valid = true;
+  spin_unlock_irqrestore(&monitor->latest_lock, flags);
+  if (READ_ONCE(monitor->event_driven) && READ_ONCE(monitor->running)) {
+    queue_delayed_work(monitor->wq, &monitor->dwork, /*delay=*/0);
+  }
+  return 0;
+}
+
+/**
+ * Finds where the processed temperature and pressure values are in the scans
+ * we get. A callback buffer's scans only hold its own channels, in scan index
+ * order, each aligned to its storage size.
+ */
+static int
+monitor_find_scan_offsets(struct bmp280_hd44780_monitor_sensor *sensor) {
+  struct iio_channel *channels =
+    iio_channel_cb_get_channels(sensor->cb_buffer);
+  bool found_temperature = false;
+  bool found_pressure = false;
+  size_t offset = 0;
+  int last_index = -1;
+  for (;;) {
+    // Next channel, by scan index
+    const struct iio_chan_spec *next = NULL;
+    for (struct iio_channel *chan = channels; chan->indio_dev; chan++) {
+      const struct iio_chan_spec *spec = chan->channel;
+      if (spec->scan_index > last_index &&
+	  (!next || spec->scan_index < next->scan_index)) {
+	next = spec;
+      }
+    }
+    if (!next) {
+      break;
+    }
+    size_t bytes = next->scan_type.storagebits / 8;
+    offset = ALIGN(offset, bytes);
+    if (iio_channel_has_info(next, IIO_CHAN_INFO_PROCESSED) && bytes == 4) {
+      if (next->type == IIO_TEMP) {
+	sensor->temperature_offset = offset;
+	found_temperature = true;
+      } else if (next->type == IIO_PRESSURE) {
+	sensor->pressure_offset = offset;
+	found_pressure = true;
+      }
+    }
+    offset += bytes;
+    last_index = next->scan_index;
+  }
+  if (!found_temperature || !found_pressure) {
+    pr_err("IIO channels must include processed temperature and pressure.\n");
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Sets up the callback buffer of one sensor, over the io-channels of its
+ * consumer device.
+ */
+static int monitor_setup_sensor(struct bmp280_hd44780_monitor *monitor,
+				struct bmp280_hd44780_monitor_sensor *sensor,
+				struct device *consumer) {
+  sensor->monitor = monitor;
+  sensor->consumer = consumer;
+  struct iio_cb_buffer *cb_buffer =
+    iio_channel_get_all_cb(consumer, bmp280_hd44780_monitor_scan, sensor);
+  if (IS_ERR(cb_buffer)) {
+    pr_err("Failed to acquire IIO channels of %s with error %ld.\n",
+	   dev_name(consumer), PTR_ERR(cb_buffer));
+    return PTR_ERR(cb_buffer);
+  }
+  sensor->cb_buffer = cb_buffer;
+  return monitor_find_scan_offsets(sensor);
+}
+
+/**
+ * Sets up all sensors. Without child nodes, the monitor node itself lists the
+ * io-channels of its only sensor. Otherwise, each child node lists those of
+ * one sensor, in the order we show them.
+ */
+static int monitor_setup_sensors(struct bmp280_hd44780_monitor *monitor,
+				 struct device *dev) {
+  unsigned int count = device_get_child_node_count(dev);
+  if (count > BMP280_MONITOR_MAX_SENSORS) {
+    pr_err("At most %d sensors are supported.\n", BMP280_MONITOR_MAX_SENSORS);
+    return -EINVAL;
+  }
+  monitor->sensors = devm_kcalloc(dev, max(count, 1U),
+				  sizeof(*monitor->sensors), GFP_KERNEL);
+  if (!monitor->sensors) {
+    return -ENOMEM;
+  }
+  if (count == 0) {
+    monitor->sensor_count = 1;
+    return monitor_setup_sensor(monitor, &monitor->sensors[0], dev);
+  }
+  struct fwnode_handle *child;
+  device_for_each_child_node(dev, child) {
+    unsigned int index = monitor->sensor_count;
+    struct device *consumer = monitor_add_consumer(dev, child, index);
+    if (IS_ERR(consumer)) {
+      fwnode_handle_put(child);
+      return PTR_ERR(consumer);
+    }
+    // Counted right away, so monitor_teardown releases it on failures.
+    monitor->sensor_count++;
+    int ret = monitor_setup_sensor(monitor, &monitor->sensors[index],
+				   consumer);
+    if (ret) {
+      fwnode_handle_put(child);
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Records the latest values of every sensor into its history, if the time
+ * for the next entry has come. Entries are window_s / BMP280_MONITOR_HISTORY
+ * apart, so the ring covers the whole window. All sensors get their entries
+ * at the same time.
+ * Must be called with monitor_mutex held.
+ */
+static void monitor_record_history(struct bmp280_hd44780_monitor *monitor,
+				   const s32 *temperature, const u32 *pressure,
+				   const bool *valid, unsigned long now) {
+  if (time_before(now, monitor->next_history)) {
+    return;
+  }
+  unsigned long interval =
+    max(msecs_to_jiffies(monitor->window_s * MSEC_PER_SEC) /
+	BMP280_MONITOR_HISTORY, 1UL);
+  monitor->next_history = now + interval;
+  for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+    if (!valid[i]) {
+      continue;
+    }
+    struct bmp280_hd44780_monitor_sensor *sensor = &monitor->sensors[i];
+    sensor->history_head = (sensor->history_head + 1) % BMP280_MONITOR_HISTORY;
+    sensor->history[sensor->history_head] =
+      (struct bmp280_hd44780_monitor_entry) {
+      .when = now,
+      .temperature = temperature[i],
+      .pressure = pressure[i],
+    };
+    sensor->history_count =
+      min(sensor->history_count + 1, (unsigned int)BMP280_MONITOR_HISTORY);
+  }
+}
+
+/**
+ * Statistics of one sensor's history, over the window. Counts are 0 when
+ * there was no value in the window. oldest_pressure is the first pressure
+ * value of the window, for the trend.
+ */
+struct bmp280_hd44780_monitor_stats {
+  unsigned int temperature_count;
+  s32 temperature_min;
+  s32 temperature_max;
+  s64 temperature_sum;
+  unsigned int pressure_count;
+  u32 pressure_min;
+  u32 pressure_max;
+  u64 pressure_sum;
+  u32 oldest_pressure;
+};
+
+/**
+ * Computes the statistics of one sensor's history entries within the window.
+ * Must be called with monitor_mutex held.
+ */
+static void
+monitor_compute_stats(const struct bmp280_hd44780_monitor *monitor,
+		      const struct bmp280_hd44780_monitor_sensor *sensor,
+		      unsigned long now,
+		      struct bmp280_hd44780_monitor_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  unsigned long window = msecs_to_jiffies(monitor->window_s * MSEC_PER_SEC);
+  // From the newest entry back, so we can stop at the first one too old.
+  for (unsigned int n = 0; n < sensor->history_count; n++) {
+    unsigned int index = (sensor->history_head + BMP280_MONITOR_HISTORY - n) %
+      BMP280_MONITOR_HISTORY;
+    const struct bmp280_hd44780_monitor_entry *entry = &sensor->history[index];
+    if (time_after(now, entry->when + window)) {
+      break;
+    }
+    if (entry->temperature != BMP280_GAP_TEMPERATURE) {
+      if (!stats->temperature_count ||
+	  entry->temperature < stats->temperature_min) {
+	stats->temperature_min = entry->temperature;
+      }
+      if (!stats->temperature_count ||
+	  entry->temperature > stats->temperature_max) {
+	stats->temperature_max = entry->temperature;
+      }
+      stats->temperature_sum += entry->temperature;
+      stats->temperature_count++;
+    }
+    if (entry->pressure != BMP280_GAP_PRESSURE) {
+      if (!stats->pressure_count || entry->pressure < stats->pressure_min) {
+	stats->pressure_min = entry->pressure;
+      }
+      if (!stats->pressure_count || entry->pressure > stats->pressure_max) {
+	stats->pressure_max = entry->pressure;
+      }
+      stats->pressure_sum += entry->pressure;
+      stats->pressure_count++;
+      stats->oldest_pressure = entry->pressure;
+    }
+  }
+}
+
+/**
+ * Trend arrow of the current pressure against the oldest one in the window:
+ * rising, falling or steady, or blank without both values.
+ */
+static char
+monitor_pressure_trend(const struct bmp280_hd44780_monitor_stats *stats,
+		       bool valid, u32 pressure) {
+  if (!valid || pressure == BMP280_GAP_PRESSURE || !stats->pressure_count) {
+    return ' ';
+  }
+  s64 change = (s64)pressure - stats->oldest_pressure;
+  if (change > BMP280_MONITOR_TREND_THRESHOLD) {
+    return '^';
+  }
+  if (change < -BMP280_MONITOR_TREND_THRESHOLD) {
+    return 'v';
+  }
+  return '-';
+}
+
+/**
+ * Formats a temperature, in 1/100 degrees Celcius, with one decimal.
+ */
+static void monitor_format_tenths(char *buf, size_t size, s32 temperature) {
+  s32 tenths = DIV_ROUND_CLOSEST(temperature, 10);
+  snprintf(buf, size, "%s%d.%d", tenths < 0 ? "-" : "", abs(tenths) / 10,
+	   abs(tenths) % 10);
+}
+
+/**
+ * Formats the page showing the current values of a sensor. When there are
+ * several sensors, the last column of the first line holds its number. Until
+ * the first scan comes in, and for scans the driver failed to read, we show
+ * dashes.
+ */
+static void
+monitor_format_current_page(const struct bmp280_hd44780_monitor *monitor,
+			    unsigned int index, bool valid, s32 temperature,
+			    u32 pressure,
+			    const struct bmp280_hd44780_monitor_stats *stats,
+			    char lines[2][BMP280_MONITOR_LINE_LENGTH + 1]) {
+  char number = monitor->sensor_count > 1 ? '1' + index : ' ';
+  if (valid && temperature != BMP280_GAP_TEMPERATURE) {
+    // Compute integer and decimal parts
+    int temperature_int = temperature / BMP280_TEMPERATURE_SCALE;
+    int temperature_100ths = abs(temperature % BMP280_TEMPERATURE_SCALE);
+    snprintf(lines[0], BMP280_MONITOR_LINE_LENGTH + 1, "Temp: %3d.%02d C%c",
+	     temperature_int, temperature_100ths, number);
+  } else {
+    snprintf(lines[0], BMP280_MONITOR_LINE_LENGTH + 1, "Temp:  --.-- C%c",
+	     number);
+  }
+  char trend = monitor_pressure_trend(stats, valid, pressure);
+  if (valid && pressure != BMP280_GAP_PRESSURE) {
+    // For pressure, use only integer part, since the number in hPa is already
+    // long. Convert from Pascal to hecto-Pascal.
+    u32 pressure_int = pressure / (100 * BMP280_PRESSURE_SCALE);
+    snprintf(lines[1], BMP280_MONITOR_LINE_LENGTH + 1, "Pres: %4u hPa %c",
+	     pressure_int, trend);
+  } else {
+    snprintf(lines[1], BMP280_MONITOR_LINE_LENGTH + 1, "Pres: ---- hPa");
+  }
+}
+
+/**
+ * Formats the page showing the minimum, average and maximum values of a
+ * sensor over the window, in tenths of degrees Celcius and hPa.
+ */
+static void
+monitor_format_stats_page(const struct bmp280_hd44780_monitor_stats *stats,
+			  char lines[2][BMP280_MONITOR_LINE_LENGTH + 1]) {
+  if (stats->temperature_count) {
+    char min[8], avg[8], max[8];
+    monitor_format_tenths(min, sizeof(min), stats->temperature_min);
+    monitor_format_tenths(avg, sizeof(avg),
+			  div_s64(stats->temperature_sum,
+				  stats->temperature_count));
+    monitor_format_tenths(max, sizeof(max), stats->temperature_max);
+    snprintf(lines[0], BMP280_MONITOR_LINE_LENGTH + 1, "T%5s%5s%5s",
+	     min, avg, max);
+  } else {
+    snprintf(lines[0], BMP280_MONITOR_LINE_LENGTH + 1, "T --.- --.- --.-");
+  }
+  if (stats->pressure_count) {
+    u32 hpa = 100 * BMP280_PRESSURE_SCALE;
+    u32 avg = div_u64(stats->pressure_sum, stats->pressure_count);
+    snprintf(lines[1], BMP280_MONITOR_LINE_LENGTH + 1, "P %4u %4u %4u",
+	     stats->pressure_min / hpa, avg / hpa, stats->pressure_max / hpa);
+  } else {
+    snprintf(lines[1], BMP280_MONITOR_LINE_LENGTH + 1, "P ---- ---- ----");
+  }
+}
+
+/**
+ * Writes lines to display number d, unless it already shows them. Values are
+ * rounded for display, so most refreshes would write the very same text.
+ * Skipping those avoids clearing the display, which makes it flicker, and
+ * bit-banging both lines again.
+ * Must be called with monitor_mutex held.
+ */
+static void monitor_show(struct bmp280_hd44780_monitor *monitor, unsigned int d,
+			 char lines[2][BMP280_MONITOR_LINE_LENGTH + 1]) {
+  if (monitor->shown_valid[d] && !strcmp(lines[0], monitor->shown[d][0]) &&
+      !strcmp(lines[1], monitor->shown[d][1])) {
+    return;
+  }
+  // Retrieve the registered display, identified by its index
+  int display_index = monitor->display_index + d;
+  struct hd44780 *display = hd44780_get(display_index);
+  if (IS_ERR(display)) {
+    pr_err("Failed to retrieve display with index %d: %ld\n",
+	   display_index, PTR_ERR(display));
+    return;
+  }
+  // Clear the display before writing anything
+  hd44780_reset_display(display);
+  // Write the first line to the display
+  hd44780_write(display, lines[0], strlen(lines[0]));
+  // Line break between the two lines
+  hd44780_write(display, "\n", 1);
+  // Write the second line to the display
+  hd44780_write(display, lines[1], strlen(lines[1]));
+  memcpy(monitor->shown[d], lines, sizeof(monitor->shown[d]));
+  monitor->shown_valid[d] = true;
+  // Release the display
+  hd44780_put(display);
+}
+
 /**
  * Monitor worker function.
  *
- * This is where the bulk of the work takes place. This function is responsible
- * for reading and parsing the temperature and pressure values from the BMP280
- * IIO channels, formatting them into human readable messages, retrieving the
- * required hd44780 display instance, and writing the messages to the display.
+ * This is where the bulk of the work takes place. This is the one sampling
+ * pass shared by all sensors and displays: it takes the latest temperature
+ * and pressure values pushed by every BMP280 driver, records them into the
+ * sensor histories, and then, for each display, formats the page it shows
+ * into human readable messages, and writes them to the display.
+ *
+ * We never talk with the sensors here.
  *
  * This function gets scheduled to run periodically, according to the running
- * and refresh_period_ms parameters.
+ * and refresh_period_ms parameters, or for every new scan, in event driven
+ * mode.
  */
 static void bmp280_hd44780_monitor_work(struct work_struct *work) {
   struct delayed_work *dwork = container_of(work, struct delayed_work, work);
   struct bmp280_hd44780_monitor *monitor =
     container_of(dwork, struct bmp280_hd44780_monitor, dwork);
+  s32 temperature[BMP280_MONITOR_MAX_SENSORS];
+  u32 pressure[BMP280_MONITOR_MAX_SENSORS];
+  bool valid[BMP280_MONITOR_MAX_SENSORS];
   mutex_lock(&monitor->monitor_mutex);
-  int status = 0;
-  // Read temperature from the BMP280 IIO channel
-  int temperature = 0, temperature_val2 = 0;
-  status = iio_read_channel_attribute(monitor->temperature_channel,
-				      &temperature, &temperature_val2,
-				      IIO_CHAN_INFO_PROCESSED);
-  if (status < 0) {
-    pr_err("Failed to read temperature value from IIO channel: %d\n", status);
-    goto out;
-  }
-  if (status != IIO_VAL_FRACTIONAL) {
-    pr_err("Unexpected IIO temperature channel type: %d\n", status);
-    goto out;
-  }
-  // Read pressure from the BMP280 IIO channel
-  int pressure = 0, pressure_val2 = 0;
-  status = iio_read_channel_attribute(monitor->pressure_channel,
-				      &pressure, &pressure_val2,
-				      IIO_CHAN_INFO_PROCESSED);
-  if (status < 0) {
-    pr_err("Failed to read pressure value from IIO channel: %d\n", status);
-    goto out;
-  }
-  if (status != IIO_VAL_FRACTIONAL) {
-    pr_err("Unexpected IIO pressure channel type: %d\n", status);
-    goto out;
-  }
-  // Compute integer and decimal parts
-  int temperature_int = temperature / temperature_val2;
-  int temperature_100ths =
-    (100 * (temperature % temperature_val2)) / temperature_val2;
-  // For pressure, use only integer part,
-  // since the number in hPa is already long
-  pressure_val2 *= 100; // Convert from Pascal to hecto-Pascal
-  int pressure_int = pressure / pressure_val2;
-  // Compose formatted string messages
-  char temperature_msg[16];
-  size_t temperature_msg_len =
-    snprintf(temperature_msg, 16, "Temp: %3d.%02d C",
-	     temperature_int, temperature_100ths);
-  char pressure_msg[16];
-  size_t pressure_msg_len =
-    snprintf(pressure_msg, 16, "Pres: %4d hPa", pressure_int);
-  // Retrieve the registered display, identified by display_index
-  struct hd44780 *display = hd44780_get(monitor->display_index);
-  if (IS_ERR(display)) {
-    pr_err("Failed to retrieve display with index %d: %ld\n",
-	   monitor->display_index, PTR_ERR(display));
-    goto out;
+  // Copy the latest values pushed by the BMP280 drivers, all at once
+  spin_lock_irq(&monitor->latest_lock);
+  for (unsigned int i = 0; i < monitor->sensor_count; i++) {
+    valid[i] = monitor->sensors[i].latest_valid;
+    temperature[i] = monitor->sensors[i].latest_temperature;
+    pressure[i] = monitor->sensors[i].latest_pressure;
   }
-  // Clear the display before writing anything
-  hd44780_reset_display(display);
-  // Write the temperature message to the display
-  hd44780_write(display, temperature_msg, temperature_msg_len);
-  // Line break between the two messages
-  hd44780_write(display, "\n", 1);
-  // Write the pressure message to the display
-  hd44780_write(display, pressure_msg, pressure_msg_len);
-  // Release the display
-  hd44780_put(display);
-  display = NULL;
- out:
-  // If we are still running, re-schedule the worker to run again after
-  // refresh_period_ms milliseconds.
-  if (monitor->running) {
-    unsigned long delay = msecs_to_jiffies(monitor->refresh_period_ms);
-    if (!schedule_delayed_work(dwork, delay)) {
-      pr_err("Failed to reschedule worker thread.\n");
-      monitor->running = false;
+  spin_unlock_irq(&monitor->latest_lock);
+  unsigned long now = jiffies;
+  monitor_record_history(monitor, temperature, pressure, valid, now);
+  // Pages: the current values of each sensor, followed by their statistics
+  // when rotating.
+  bool rotating = monitor->page_period_ms != 0;
+  unsigned int pages = monitor->sensor_count * (rotating ? 2 : 1);
+  if (rotating && !time_before(now, monitor->next_page)) {
+    monitor->page = (monitor->page + 1) % pages;
+    monitor->next_page = now + msecs_to_jiffies(monitor->page_period_ms);
+  }
+  for (unsigned int d = 0; d < monitor->display_count; d++) {
+    unsigned int page = (monitor->page + d) % pages;
+    unsigned int index = rotating ? page / 2 : page;
+    struct bmp280_hd44780_monitor_stats stats;
+    monitor_compute_stats(monitor, &monitor->sensors[index], now, &stats);
+    char lines[2][BMP280_MONITOR_LINE_LENGTH + 1];
+    if (rotating && page % 2) {
+      monitor_format_stats_page(&stats, lines);
+    } else {
+      monitor_format_current_page(monitor, index, valid[index],
+				  temperature[index], pressure[index], &stats,
+				  lines);
     }
+    monitor_show(monitor, d, lines);
+  }
+  // If we are still running, and polling, re-schedule the worker to run again
+  // after refresh_period_ms milliseconds. In event driven mode, the next scan
+  // queues us.
+  if (monitor->running && !monitor->event_driven) {
+    unsigned long delay = msecs_to_jiffies(monitor->refresh_period_ms);
+    // Ignore return value, this might fail if a parameter change already
+    // queued the work up again while we waited for the mutex, which is
+    // normal.
+    queue_delayed_work(monitor->wq, dwork, delay);
   }
   mutex_unlock(&monitor->monitor_mutex);
 }
@@ -203,12 +796,54 @@ bmp280_hd44780_monitor_parameter_store(struct device *dev,
 static DEVICE_ATTR(monitor_display_index, 0644,
 		   bmp280_hd44780_monitor_parameter_show,
 		   bmp280_hd44780_monitor_parameter_store);
+static DEVICE_ATTR(monitor_display_count, 0644,
+		   bmp280_hd44780_monitor_parameter_show,
+		   bmp280_hd44780_monitor_parameter_store);
 static DEVICE_ATTR(monitor_refresh_period_ms, 0644,
 		   bmp280_hd44780_monitor_parameter_show,
 		   bmp280_hd44780_monitor_parameter_store);
+static DEVICE_ATTR(monitor_page_period_ms, 0644,
+		   bmp280_hd44780_monitor_parameter_show,
+		   bmp280_hd44780_monitor_parameter_store);
+static DEVICE_ATTR(monitor_window_s, 0644,
+		   bmp280_hd44780_monitor_parameter_show,
+		   bmp280_hd44780_monitor_parameter_store);
 static DEVICE_ATTR(monitor_running, 0644,
 		   bmp280_hd44780_monitor_parameter_show,
 		   bmp280_hd44780_monitor_parameter_store);
+static DEVICE_ATTR(monitor_event_driven, 0644,
+		   bmp280_hd44780_monitor_parameter_show,
+		   bmp280_hd44780_monitor_parameter_store);
+
+static struct device_attribute *bmp280_hd44780_monitor_attrs[] = {
+  &dev_attr_monitor_display_index,
+  &dev_attr_monitor_display_count,
+  &dev_attr_monitor_refresh_period_ms,
+  &dev_attr_monitor_page_period_ms,
+  &dev_attr_monitor_window_s,
+  &dev_attr_monitor_running,
+  &dev_attr_monitor_event_driven,
+};
+
+/**
+ * Removes the sysfs attribute files. Removing files that were never created
+ * does nothing, so this also cleans up after a failed probe.
+ */
+static void monitor_remove_files(struct device *dev) {
+  for (size_t i = 0; i < ARRAY_SIZE(bmp280_hd44780_monitor_attrs); i++) {
+    device_remove_file(dev, bmp280_hd44780_monitor_attrs[i]);
+  }
+}
+
+/**
+ * Makes the next refresh redraw every display in full, e.g. because
+ * something else may have written to them.
+ * Must be called with monitor_mutex held.
+ */
+static void
+monitor_invalidate_displays(struct bmp280_hd44780_monitor *monitor) {
+  memset(monitor->shown_valid, 0, sizeof(monitor->shown_valid));
+}
 
 /**
  * Sysfs device attribute show function.
@@ -223,10 +858,18 @@ bmp280_hd44780_monitor_parameter_show(struct device *dev,
   ssize_t ret = 0;
   if (attr == &dev_attr_monitor_display_index) {
     ret = snprintf(buf, 12, "%d", monitor->display_index);
+  } else if (attr == &dev_attr_monitor_display_count) {
+    ret = snprintf(buf, 11, "%u", monitor->display_count);
   } else if (attr == &dev_attr_monitor_refresh_period_ms) {
     ret = snprintf(buf, 11, "%u", monitor->refresh_period_ms);
+  } else if (attr == &dev_attr_monitor_page_period_ms) {
+    ret = snprintf(buf, 11, "%u", monitor->page_period_ms);
+  } else if (attr == &dev_attr_monitor_window_s) {
+    ret = snprintf(buf, 11, "%u", monitor->window_s);
   } else if (attr == &dev_attr_monitor_running) {
     ret = snprintf(buf, 2, "%d", monitor->running ? 1 : 0);
+  } else if (attr == &dev_attr_monitor_event_driven) {
+    ret = snprintf(buf, 2, "%d", monitor->event_driven ? 1 : 0);
   } else {
     ret = -EINVAL;
   }
@@ -255,18 +898,54 @@ bmp280_hd44780_monitor_parameter_store(struct device *dev,
   memset(str, 0, sizeof(str));
   memcpy(str, buf, count);
   ssize_t ret = 0;
+  // Whether to run the next refresh right away, if currently running, so we
+  // don't have to wait for the old refresh period.
+  bool refresh = false;
   if (attr == &dev_attr_monitor_display_index) {
     // base=0 means autodetect base
     ret = kstrtos32(str, /*base=*/0, &monitor->display_index);
+    // Whatever those displays show, it is not our last lines.
+    monitor_invalidate_displays(monitor);
+    refresh = ret == 0;
+  } else if (attr == &dev_attr_monitor_display_count) {
+    u32 value;
+    // base=0 means autodetect base
+    ret = kstrtou32(str, /*base=*/0, &value);
+    if (ret == 0 && (value < 1 || value > BMP280_MONITOR_MAX_DISPLAYS)) {
+      ret = -EINVAL;
+    }
+    if (ret == 0) {
+      monitor->display_count = value;
+      monitor_invalidate_displays(monitor);
+      refresh = true;
+    }
   } else if (attr == &dev_attr_monitor_refresh_period_ms) {
     // base=0 means autodetect base
     ret = kstrtou32(str, /*base=*/0, &monitor->refresh_period_ms);
-    // If currently running, run the next refresh right away, so we don't have
-    // to wait for the old refresh period.
-    if (ret == 0 && monitor->running) {
-      // Ignore return value, this might fail if the the work is already queued
-      // up for running, which is normal.
-      schedule_delayed_work(&monitor->dwork, /*delay=*/0);
+    refresh = ret == 0;
+  } else if (attr == &dev_attr_monitor_page_period_ms) {
+    // base=0 means autodetect base
+    ret = kstrtou32(str, /*base=*/0, &monitor->page_period_ms);
+    if (ret == 0) {
+      // Page numbers mean something else with or without rotation, so start
+      // over from the first page.
+      monitor->page = 0;
+      monitor->next_page =
+	jiffies + msecs_to_jiffies(monitor->page_period_ms);
+      refresh = true;
+    }
+  } else if (attr == &dev_attr_monitor_window_s) {
+    u32 value;
+    // base=0 means autodetect base
+    ret = kstrtou32(str, /*base=*/0, &value);
+    if (ret == 0 && (value == 0 || value > BMP280_MONITOR_MAX_WINDOW_S)) {
+      ret = -EINVAL;
+    }
+    if (ret == 0) {
+      // Entries are spaced for the old window, start over.
+      monitor->window_s = value;
+      monitor_clear_history(monitor);
+      refresh = true;
     }
   } else if (attr == &dev_attr_monitor_running) {
     s32 value = monitor->running;
@@ -274,20 +953,43 @@ bmp280_hd44780_monitor_parameter_store(struct device *dev,
     ret = kstrtos32(str, /*base=*/0, &value);
     if (ret == 0) {
       if (value == 0) {
-	// Stop running
-	monitor->running = false;
+	// Stop running, and release the BMP280 buffers, so their
+	// configuration can be changed again. New scans would queue the worker
+	// again, so stop those first.
+	WRITE_ONCE(monitor->running, false);
+	monitor_set_capturing(monitor, false);
 	cancel_delayed_work(&monitor->dwork);
       } else {
-	// Either start running again, or run the next refresh right away.
-	monitor->running = true;
-	// Ignore return value, this might fail if the the work is already queued
-	// up for running, which is normal.
-	schedule_delayed_work(&monitor->dwork, /*delay=*/0);
+	ret = monitor_set_capturing(monitor, true);
+	if (ret == 0) {
+	  // Either start running again, or run the next refresh right away.
+	  // Redraw in full, in case something else wrote to the displays.
+	  WRITE_ONCE(monitor->running, true);
+	  monitor_invalidate_displays(monitor);
+	  refresh = true;
+	}
+      }
+    }
+  } else if (attr == &dev_attr_monitor_event_driven) {
+    s32 value = monitor->event_driven;
+    // base=0 means autodetect base
+    ret = kstrtos32(str, /*base=*/0, &value);
+    if (ret == 0) {
+      WRITE_ONCE(monitor->event_driven, value != 0);
+      // Refresh right away: either to stop waiting for a polling period, or
+      // to start polling again.
+      if (monitor->running) {
+	mod_delayed_work(monitor->wq, &monitor->dwork, /*delay=*/0);
       }
     }
   } else {
     ret = -EINVAL;
   }
+  if (refresh && monitor->running) {
+    // Ignore return value, this might fail if the the work is already queued
+    // up for running, which is normal.
+    queue_delayed_work(monitor->wq, &monitor->dwork, /*delay=*/0);
+  }
   mutex_unlock(&monitor->monitor_mutex);
   if (ret == 0) {
     ret = count;
@@ -298,9 +1000,10 @@ bmp280_hd44780_monitor_parameter_store(struct device *dev,
 /**
  * Monitor platform driver probe method.
  *
- * Allocates and initializes an instance of our monitor, retrieves references to
- * the BMP280 IIO channels, creates the sysfs attribute files, and start our
- * worker thread (as a system default workqueue entry).
+ * Allocates and initializes an instance of our monitor, sets up a callback
+ * buffer on the BMP280 IIO channels of each sensor, creates the sysfs
+ * attribute files, starts consuming the buffers, and starts our worker thread
+ * (as a system default workqueue entry, unless dedicated_workqueue is set).
  */
 static int bmp280_hd44780_monitor_probe(struct platform_device *pdev) {
   pr_info("Probing bmp280-hd44780-monitor platform driver.\n");
@@ -312,52 +1015,51 @@ static int bmp280_hd44780_monitor_probe(struct platform_device *pdev) {
   }
   monitor_init(monitor);
   int ret = 0;
-  // Attempt to retrieve temperature channel as a device property
-  monitor->temperature_channel =
-    devm_iio_channel_get(&pdev->dev, "temperature");
-  if (IS_ERR(monitor->temperature_channel)) {
-    pr_err("Failed to acquire IIO temperature channel with error %ld. "
-	   "Aborting probe.\n", PTR_ERR(monitor->temperature_channel));
-    ret = PTR_ERR(monitor->temperature_channel);
-    goto out_fail;
+  if (dedicated_workqueue) {
+    monitor->wq = alloc_workqueue("bmp280-hd44780-monitor",
+				  WQ_HIGHPRI | WQ_UNBOUND, 0);
+    if (!monitor->wq) {
+      pr_err("Failed to allocate workqueue. Aborting probe.\n");
+      monitor->wq = system_wq;
+      ret = -ENOMEM;
+      goto out_fail;
+    }
   }
-  // Attempt to retrieve pressure channel as a device property
-  monitor->pressure_channel =
-    devm_iio_channel_get(&pdev->dev, "pressure");
-  if (IS_ERR(monitor->pressure_channel)) {
-    pr_err("Failed to acquire IIO pressure channel with error %ld. "
-	   "Aborting probe.\n", PTR_ERR(monitor->pressure_channel));
-    ret = PTR_ERR(monitor->pressure_channel);
+  // Attempt to set up a callback buffer for each sensor, over the channels in
+  // its io-channels property: processed temperature and pressure.
+  ret = monitor_setup_sensors(monitor, &pdev->dev);
+  if (ret) {
+    pr_err("Failed to set up sensors with error %d. Aborting probe.\n", ret);
     goto out_fail;
   }
   // Make our context structure available from this device
   dev_set_drvdata(&pdev->dev, monitor);
   // Setup sysfs files for driver runtime control
-  ret = device_create_file(&pdev->dev, &dev_attr_monitor_display_index);
-  if (ret) {
-    goto out_fail;
-  }
-  ret = device_create_file(&pdev->dev, &dev_attr_monitor_refresh_period_ms);
-  if (ret) {
-    goto out_fail;
+  for (size_t i = 0; i < ARRAY_SIZE(bmp280_hd44780_monitor_attrs); i++) {
+    ret = device_create_file(&pdev->dev, bmp280_hd44780_monitor_attrs[i]);
+    if (ret) {
+      goto out_fail;
+    }
   }
-  ret = device_create_file(&pdev->dev, &dev_attr_monitor_running);
+  // Start consuming the BMP280 buffers
+  mutex_lock(&monitor->monitor_mutex);
+  ret = monitor_set_capturing(monitor, true);
+  mutex_unlock(&monitor->monitor_mutex);
   if (ret) {
     goto out_fail;
   }
   // Start our monitor worker thread
-  if (!schedule_delayed_work(&monitor->dwork, /*delay=*/0)) {
+  if (!queue_delayed_work(monitor->wq, &monitor->dwork, /*delay=*/0)) {
     pr_err("Failed to schedule worker thread. Aborting probe.\n");
     ret = -EFAULT;
     goto out_fail;
   }
-  pr_info("Successfully probed bmp280-hd44780-monitor platform driver.\n");
+  pr_info("Successfully probed bmp280-hd44780-monitor platform driver, "
+	  "with %u sensors.\n", monitor->sensor_count);
   return 0;
  out_fail:
-  device_remove_file(&pdev->dev, &dev_attr_monitor_display_index);
-  device_remove_file(&pdev->dev, &dev_attr_monitor_refresh_period_ms);
-  device_remove_file(&pdev->dev, &dev_attr_monitor_running);
-  monitor_teardown(monitor);
+  monitor_remove_files(&pdev->dev);
+  monitor_teardown(monitor, &pdev->dev);
   return ret;
 }
 
@@ -367,11 +1069,9 @@ static int bmp280_hd44780_monitor_probe(struct platform_device *pdev) {
  * Stops the driver worker thread.
  */
 static void bmp280_hd44780_monitor_remove(struct platform_device *pdev) {
-  device_remove_file(&pdev->dev, &dev_attr_monitor_display_index);
-  device_remove_file(&pdev->dev, &dev_attr_monitor_refresh_period_ms);
-  device_remove_file(&pdev->dev, &dev_attr_monitor_running);
+  monitor_remove_files(&pdev->dev);
   struct bmp280_hd44780_monitor *monitor = dev_get_drvdata(&pdev->dev);
-  monitor_teardown(monitor);
+  monitor_teardown(monitor, &pdev->dev);
   pr_info("Successfully removed bmp280-hd44780-monitor platform driver.\n");
 }
 
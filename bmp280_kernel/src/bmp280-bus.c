@@ -0,0 +1,429 @@
+/**
+ * This file coordinates sensors sharing an I2C adapter.
+ * Every adapter with at least one of our sensors gets a group, and the group
+ * gets its own IIO trigger, named after the adapter (e.g., `bmp280-i2c-1`).
+ * Any sensor on that adapter can use it. On each trigger event, whichever
+ * sensor's trigger handler runs first reads every sensor in the group back to
+ * back, while holding all their bus mutexes, and stamps all the samples with
+ * the same timestamp. Where the adapter supports plain I2C messages, the
+ * whole group is read in a single `i2c_transfer`, one register write plus
+ * one 6 bytes read per sensor, joined by repeated starts. The other sensors'
+ * handlers then pick up the sample read for them.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/i2c.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/lockdep.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/regmap.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+
+#include "bmp280.h"
+
+/**
+ * Group of sensors sharing an I2C adapter.
+ * lock protects the member list, the messages, read_generation and
+ * period_ns, as well as the group's share of each member (see struct
+ * bmp280_bus_member). When reading the group, it is taken before the
+ * members' bus mutexes.
+ * fired counts trigger events, and read_generation is the last event the
+ * group was read for. Each event is read once, by the first handler to see
+ * it.
+ * msgs holds two I2C messages per member, for groups read with a single
+ * i2c_transfer.
+ */
+struct bmp280_bus_group {
+  struct list_head node;
+  struct kref ref;
+  struct i2c_adapter *adapter;
+  bool use_transfer;
+  struct mutex lock;
+  struct list_head members;
+  u32 member_count;
+  struct i2c_msg *msgs;
+  struct iio_trigger *trig;
+  struct hrtimer timer;
+  atomic_t fired;
+  u32 read_generation;
+  u32 period_ns;
+};
+
+/**
+ * Every group, one per I2C adapter with at least one of our sensors.
+ * bmp280_bus_groups_lock protects the list, and the groups' reference counts.
+ */
+static LIST_HEAD(bmp280_bus_groups);
+static DEFINE_MUTEX(bmp280_bus_groups_lock);
+
+static enum hrtimer_restart bmp280_bus_timer_fn(struct hrtimer *timer);
+static int bmp280_bus_trigger_set_state(struct iio_trigger *trig, bool state);
+static int bmp280_bus_trigger_validate_device(struct iio_trigger *trig,
+					      struct iio_dev *indio_dev);
+static void leave_bmp280_bus_group(void *data);
+
+/**
+ * Shared trigger hooks. Only sensors in the group can use its trigger.
+ */
+static const struct iio_trigger_ops bmp280_bus_trigger_ops = {
+  .set_trigger_state = bmp280_bus_trigger_set_state,
+  .validate_device = bmp280_bus_trigger_validate_device,
+};
+
+/**
+ * Allocates a group for an adapter, and registers its trigger.
+ * Must be called with bmp280_bus_groups_lock held.
+ */
+static struct bmp280_bus_group *
+create_bmp280_bus_group(struct i2c_adapter *adapter) {
+  struct bmp280_bus_group *group = kzalloc(sizeof(*group), GFP_KERNEL);
+  if (!group) {
+    return ERR_PTR(-ENOMEM);
+  }
+  kref_init(&group->ref);
+  group->adapter = adapter;
+  // Plain I2C messages are needed to read several sensors in one transfer.
+  // SMBus-only adapters fall back to one block read per sensor.
+  group->use_transfer = i2c_check_functionality(adapter, I2C_FUNC_I2C);
+  mutex_init(&group->lock);
+  INIT_LIST_HEAD(&group->members);
+  atomic_set(&group->fired, 0);
+  hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  group->timer.function = bmp280_bus_timer_fn;
+  group->trig = iio_trigger_alloc(&adapter->dev, "bmp280-%s",
+				  dev_name(&adapter->dev));
+  if (!group->trig) {
+    kfree(group);
+    return ERR_PTR(-ENOMEM);
+  }
+  group->trig->ops = &bmp280_bus_trigger_ops;
+  iio_trigger_set_drvdata(group->trig, group);
+  int status = iio_trigger_register(group->trig);
+  if (status) {
+    pr_err("Failed to register shared trigger for %s.\n",
+	   dev_name(&adapter->dev));
+    iio_trigger_free(group->trig);
+    kfree(group);
+    return ERR_PTR(status);
+  }
+  list_add(&group->node, &bmp280_bus_groups);
+  return group;
+}
+
+/**
+ * Frees a group once its last sensor left.
+ * Called with bmp280_bus_groups_lock held.
+ */
+static void release_bmp280_bus_group(struct kref *ref) {
+  struct bmp280_bus_group *group =
+    container_of(ref, struct bmp280_bus_group, ref);
+  list_del(&group->node);
+  hrtimer_cancel(&group->timer);
+  iio_trigger_unregister(group->trig);
+  iio_trigger_free(group->trig);
+  kfree(group->msgs);
+  kfree(group);
+}
+
+int join_bmp280_bus_group(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_bus_member *member = &bmp280->bus;
+  member->group = NULL;
+  if (!bmp280->client) {
+    // SPI sensors each have their own chip select, there is nothing to share.
+    return 0;
+  }
+  struct i2c_adapter *adapter = bmp280->client->adapter;
+  int status = 0;
+  mutex_lock(&bmp280_bus_groups_lock);
+  struct bmp280_bus_group *group = NULL;
+  struct bmp280_bus_group *entry;
+  list_for_each_entry(entry, &bmp280_bus_groups, node) {
+    if (entry->adapter == adapter) {
+      group = entry;
+      kref_get(&group->ref);
+      break;
+    }
+  }
+  if (!group) {
+    group = create_bmp280_bus_group(adapter);
+    if (IS_ERR(group)) {
+      status = PTR_ERR(group);
+      goto out;
+    }
+  }
+  mutex_lock(&group->lock);
+  if (group->use_transfer) {
+    struct i2c_msg *msgs = krealloc_array(group->msgs,
+					  2 * (group->member_count + 1),
+					  sizeof(*msgs), GFP_KERNEL);
+    if (!msgs) {
+      mutex_unlock(&group->lock);
+      kref_put(&group->ref, release_bmp280_bus_group);
+      status = -ENOMEM;
+      goto out;
+    }
+    group->msgs = msgs;
+  }
+  member->group = group;
+  member->indio_dev = indio_dev;
+  member->batched = false;
+  member->generation = 0;
+  member->reg = BMP280_DATA_BLOCK_REG_ADDRESS;
+  list_add_tail(&member->node, &group->members);
+  group->member_count++;
+  mutex_unlock(&group->lock);
+ out:
+  mutex_unlock(&bmp280_bus_groups_lock);
+  if (status) {
+    return status;
+  }
+  return devm_add_action_or_reset(&bmp280->client->dev,
+				  leave_bmp280_bus_group, member);
+}
+
+/**
+ * Removes a sensor from its group, when its device is removed.
+ */
+static void leave_bmp280_bus_group(void *data) {
+  struct bmp280_bus_member *member = data;
+  struct bmp280_bus_group *group = member->group;
+  mutex_lock(&bmp280_bus_groups_lock);
+  mutex_lock(&group->lock);
+  list_del(&member->node);
+  group->member_count--;
+  mutex_unlock(&group->lock);
+  kref_put(&group->ref, release_bmp280_bus_group);
+  mutex_unlock(&bmp280_bus_groups_lock);
+}
+
+bool using_bmp280_bus_trigger(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  return indio_dev->trig && bmp280->bus.group &&
+    indio_dev->trig == bmp280->bus.group->trig;
+}
+
+void set_bmp280_bus_batched(struct iio_dev *indio_dev, bool batched) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_bus_member *member = &bmp280->bus;
+  if (!member->group) {
+    return;
+  }
+  mutex_lock(&member->group->lock);
+  member->batched = batched;
+  member->generation = 0;
+  mutex_unlock(&member->group->lock);
+}
+
+/**
+ * Time between trigger events. The slowest sensor in the group sets the pace,
+ * so every sensor has a new sample for each event.
+ * Must be called with the group's lock held.
+ */
+static u32 compute_bmp280_bus_period_ns(struct bmp280_bus_group *group) {
+  u32 period_us = 0;
+  struct bmp280_bus_member *member;
+  list_for_each_entry(member, &group->members, node) {
+    struct bmp280_config config;
+    get_bmp280_config(iio_priv(member->indio_dev), &config);
+    period_us = max(period_us, compute_bmp280_sampling_period_us(&config));
+  }
+  return period_us * NSEC_PER_USEC;
+}
+
+/**
+ * Timer callback. Counts a new event, and fires the shared trigger.
+ */
+static enum hrtimer_restart bmp280_bus_timer_fn(struct hrtimer *timer) {
+  struct bmp280_bus_group *group =
+    container_of(timer, struct bmp280_bus_group, timer);
+  atomic_inc(&group->fired);
+  iio_trigger_poll(group->trig);
+  hrtimer_forward_now(timer, ns_to_ktime(READ_ONCE(group->period_ns)));
+  return HRTIMER_RESTART;
+}
+
+/**
+ * Starts the timer when the first sensor starts capturing on the shared
+ * trigger, and stops it after the last one stops.
+ */
+static int bmp280_bus_trigger_set_state(struct iio_trigger *trig, bool state) {
+  struct bmp280_bus_group *group = iio_trigger_get_drvdata(trig);
+  if (!state) {
+    hrtimer_cancel(&group->timer);
+    return 0;
+  }
+  mutex_lock(&group->lock);
+  WRITE_ONCE(group->period_ns, compute_bmp280_bus_period_ns(group));
+  mutex_unlock(&group->lock);
+  hrtimer_start(&group->timer, ns_to_ktime(group->period_ns),
+		HRTIMER_MODE_REL);
+  return 0;
+}
+
+/**
+ * Only lets sensors in the group use its trigger. We look the device up in
+ * the member list, rather than at its private data, since any IIO device can
+ * ask.
+ */
+static int bmp280_bus_trigger_validate_device(struct iio_trigger *trig,
+					      struct iio_dev *indio_dev) {
+  struct bmp280_bus_group *group = iio_trigger_get_drvdata(trig);
+  int status = -EINVAL;
+  mutex_lock(&group->lock);
+  struct bmp280_bus_member *member;
+  list_for_each_entry(member, &group->members, node) {
+    if (member->indio_dev == indio_dev) {
+      status = 0;
+      break;
+    }
+  }
+  mutex_unlock(&group->lock);
+  return status;
+}
+
+/**
+ * Reads every batched sensor in the group, back to back.
+ * Takes every member's bus mutex first, so no other transfer gets in between,
+ * and all samples are taken within the same short window. Sensors that failed
+ * to be read keep their old generation, and are read on their own by their
+ * handler.
+ * Must be called with the group's lock held.
+ */
+static void read_bmp280_bus_group(struct bmp280_bus_group *group,
+				  struct iio_dev *leader, u32 generation) {
+  lockdep_assert_held(&group->lock);
+  struct bmp280_bus_member *member;
+  list_for_each_entry(member, &group->members, node) {
+    if (member->batched) {
+      struct bmp280_ctx *bmp280 = iio_priv(member->indio_dev);
+      mutex_lock_nest_lock(&bmp280->lock, &group->lock);
+    }
+  }
+  int n = 0;
+  list_for_each_entry(member, &group->members, node) {
+    if (!member->batched) {
+      continue;
+    }
+    struct bmp280_ctx *bmp280 = iio_priv(member->indio_dev);
+    // A faulted sensor would fail the combined transfer for everyone. It
+    // reads on its own instead, which fails fast or re-probes it.
+    if (bmp280->health.faulted) {
+      continue;
+    }
+    // Forced mode sensors run their conversion first, one after the other.
+    int status = prepare_bmp280_sample(bmp280);
+    if (status) {
+      continue;
+    }
+    if (!group->use_transfer) {
+      status = read_bmp280_regs(bmp280, member->reg, member->block,
+				BMP280_DATA_BLOCK_LENGTH);
+      if (status) {
+	continue;
+      }
+    } else {
+      group->msgs[n++] = (struct i2c_msg){
+	.addr = bmp280->client->addr,
+	.flags = 0,
+	.len = 1,
+	.buf = &member->reg,
+      };
+      group->msgs[n++] = (struct i2c_msg){
+	.addr = bmp280->client->addr,
+	.flags = I2C_M_RD,
+	.len = BMP280_DATA_BLOCK_LENGTH,
+	.buf = member->block,
+      };
+    }
+    member->generation = generation;
+  }
+  // Every sensor in a combined transfer waits for all of it, so each of them
+  // gets the whole transfer time as its own.
+  u64 transfer_ns = 0;
+  if (n) {
+    u64 start_ns = bmp280_stats_clock();
+    int done = i2c_transfer(group->adapter, group->msgs, n);
+    transfer_ns = bmp280_stats_clock() - start_ns;
+    int status = done == n ? 0 : done < 0 ? done : -EIO;
+    // We cannot tell whose part failed, so every sensor in the transfer
+    // counts the error, like any read of its own. Each of them then reads on
+    // its own, which retries, and clears its failures if the sensor is fine.
+    list_for_each_entry(member, &group->members, node) {
+      if (member->batched && member->generation == generation) {
+	account_bmp280_transfer(iio_priv(member->indio_dev), member->reg,
+				BMP280_DATA_BLOCK_LENGTH, status);
+      }
+    }
+    if (status) {
+      pr_err_ratelimited("Group read on %s failed: %d\n",
+			 dev_name(&group->adapter->dev), done);
+      list_for_each_entry(member, &group->members, node) {
+	member->generation = 0;
+      }
+    }
+  }
+  // One timestamp for the whole group. Sensors using a different clock than
+  // the leader get their own.
+  s64 timestamp = iio_get_time_ns(leader);
+  clockid_t clock = iio_device_get_clock(leader);
+  list_for_each_entry(member, &group->members, node) {
+    if (!member->batched) {
+      continue;
+    }
+    struct bmp280_ctx *bmp280 = iio_priv(member->indio_dev);
+    if (member->generation == generation) {
+      // Bus bytes are counted by account_bmp280_transfer on both paths,
+      // directly, or through read_bmp280_regs.
+      if (group->use_transfer) {
+	record_bmp280_latency(bmp280, BMP280_LATENCY_TRANSFER, transfer_ns);
+      }
+      decode_bmp280_sample(member->block, &member->sample);
+      publish_bmp280_sample(bmp280, &member->sample);
+      member->timestamp = iio_device_get_clock(member->indio_dev) == clock ?
+	timestamp : iio_get_time_ns(member->indio_dev);
+    }
+    mutex_unlock(&bmp280->lock);
+  }
+}
+
+int read_bmp280_bus_sample(struct iio_dev *indio_dev,
+			   struct bmp280_raw_sample *sample, s64 *timestamp) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_bus_member *member = &bmp280->bus;
+  struct bmp280_bus_group *group = member->group;
+  mutex_lock(&group->lock);
+  u32 fired = atomic_read(&group->fired);
+  if (group->read_generation != fired) {
+    // First handler for this event: read the whole group.
+    read_bmp280_bus_group(group, indio_dev, fired);
+    group->read_generation = fired;
+    // Members may have been reconfigured between captures.
+    WRITE_ONCE(group->period_ns, compute_bmp280_bus_period_ns(group));
+  }
+  bool found = member->batched && member->generation == fired;
+  if (found) {
+    *sample = member->sample;
+    *timestamp = member->timestamp;
+    // Each sample is handed out once.
+    member->generation = 0;
+  }
+  mutex_unlock(&group->lock);
+  if (found) {
+    return 0;
+  }
+  // Not part of the group read, or it failed. Read on our own.
+  return read_bmp280_raw_sample(bmp280, sample);
+}
@@ -0,0 +1,217 @@
+/**
+ * This file implements the KUnit suite of the compensation formulas, the
+ * in-kernel counterpart of tools/bmp280-compensate-test.c, so the formulas
+ * are also checked as the kernel builds them, e.g. with its 64 bit math
+ * helpers on 32 bit CPUs. It builds as its own module, only for kernels with
+ * KUnit, and runs when loaded. It checks every engine against the datasheet's
+ * example, sweeps a grid over the operating range, and fuzzes the calibration
+ * values and raw readings: s32 must stay within a few Pascals of s64. Like
+ * the userspace tests, it sticks to calibrations within the datasheet's
+ * ranges, and raw readings over the operating range, where the formulas must
+ * not overflow, so it also runs clean on kernels with UBSAN.
+ */
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/math.h>
+#include <linux/module.h>
+#include <linux/types.h>
+
+// The suite builds its own copy of the formulas, so the driver module does
+// not have to export them.
+#include "bmp280-compensate.c"
+
+/**
+ * Calibration of the datasheet's example, Section 3.12, and its raw readings,
+ * without the LS 4 padding bits. It compensates to 25.08 C, and 100653.25 Pa
+ * with the 64 bit formula, in 1/256 Pa, or 100656 Pa with the 32 bit one.
+ */
+static const struct bmp280_calibration bmp280_kunit_calibration = {
+  .dig_T = { 27504, 26435, (u16)-1000 },
+  .dig_P = { 36477, (u16)-10685, 3024, 2855, 140, (u16)-7, 15500,
+	     (u16)-14600, 6000 },
+};
+#define BMP280_KUNIT_RAW_TEMP 519888
+#define BMP280_KUNIT_RAW_PRESS 415148
+#define BMP280_KUNIT_TEMP 2508
+#define BMP280_KUNIT_PRESS_S64 25767233
+#define BMP280_KUNIT_PRESS_S32 (100656 << 8)
+
+/**
+ * Raw value ranges swept by test_bmp280_grid, and fuzzed by test_bmp280_fuzz,
+ * without the LS 4 padding bits.
+ * They cover about -40 to 85 degrees Celcius, and 300 to 1100 hPa, for
+ * typical calibration values.
+ */
+#define BMP280_KUNIT_RAW_TEMP_MIN 0x58000
+#define BMP280_KUNIT_RAW_TEMP_MAX 0x98000
+#define BMP280_KUNIT_RAW_PRESS_MIN 0x30000
+#define BMP280_KUNIT_RAW_PRESS_MAX 0xa0000
+#define BMP280_KUNIT_GRID_STEPS 16
+
+/**
+ * The most s32 may differ from s64 within the operating range, in 1/256
+ * Pascal.
+ */
+#define BMP280_KUNIT_S32_TOLERANCE (8 << 8)
+
+/**
+ * Fuzzed calibrations, and raw samples compensated with each.
+ */
+#define BMP280_KUNIT_CALIBRATIONS 256
+#define BMP280_KUNIT_SAMPLES_PER_CALIBRATION 64
+
+/**
+ * splitmix64, so every run fuzzes the same values.
+ */
+static u64 next_bmp280_kunit_random(u64 *state) {
+  u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Compensates one raw sample with both engines, and checks s32 against the
+ * reference one. s32 is only held to BMP280_KUNIT_S32_TOLERANCE within the
+ * operating range.
+ */
+static void check_bmp280_kunit_engines(struct kunit *test,
+				       const struct bmp280_coeffs *coeffs,
+				       s32 raw_temp, s32 raw_press) {
+  u32 reference = compensate_bmp280_raw_pressure(
+    coeffs, BMP280_PRESSURE_COMPENSATION_S64, raw_temp, raw_press);
+  s32 temp = compensate_bmp280_raw_temperature(coeffs, raw_temp);
+  if (temp < -4000 || temp > 8500 || reference / 256 < 30000 ||
+      reference / 256 > 110000) {
+    return;
+  }
+  u32 s32_press = compensate_bmp280_raw_pressure(
+    coeffs, BMP280_PRESSURE_COMPENSATION_S32, raw_temp, raw_press);
+  u32 diff = s32_press > reference ?
+    s32_press - reference : reference - s32_press;
+  KUNIT_EXPECT_LE_MSG(test, diff, BMP280_KUNIT_S32_TOLERANCE,
+		      "raw 0x%x 0x%x", raw_temp, raw_press);
+}
+
+static void test_bmp280_datasheet_example(struct kunit *test) {
+  static const u32 expected[] = {
+    [BMP280_PRESSURE_COMPENSATION_S64] = BMP280_KUNIT_PRESS_S64,
+    [BMP280_PRESSURE_COMPENSATION_S32] = BMP280_KUNIT_PRESS_S32,
+  };
+  struct bmp280_coeffs coeffs;
+  compute_bmp280_coeffs(&bmp280_kunit_calibration, &coeffs);
+  s32 raw_temp = BMP280_KUNIT_RAW_TEMP << 4;
+  s32 raw_press = BMP280_KUNIT_RAW_PRESS << 4;
+  KUNIT_EXPECT_EQ(test, compensate_bmp280_raw_temperature(&coeffs, raw_temp),
+		  BMP280_KUNIT_TEMP);
+  for (int engine = 0; engine < ARRAY_SIZE(expected); engine++) {
+    KUNIT_EXPECT_EQ_MSG(test,
+			compensate_bmp280_raw_pressure(&coeffs, engine,
+						       raw_temp, raw_press),
+			expected[engine], "engine %d", engine);
+    s32 temp;
+    u32 press;
+    compensate_bmp280_batch(&coeffs, engine, &raw_temp, &raw_press, &temp,
+			    &press, 1);
+    KUNIT_EXPECT_EQ_MSG(test, temp, BMP280_KUNIT_TEMP, "engine %d", engine);
+    KUNIT_EXPECT_EQ_MSG(test, press, expected[engine], "engine %d", engine);
+  }
+}
+
+static void test_bmp280_grid(struct kunit *test) {
+  struct bmp280_coeffs coeffs;
+  compute_bmp280_coeffs(&bmp280_kunit_calibration, &coeffs);
+  for (int t = 0; t < BMP280_KUNIT_GRID_STEPS; t++) {
+    for (int p = 0; p < BMP280_KUNIT_GRID_STEPS; p++) {
+      s32 raw_temp = BMP280_KUNIT_RAW_TEMP_MIN +
+	(BMP280_KUNIT_RAW_TEMP_MAX - BMP280_KUNIT_RAW_TEMP_MIN) * t /
+	(BMP280_KUNIT_GRID_STEPS - 1);
+      s32 raw_press = BMP280_KUNIT_RAW_PRESS_MIN +
+	(BMP280_KUNIT_RAW_PRESS_MAX - BMP280_KUNIT_RAW_PRESS_MIN) * p /
+	(BMP280_KUNIT_GRID_STEPS - 1);
+      check_bmp280_kunit_engines(test, &coeffs, raw_temp << 4,
+				 raw_press << 4);
+    }
+  }
+}
+
+/**
+ * Calibrations within the datasheet's ranges, each word within 1/8 of the
+ * example's, which real sensors stay well within.
+ */
+static void test_bmp280_fuzz(struct kunit *test) {
+  const struct bmp280_calibration *base = &bmp280_kunit_calibration;
+  u64 state = 1;
+  for (int c = 0; c < BMP280_KUNIT_CALIBRATIONS; c++) {
+    struct bmp280_calibration calib;
+    for (int i = 0; i < 12; i++) {
+      const u16 *words = i < 3 ? base->dig_T : base->dig_P;
+      int index = i < 3 ? i : i - 3;
+      s32 value = bmp280_calibration_value(words, index);
+      s32 spread = abs(value) / 8;
+      u16 word = value + (s32)((u32)next_bmp280_kunit_random(&state) %
+			       (2 * spread + 1)) - spread;
+      if (i < 3) {
+	calib.dig_T[index] = word;
+      } else {
+	calib.dig_P[index] = word;
+      }
+    }
+    struct bmp280_coeffs coeffs;
+    compute_bmp280_coeffs(&calib, &coeffs);
+    for (int i = 0; i < BMP280_KUNIT_SAMPLES_PER_CALIBRATION; i++) {
+      s32 raw_temp = BMP280_KUNIT_RAW_TEMP_MIN +
+	(u32)next_bmp280_kunit_random(&state) %
+	(BMP280_KUNIT_RAW_TEMP_MAX - BMP280_KUNIT_RAW_TEMP_MIN + 1);
+      s32 raw_press = BMP280_KUNIT_RAW_PRESS_MIN +
+	(u32)next_bmp280_kunit_random(&state) %
+	(BMP280_KUNIT_RAW_PRESS_MAX - BMP280_KUNIT_RAW_PRESS_MIN + 1);
+      check_bmp280_kunit_engines(test, &coeffs, raw_temp << 4,
+				 raw_press << 4);
+    }
+  }
+}
+
+/**
+ * Altitudes of a few pressures, against the barometric formula worked out
+ * in floating point, and pressures of 0.
+ */
+static void test_bmp280_altitude(struct kunit *test) {
+  static const struct {
+    u32 press;
+    u32 reference_press;
+    s32 altitude;
+  } cases[] = {
+    { BMP280_KUNIT_PRESS_S64, 101325, 56077 },
+    { 30000 << 8, 101325, 9165156 },
+    { 110000 << 8, 101325, -698420 },
+    { 101325 << 8, 101325, 0 },
+  };
+  for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+    s32 altitude = compute_bmp280_altitude(cases[i].press,
+					   cases[i].reference_press);
+    KUNIT_EXPECT_LE_MSG(test, abs(altitude - cases[i].altitude), 5,
+			"%u/256 Pa gives %d mm", cases[i].press, altitude);
+  }
+  KUNIT_EXPECT_EQ(test, compute_bmp280_altitude(0, 101325),
+		  BMP280_ALTITUDE_UNDEFINED);
+  KUNIT_EXPECT_EQ(test, compute_bmp280_altitude(101325 << 8, 0),
+		  BMP280_ALTITUDE_UNDEFINED);
+}
+
+static struct kunit_case bmp280_compensate_cases[] = {
+  KUNIT_CASE(test_bmp280_datasheet_example),
+  KUNIT_CASE(test_bmp280_grid),
+  KUNIT_CASE(test_bmp280_fuzz),
+  KUNIT_CASE(test_bmp280_altitude),
+  {}
+};
+
+static struct kunit_suite bmp280_compensate_suite = {
+  .name = "bmp280-compensate",
+  .test_cases = bmp280_compensate_cases,
+};
+kunit_test_suite(bmp280_compensate_suite);
+
+MODULE_DESCRIPTION("KUnit tests of the BMP280 compensation formulas");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,251 @@
+/**
+ * This file implements the compensation formulas described in the datasheet,
+ * the batch compensation of raw samples, and the conversion of pressure to
+ * altitude.
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
+ * (Section 3.11.3 - Compensation formula)
+ * Nothing here talks with the sensor or takes a lock, and the file only
+ * depends on the kernel for its 64 bit math helpers, so it also builds in
+ * userspace, with the fallbacks below.
+ * Values that can be negative are scaled up with multiplications rather than
+ * the datasheet's left shifts, which are undefined for negative values in C.
+ * Both compile to the same shifts.
+ */
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#include <linux/stddef.h>
+#include <linux/types.h>
+#endif
+
+#include "bmp280-compensate.h"
+
+#ifndef __KERNEL__
+static inline s64 div64_s64(s64 dividend, s64 divisor) {
+  return dividend / divisor;
+}
+#endif
+
+/**
+ * Derives the constants used by the compensation formulas from the
+ * calibration values. Every shift the datasheet formulas apply to a
+ * calibration value alone is done here, once, rather than on every sample.
+ */
+void compute_bmp280_coeffs(const struct bmp280_calibration *calib,
+			   struct bmp280_coeffs *coeffs) {
+  const u16 *dig_T = calib->dig_T;
+  const u16 *dig_P = calib->dig_P;
+  coeffs->t1 = bmp280_calibration_value(dig_T, 0);
+  coeffs->t1_shl1 = coeffs->t1 << 1;
+  coeffs->t2 = bmp280_calibration_value(dig_T, 1);
+  coeffs->t3 = bmp280_calibration_value(dig_T, 2);
+  coeffs->p1 = bmp280_calibration_value(dig_P, 0);
+  coeffs->p2 = bmp280_calibration_value(dig_P, 1);
+  coeffs->p3 = bmp280_calibration_value(dig_P, 2);
+  coeffs->p4_shl35 = (s64)bmp280_calibration_value(dig_P, 3) * (1LL << 35);
+  coeffs->p5 = bmp280_calibration_value(dig_P, 4);
+  coeffs->p6 = bmp280_calibration_value(dig_P, 5);
+  coeffs->p7_shl4 = bmp280_calibration_value(dig_P, 6) * (1 << 4);
+  coeffs->p8 = bmp280_calibration_value(dig_P, 7);
+  coeffs->p9 = bmp280_calibration_value(dig_P, 8);
+}
+
+/**
+ * `t_fine` is an intermediate temperature value, required by both the final
+ * processed temperature, as well as for pressure computation. See the
+ * datasheet for details.
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
+ * (Section 3.11.3 - Compensation formula)
+ */
+static s32 compute_bmp280_t_fine(s32 raw_temp,
+				 const struct bmp280_coeffs *coeffs) {
+  // This rather cryptic set of operations is described in the datasheet
+  s32 var1 = (((raw_temp >> 3) - coeffs->t1_shl1) * coeffs->t2) >> 11;
+  s32 var2 = (((((raw_temp >> 4) - coeffs->t1) *
+		((raw_temp >> 4) - coeffs->t1)) >> 12) * coeffs->t3) >> 14;
+  return var1 + var2;
+}
+
+/**
+ * Reference pressure compensation, following the 64 bit integer formula
+ * described in the datasheet.
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
+ * (Section 3.11.3 - Compensation formula)
+ * raw_temp and raw_press have their LS 4 padding bits already removed.
+ */
+static u32 compensate_bmp280_pressure_s64(const struct bmp280_coeffs *coeffs,
+					  s32 raw_temp, s32 raw_press) {
+  s64 t_fine = compute_bmp280_t_fine(raw_temp, coeffs);
+  s64 var1 = t_fine - 128000;
+  s64 var2 = var1 * var1 * coeffs->p6;
+  var2 = var2 + var1 * coeffs->p5 * (1LL << 17);
+  var2 = var2 + coeffs->p4_shl35;
+  var1 = ((var1 * var1 * coeffs->p3) >> 8) + var1 * coeffs->p2 * (1LL << 12);
+  var1 = ((((s64)1) << 47) + var1) * coeffs->p1 >> 33;
+  if (var1 == 0) {
+    return 0;
+  }
+  s64 p = 1048576 - raw_press;
+  p = div64_s64(((p << 31) - var2) * 3125, var1);
+  var1 = (coeffs->p9 * (p >> 13) * (p >> 13)) >> 25;
+  var2 = (coeffs->p8 * p) >> 19;
+  p = ((p + var1 + var2) >> 8) + coeffs->p7_shl4;
+  return (u32)p;
+}
+
+/**
+ * Pressure compensation following the 32 bit integer formula described in
+ * the datasheet (Section 8.2). It only needs a 32 bit division, but it
+ * resolves whole Pascals only, which we scale to 1/256 Pascal.
+ * raw_temp and raw_press have their LS 4 padding bits already removed.
+ */
+static u32 compensate_bmp280_pressure_s32(const struct bmp280_coeffs *coeffs,
+					  s32 raw_temp, s32 raw_press) {
+  s32 t_fine = compute_bmp280_t_fine(raw_temp, coeffs);
+  s32 var1 = (t_fine >> 1) - 64000;
+  s32 var2 = (((var1 >> 2) * (var1 >> 2)) >> 11) * coeffs->p6;
+  var2 = var2 + var1 * coeffs->p5 * 2;
+  // dig_P4 << 16, from the 64 bit formula's dig_P4 << 35.
+  var2 = (var2 >> 2) + (s32)(coeffs->p4_shl35 >> 19);
+  var1 = (((coeffs->p3 * (((var1 >> 2) * (var1 >> 2)) >> 13)) >> 3) +
+	  ((coeffs->p2 * var1) >> 1)) >> 18;
+  var1 = ((32768 + var1) * coeffs->p1) >> 15;
+  if (var1 == 0) {
+    return 0;
+  }
+  u32 p = ((u32)(1048576 - raw_press) - (var2 >> 12)) * 3125;
+  if (p < 0x80000000) {
+    p = (p << 1) / (u32)var1;
+  } else {
+    p = (p / (u32)var1) * 2;
+  }
+  var1 = (coeffs->p9 * (s32)(((p >> 3) * (p >> 3)) >> 13)) >> 12;
+  var2 = ((s32)(p >> 2) * coeffs->p8) >> 13;
+  // dig_P7, from the 64 bit formula's dig_P7 << 4.
+  p = (u32)((s32)p + ((var1 + var2 + (coeffs->p7_shl4 >> 4)) >> 4));
+  return p << 8;
+}
+
+s32 compensate_bmp280_raw_temperature(const struct bmp280_coeffs *coeffs,
+				      s32 raw_temp) {
+  // LS 4 bits of raw temperature are ignored.
+  return (compute_bmp280_t_fine(raw_temp >> 4, coeffs) * 5 + 128) >> 8;
+}
+
+u32 compensate_bmp280_raw_pressure(const struct bmp280_coeffs *coeffs,
+				   int engine, s32 raw_temp, s32 raw_press) {
+  // LS 4 bits of raw temperature and pressure are ignored.
+  raw_press >>= 4;
+  raw_temp >>= 4;
+  if (engine == BMP280_PRESSURE_COMPENSATION_S32) {
+    return compensate_bmp280_pressure_s32(coeffs, raw_temp, raw_press);
+  }
+  return compensate_bmp280_pressure_s64(coeffs, raw_temp, raw_press);
+}
+
+void compensate_bmp280_batch(const struct bmp280_coeffs *coeffs, int engine,
+			     const s32 *raw_temp, const s32 *raw_press,
+			     s32 *temp, u32 *press, size_t n) {
+  // Temperature only uses 32 bit multiplications and shifts, so this loop
+  // vectorizes well.
+  if (temp) {
+    for (size_t i = 0; i < n; i++) {
+      temp[i] = compensate_bmp280_raw_temperature(coeffs, raw_temp[i]);
+    }
+  }
+  if (!press) {
+    return;
+  }
+  // One loop per engine, so the engine is not tested on every sample.
+  if (engine == BMP280_PRESSURE_COMPENSATION_S32) {
+    for (size_t i = 0; i < n; i++) {
+      press[i] = compensate_bmp280_pressure_s32(coeffs, raw_temp[i] >> 4,
+						raw_press[i] >> 4);
+    }
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      press[i] = compensate_bmp280_pressure_s64(coeffs, raw_temp[i] >> 4,
+						raw_press[i] >> 4);
+    }
+  }
+}
+
+/**
+ * Number of fractional bits of the fixed point logarithms and exponents used
+ * by compute_bmp280_altitude.
+ */
+#define BMP280_LOG2_FRACTION_BITS 24
+
+/**
+ * 1 / 5.255, the exponent of the barometric formula, with
+ * BMP280_LOG2_FRACTION_BITS fractional bits.
+ */
+#define BMP280_ALTITUDE_EXPONENT 3192620
+
+/**
+ * 44330 m, the scale of the barometric formula, in millimeters.
+ */
+#define BMP280_ALTITUDE_SCALE_MM 44330000LL
+
+/**
+ * 2 ^ (2 ^ -(i + 1)), with 30 fractional bits. Multiplying together the
+ * entries of the bits set in a fraction gives 2 to the power of the fraction.
+ */
+static const u32 bmp280_exp2_table[BMP280_LOG2_FRACTION_BITS] = {
+  1518500250, 1276901417, 1170923762, 1121280436, 1097253708, 1085434106,
+  1079572136, 1076653033, 1075196443, 1074468888, 1074105294, 1073923544,
+  1073832680, 1073787251, 1073764537, 1073753181, 1073747502, 1073744663,
+  1073743244, 1073742534, 1073742179, 1073742001, 1073741913, 1073741868,
+};
+
+/**
+ * Base 2 logarithm of a non zero integer, with BMP280_LOG2_FRACTION_BITS
+ * fractional bits. The integer part is the position of the MS bit. The
+ * fraction is that of the mantissa, in [1, 2), which gains one bit each time
+ * it gets squared. 0 has no logarithm, and gives 0, like 1.
+ */
+static s64 bmp280_log2(u64 x) {
+  int n = 63;
+  while (n > 0 && !(x >> n)) {
+    n--;
+  }
+  // Mantissa, with 30 fractional bits, so its square fits in 64 bits.
+  u64 m = n > 30 ? x >> (n - 30) : x << (30 - n);
+  s64 result = (s64)n << BMP280_LOG2_FRACTION_BITS;
+  for (int bit = BMP280_LOG2_FRACTION_BITS - 1; bit >= 0; bit--) {
+    m = (m * m) >> 30;
+    if (m >= 2ULL << 30) {
+      m >>= 1;
+      result |= 1LL << bit;
+    }
+  }
+  return result;
+}
+
+/**
+ * 2 to the power of x, which has BMP280_LOG2_FRACTION_BITS fractional bits,
+ * with 30 fractional bits. x must be below 2.
+ */
+static u64 bmp280_exp2(s64 x) {
+  s64 integer = x >> BMP280_LOG2_FRACTION_BITS;
+  u32 fraction = x & ((1 << BMP280_LOG2_FRACTION_BITS) - 1);
+  u64 result = 1ULL << 30;
+  for (int i = 0; i < BMP280_LOG2_FRACTION_BITS; i++) {
+    if (fraction & (1U << (BMP280_LOG2_FRACTION_BITS - 1 - i))) {
+      result = (result * bmp280_exp2_table[i] + (1 << 29)) >> 30;
+    }
+  }
+  return integer >= 0 ? result << integer : result >> -integer;
+}
+
+s32 compute_bmp280_altitude(u32 press, u32 reference_press) {
+  if (!press || !reference_press) {
+    return BMP280_ALTITUDE_UNDEFINED;
+  }
+  // (p / p0) ^ (1 / 5.255) = 2 ^ ((log2(p) - log2(p0)) / 5.255), with p0 in
+  // the same 1/256 Pascal units as p.
+  s64 log2_ratio = bmp280_log2(press) - bmp280_log2((u64)reference_press << 8);
+  s64 exponent = (log2_ratio * BMP280_ALTITUDE_EXPONENT) >>
+    BMP280_LOG2_FRACTION_BITS;
+  s64 ratio = bmp280_exp2(exponent);
+  return (BMP280_ALTITUDE_SCALE_MM * ((1LL << 30) - ratio) + (1 << 29)) >> 30;
+}
@@ -0,0 +1,138 @@
+#ifndef BMP280_COMPENSATE_H_
+#define BMP280_COMPENSATE_H_
+
+/**
+ * Compensation formulas, turning raw samples into temperature and pressure.
+ * They are pure functions of the calibration values and the raw samples, and
+ * never talk with the sensor, so this header and bmp280-compensate.c build
+ * both in the kernel module and in userspace, e.g. to compensate raw samples
+ * captured from the IIO buffer.
+ * Raw values are passed as read from the data registers, including their 4
+ * LS padding bits, like struct bmp280_raw_sample holds them.
+ */
+
+#ifdef __KERNEL__
+#include <linux/cache.h>
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int16_t s16;
+typedef uint16_t u16;
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+
+#ifndef ____cacheline_aligned
+#define ____cacheline_aligned __attribute__((__aligned__(64)))
+#endif
+#endif
+
+/**
+ * Calibration values, as stored by the sensor: dig_T1 to dig_T3, and dig_P1
+ * to dig_P9, in CPU byte order. They are constant for any given sensor, so we
+ * only read them once. See bmp280_calibration_value for their signedness.
+ */
+struct bmp280_calibration {
+  u16 dig_T[3];
+  u16 dig_P[9];
+};
+
+/**
+ * Value of calibration word `index` of either set, starting from 0 for dig_T1
+ * or dig_P1. dig_T1 and dig_P1 are unsigned 16 bits, whereas all other
+ * calibration values are signed 16 bits.
+ */
+static inline s32 bmp280_calibration_value(const u16 *words, int index) {
+  return index == 0 ? words[0] : (s16)words[index];
+}
+
+/**
+ * Constants used by the compensation formulas, derived from the calibration
+ * values once, when they are read. Each holds a calibration value with any
+ * shift the datasheet formulas apply to it alone already applied (the _shlN
+ * suffix is the shift), in the type the formulas use it with.
+ * The whole struct fits in 64 bytes, and is cache line aligned, so compensating
+ * a sample only touches one cache line of constants.
+ */
+struct bmp280_coeffs {
+  s64 p4_shl35;
+  s32 t1;
+  s32 t1_shl1;
+  s32 t2;
+  s32 t3;
+  s32 p1;
+  s32 p2;
+  s32 p3;
+  s32 p5;
+  s32 p6;
+  s32 p7_shl4;
+  s32 p8;
+  s32 p9;
+} ____cacheline_aligned;
+
+/**
+ * Pressure compensation engines. All of them return pressure in units of
+ * 1/256 Pascal.
+ * BMP280_PRESSURE_COMPENSATION_S64 is the datasheet's 64 bit formula, used as
+ * the reference. BMP280_PRESSURE_COMPENSATION_S32 is the datasheet's 32 bit
+ * variant, which only resolves whole Pascals.
+ */
+enum bmp280_pressure_compensation {
+  BMP280_PRESSURE_COMPENSATION_S64,
+  BMP280_PRESSURE_COMPENSATION_S32,
+  BMP280_PRESSURE_COMPENSATION_ENGINES,
+};
+
+/**
+ * Derives the compensation constants from the calibration values.
+ */
+void compute_bmp280_coeffs(const struct bmp280_calibration *calib,
+			   struct bmp280_coeffs *coeffs);
+
+/**
+ * Computes the final temperature, in units of 1/100 degrees Celcius, from a
+ * raw temperature value.
+ */
+s32 compensate_bmp280_raw_temperature(const struct bmp280_coeffs *coeffs,
+				      s32 raw_temp);
+
+/**
+ * Computes the final pressure, in units of 1/256 Pascal, with the given
+ * engine, from raw temperature and pressure values of the same measurement.
+ */
+u32 compensate_bmp280_raw_pressure(const struct bmp280_coeffs *coeffs,
+				   int engine, s32 raw_temp, s32 raw_press);
+
+/**
+ * Compensates n raw samples at once: raw_temp[i] and raw_press[i] into
+ * temp[i] and press[i], with the given pressure engine. Either of temp and
+ * press can be NULL, when only the other one is needed.
+ * Each output is computed in its own loop over the plain arrays, with the
+ * engine chosen once for the whole batch, so the compiler can keep the
+ * constants in registers and vectorize what it can.
+ */
+void compensate_bmp280_batch(const struct bmp280_coeffs *coeffs, int engine,
+			     const s32 *raw_temp, const s32 *raw_press,
+			     s32 *temp, u32 *press, size_t n);
+
+/**
+ * Altitude of a pressure of 0, which has none. The same value as the driver's
+ * BMP280_GAP_ALTITUDE, so it reads as a gap.
+ */
+#define BMP280_ALTITUDE_UNDEFINED (-0x7fffffff - 1)
+
+/**
+ * Computes the altitude above the reference pressure level, in millimeters,
+ * from a pressure in units of 1/256 Pascal, and the pressure at the reference
+ * level, usually sea level, in Pascal. Uses the international barometric
+ * formula, h = 44330 m * (1 - (p / p0) ^ (1 / 5.255)), in fixed point, within
+ * a few millimeters of the formula over the sensor's range. Pressures above
+ * the reference one give negative altitudes. Either pressure being 0 gives
+ * BMP280_ALTITUDE_UNDEFINED.
+ */
+s32 compute_bmp280_altitude(u32 press, u32 reference_press);
+
+#endif  // BMP280_COMPENSATE_H_
@@ -0,0 +1,329 @@
+/**
+ * This file implements threshold and rate of change IIO events, on the
+ * processed temperature and pressure, so userspace can wait for a change on
+ * the IIO event chardev instead of polling the sensor.
+ * Each event fires once when its condition starts to hold, and is re-armed
+ * when the condition stops holding, so a value sitting above a threshold
+ * does not flood the event queue. Rates of change are computed between
+ * consecutive samples, and rising and falling rates are both given as
+ * positive values, per second.
+ * While a buffer capture runs, every pushed sample is checked, before
+ * decimation. Otherwise, while any event is enabled, a sampler reads the
+ * sensor once per sampling period, through the same cache as sysfs reads,
+ * and only checks the samples it did not see yet, at the time they were read.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/iio/events.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/types.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/pm_runtime.h>
+#include <linux/string.h>
+#include <linux/time64.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "bmp280.h"
+
+/**
+ * Number of units of the processed temperature (1/100 degrees Celcius) and
+ * pressure (1/256 Pascal) in each unit of the event values.
+ */
+static const s64 bmp280_event_scales[] = { 100, 256 };
+
+/**
+ * IIO event codes pushed for each kind of event.
+ */
+static const enum iio_event_type bmp280_event_types[] = {
+  [BMP280_EVENT_THRESH_RISING] = IIO_EV_TYPE_THRESH,
+  [BMP280_EVENT_THRESH_FALLING] = IIO_EV_TYPE_THRESH,
+  [BMP280_EVENT_ROC_RISING] = IIO_EV_TYPE_ROC,
+  [BMP280_EVENT_ROC_FALLING] = IIO_EV_TYPE_ROC,
+};
+static const enum iio_event_direction bmp280_event_directions[] = {
+  [BMP280_EVENT_THRESH_RISING] = IIO_EV_DIR_RISING,
+  [BMP280_EVENT_THRESH_FALLING] = IIO_EV_DIR_FALLING,
+  [BMP280_EVENT_ROC_RISING] = IIO_EV_DIR_RISING,
+  [BMP280_EVENT_ROC_FALLING] = IIO_EV_DIR_FALLING,
+};
+
+static void bmp280_events_sampler_fn(struct work_struct *work);
+
+/**
+ * Stops the sampler, when the device is removed.
+ */
+static void bmp280_events_cancel_sampler(void *data) {
+  struct bmp280_events *events = data;
+  cancel_delayed_work_sync(&events->sampler);
+}
+
+int setup_bmp280_events(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_events *events = &bmp280->events;
+  memset(events, 0, sizeof(*events));
+  events->indio_dev = indio_dev;
+  mutex_init(&events->lock);
+  INIT_DELAYED_WORK(&events->sampler, bmp280_events_sampler_fn);
+  // Registered before the IIO device, so it runs after the device is gone,
+  // and nothing can enable the events again.
+  return devm_add_action_or_reset(indio_dev->dev.parent,
+				  bmp280_events_cancel_sampler, events);
+}
+
+bool bmp280_events_enabled(struct bmp280_ctx *bmp280) {
+  return READ_ONCE(bmp280->events.enabled) != 0;
+}
+
+/**
+ * Events of the channel, i.e. 0 for the temperature and 1 for the pressure,
+ * and of the kind for an IIO event type and direction. Returns -EINVAL for
+ * anything else.
+ */
+static int bmp280_event_index(const struct iio_chan_spec *chan,
+			      enum iio_event_type type,
+			      enum iio_event_direction dir,
+			      int *value, int *kind) {
+  if (chan->type == IIO_TEMP) {
+    *value = 0;
+  } else if (chan->type == IIO_PRESSURE) {
+    *value = 1;
+  } else {
+    return -EINVAL;
+  }
+  for (int i = 0; i < BMP280_EVENT_KINDS; i++) {
+    if (bmp280_event_types[i] == type && bmp280_event_directions[i] == dir) {
+      *kind = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * Whether the condition of an event holds for the value, given its rate of
+ * change, if known.
+ */
+static bool bmp280_event_holds(int kind, s64 threshold, s64 value, s64 rate,
+			       bool rate_valid) {
+  if (kind == BMP280_EVENT_THRESH_RISING) {
+    return value > threshold;
+  } else if (kind == BMP280_EVENT_THRESH_FALLING) {
+    return value < threshold;
+  } else if (kind == BMP280_EVENT_ROC_RISING) {
+    return rate_valid && rate > threshold;
+  }
+  return rate_valid && rate < -threshold;
+}
+
+void check_bmp280_events(struct iio_dev *indio_dev,
+			 const struct bmp280_compensated_sample *compensated,
+			 s64 timestamp) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_events *events = &bmp280->events;
+  if (!bmp280_events_enabled(bmp280)) {
+    return;
+  }
+  s64 values[2] = { compensated->temp, compensated->press };
+  bool valid[2] = {
+    compensated->temp != BMP280_GAP_TEMP,
+    compensated->press != BMP280_GAP_PRESS,
+  };
+  mutex_lock(&events->lock);
+  s64 elapsed_ns = timestamp - events->previous_timestamp;
+  bool rate_valid = events->previous_valid && elapsed_ns > 0;
+  for (int value = 0; value < 2; value++) {
+    if (!valid[value]) {
+      continue;
+    }
+    s64 rate = rate_valid ?
+      div64_s64((values[value] - events->previous[value]) * NSEC_PER_SEC,
+		elapsed_ns) : 0;
+    for (int kind = 0; kind < BMP280_EVENT_KINDS; kind++) {
+      u32 bit = BIT(value * BMP280_EVENT_KINDS + kind);
+      if (!(events->enabled & bit)) {
+	continue;
+      }
+      if (!bmp280_event_holds(kind, events->values[value][kind],
+			      values[value], rate, rate_valid)) {
+	events->fired &= ~bit;
+      } else if (!(events->fired & bit)) {
+	events->fired |= bit;
+	enum iio_chan_type type = value ? IIO_PRESSURE : IIO_TEMP;
+	iio_push_event(indio_dev,
+		       IIO_UNMOD_EVENT_CODE(type, 0, bmp280_event_types[kind],
+					    bmp280_event_directions[kind]),
+		       timestamp);
+      }
+    }
+  }
+  // A gap breaks the rates of change, which start over with the next sample.
+  events->previous_valid = valid[0] && valid[1];
+  events->previous[0] = values[0];
+  events->previous[1] = values[1];
+  events->previous_timestamp = timestamp;
+  mutex_unlock(&events->lock);
+}
+
+/**
+ * Sampler, reading the sensor once per sampling period while any event is
+ * enabled. While a buffer capture runs, we cannot claim direct mode, and the
+ * trigger handler checks the samples it pushes instead, so the sampler only
+ * waits for the capture to end.
+ */
+static void bmp280_events_sampler_fn(struct work_struct *work) {
+  struct bmp280_events *events =
+    container_of(to_delayed_work(work), struct bmp280_events, sampler);
+  struct iio_dev *indio_dev = events->indio_dev;
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  if (!bmp280_events_enabled(bmp280)) {
+    return;
+  }
+  if (!iio_device_claim_direct_mode(indio_dev)) {
+    struct bmp280_raw_sample sample;
+    ktime_t time;
+    int status = pm_runtime_resume_and_get(bmp280->dev);
+    if (!status) {
+      status = read_bmp280_timed_cached_sample(bmp280, &sample, &time);
+      pm_runtime_mark_last_busy(bmp280->dev);
+      pm_runtime_put_autosuspend(bmp280->dev);
+    }
+    iio_device_release_direct_mode(indio_dev);
+    if (!status) {
+      // A sample we already checked would give a rate of 0, which re-arms
+      // the rates of change.
+      mutex_lock(&events->lock);
+      bool fresh = time != events->sampled_time;
+      events->sampled_time = time;
+      mutex_unlock(&events->lock);
+      if (fresh) {
+	struct bmp280_compensated_sample compensated;
+	compensate_bmp280_samples(bmp280, &sample.raw_temp, &sample.raw_press,
+				  &compensated.temp, &compensated.press, 1);
+	// Timestamped when it was read, not now, so the rates use the time
+	// between the two samples.
+	s64 age_ns = ktime_to_ns(ktime_sub(ktime_get(), time));
+	check_bmp280_events(indio_dev, &compensated,
+			    iio_get_time_ns(indio_dev) - age_ns);
+      }
+    } else {
+      pr_err_ratelimited("Failed to read sample for events: %d\n", status);
+    }
+  }
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  u32 period_us = compute_bmp280_sampling_period_us(&config);
+  queue_delayed_work(system_wq, &events->sampler,
+		     max(usecs_to_jiffies(period_us), 1UL));
+}
+
+int read_bmp280_event_config(struct iio_dev *indio_dev,
+			     const struct iio_chan_spec *chan,
+			     enum iio_event_type type,
+			     enum iio_event_direction dir) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  int value, kind;
+  int status = bmp280_event_index(chan, type, dir, &value, &kind);
+  if (status) {
+    return status;
+  }
+  u32 bit = BIT(value * BMP280_EVENT_KINDS + kind);
+  return !!(READ_ONCE(bmp280->events.enabled) & bit);
+}
+
+/**
+ * Enables or disables an event. An enabled event is armed, so it fires on
+ * the next sample if its condition already holds. Enabling the first event
+ * starts the sampler, which stops on its own once none is.
+ */
+int write_bmp280_event_config(struct iio_dev *indio_dev,
+			      const struct iio_chan_spec *chan,
+			      enum iio_event_type type,
+			      enum iio_event_direction dir, bool state) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_events *events = &bmp280->events;
+  int value, kind;
+  int status = bmp280_event_index(chan, type, dir, &value, &kind);
+  if (status) {
+    return status;
+  }
+  u32 bit = BIT(value * BMP280_EVENT_KINDS + kind);
+  mutex_lock(&events->lock);
+  bool was_enabled = events->enabled != 0;
+  u32 enabled = state ? events->enabled | bit : events->enabled & ~bit;
+  events->fired &= ~bit;
+  WRITE_ONCE(events->enabled, enabled);
+  if (!was_enabled && enabled) {
+    events->previous_valid = false;
+    events->sampled_time = 0;
+    mod_delayed_work(system_wq, &events->sampler, 0);
+  }
+  mutex_unlock(&events->lock);
+  return 0;
+}
+
+/**
+ * Reads an event's value, in degrees Celcius or Pascal, or in the same per
+ * second.
+ */
+int read_bmp280_event_value(struct iio_dev *indio_dev,
+			    const struct iio_chan_spec *chan,
+			    enum iio_event_type type,
+			    enum iio_event_direction dir,
+			    enum iio_event_info info, int *val, int *val2) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  int value, kind;
+  int status = bmp280_event_index(chan, type, dir, &value, &kind);
+  if (status || info != IIO_EV_INFO_VALUE) {
+    return -EINVAL;
+  }
+  mutex_lock(&bmp280->events.lock);
+  s64 threshold = bmp280->events.values[value][kind];
+  mutex_unlock(&bmp280->events.lock);
+  s64 scale = bmp280_event_scales[value];
+  s32 remainder;
+  *val = div_s64_rem(threshold, scale, &remainder);
+  *val2 = div_s64((s64)abs(remainder) * 1000000, scale);
+  // The IIO core only prints the sign of val2 when val is 0.
+  if (threshold < 0 && *val == 0) {
+    *val2 = -*val2;
+  }
+  return IIO_VAL_INT_PLUS_MICRO;
+}
+
+/**
+ * Sets an event's value, in degrees Celcius or Pascal, or in the same per
+ * second for the rates of change, which cannot be negative. Re-arms the
+ * event.
+ */
+int write_bmp280_event_value(struct iio_dev *indio_dev,
+			     const struct iio_chan_spec *chan,
+			     enum iio_event_type type,
+			     enum iio_event_direction dir,
+			     enum iio_event_info info, int val, int val2) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  int value, kind;
+  int status = bmp280_event_index(chan, type, dir, &value, &kind);
+  if (status || info != IIO_EV_INFO_VALUE) {
+    return -EINVAL;
+  }
+  s64 scale = bmp280_event_scales[value];
+  // For negative values, the IIO core gives val2 the sign only when val is
+  // 0, e.g. -1.5 is (-1, 500000), and -0.5 is (0, -500000).
+  s64 fraction = div_s64((s64)val2 * scale, 1000000);
+  s64 threshold = (s64)val * scale + (val < 0 ? -fraction : fraction);
+  if (type == IIO_EV_TYPE_ROC && threshold < 0) {
+    return -EINVAL;
+  }
+  mutex_lock(&bmp280->events.lock);
+  bmp280->events.values[value][kind] = threshold;
+  bmp280->events.fired &= ~BIT(value * BMP280_EVENT_KINDS + kind);
+  mutex_unlock(&bmp280->events.lock);
+  return 0;
+}
@@ -0,0 +1,245 @@
+/**
+ * This file implements a software FIFO for triggered buffer captures.
+ * Without it, every sample is pushed to the IIO buffers on its own, and a
+ * reader blocked on the buffer wakes up once per sample. With a watermark of
+ * N, we keep N raw samples here, and push them together, so a reader that
+ * sets the buffer's `watermark` to N wakes up once per batch.
+ * The FIFO is sized by the IIO buffer's own `watermark`, through the
+ * `hwfifo_set_watermark` hook, like drivers for sensors with a hardware FIFO.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/sysfs.h>
+#include <linux/lockdep.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/stringify.h>
+#include <linux/sysfs.h>
+#include <linux/types.h>
+
+#include "bmp280.h"
+#include "bmp280-trace.h"
+
+static ssize_t bmp280_fifo_watermark_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf);
+static ssize_t bmp280_fifo_enabled_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf);
+
+/**
+ * IIO buffer attribute files, following the ABI of sensors with a hardware
+ * FIFO. `hwfifo_watermark` is the batch size in effect for the current
+ * capture, and `hwfifo_enabled` tells whether samples are being batched.
+ */
+IIO_STATIC_CONST_DEVICE_ATTR(hwfifo_watermark_min, "1");
+IIO_STATIC_CONST_DEVICE_ATTR(hwfifo_watermark_max,
+			     __stringify(BMP280_FIFO_MAX_SAMPLES));
+static IIO_DEVICE_ATTR(hwfifo_watermark, 0444, bmp280_fifo_watermark_show,
+		       NULL, 0);
+static IIO_DEVICE_ATTR(hwfifo_enabled, 0444, bmp280_fifo_enabled_show,
+		       NULL, 0);
+
+const struct iio_dev_attr *bmp280_fifo_attributes[] = {
+  &iio_dev_attr_hwfifo_watermark_min,
+  &iio_dev_attr_hwfifo_watermark_max,
+  &iio_dev_attr_hwfifo_watermark,
+  &iio_dev_attr_hwfifo_enabled,
+  NULL,
+};
+
+void setup_bmp280_fifo(struct bmp280_ctx *bmp280) {
+  mutex_init(&bmp280->fifo.lock);
+  bmp280->fifo.watermark = 1;
+  bmp280->fifo.count = 0;
+}
+
+void reset_bmp280_fifo(struct bmp280_ctx *bmp280) {
+  mutex_lock(&bmp280->fifo.lock);
+  bmp280->fifo.count = 0;
+  mutex_unlock(&bmp280->fifo.lock);
+}
+
+int set_bmp280_fifo_watermark(struct iio_dev *indio_dev, unsigned int val) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  mutex_lock(&bmp280->fifo.lock);
+  bmp280->fifo.watermark = clamp_t(u32, val, 1, BMP280_FIFO_MAX_SAMPLES);
+  mutex_unlock(&bmp280->fifo.lock);
+  return 0;
+}
+
+/**
+ * Compensates n samples, for the processed channels captured by the buffer
+ * only. The altitude is computed from the pressure, so it needs it as well.
+ * Raw-only captures skip compensation altogether, unless the events need
+ * both values. Values that are skipped are
+ * set to gaps, so decimation and tracing never see leftovers from earlier
+ * samples.
+ */
+static void compensate_bmp280_fifo_samples(struct iio_dev *indio_dev,
+					   const s32 *raw_temp,
+					   const s32 *raw_press,
+					   const s64 *timestamp,
+					   s32 *temp, u32 *press, size_t n) {
+  const unsigned long *mask = indio_dev->active_scan_mask;
+  bool all = bmp280_events_enabled(iio_priv(indio_dev));
+  bool with_temp = all || test_bit(BMP280_SCAN_TEMP, mask);
+  bool with_press = all || test_bit(BMP280_SCAN_PRESS, mask) ||
+    test_bit(BMP280_SCAN_ALTITUDE, mask);
+  for (size_t i = 0; !with_temp && i < n; i++) {
+    temp[i] = BMP280_GAP_TEMP;
+  }
+  for (size_t i = 0; !with_press && i < n; i++) {
+    press[i] = BMP280_GAP_PRESS;
+  }
+  compensate_bmp280_samples(iio_priv(indio_dev), raw_temp, raw_press,
+			    with_temp ? temp : NULL, with_press ? press : NULL,
+			    n);
+  if (!trace_bmp280_compensate_enabled()) {
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    trace_bmp280_compensate(indio_dev, raw_temp[i], raw_press[i],
+			    temp[i], press[i],
+			    timestamp[i], 0);
+  }
+}
+
+/**
+ * Pushes up to `count` of the oldest samples, and moves the remaining ones to
+ * the front. Expects the FIFO lock to be held.
+ * The samples are compensated together first, so the per sample work left is
+ * assembling the scans.
+ * Returns how many samples were pushed, or an error if none could be.
+ */
+static int __flush_bmp280_fifo(struct iio_dev *indio_dev, u32 count) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_fifo *fifo = &bmp280->fifo;
+  lockdep_assert_held(&fifo->lock);
+  count = min(count, fifo->count);
+  compensate_bmp280_fifo_samples(indio_dev, fifo->raw_temp, fifo->raw_press,
+				 fifo->timestamp, fifo->temp, fifo->press,
+				 count);
+  u32 pushed;
+  int status = 0;
+  for (pushed = 0; pushed < count; pushed++) {
+    struct bmp280_raw_sample sample = {
+      .raw_temp = fifo->raw_temp[pushed],
+      .raw_press = fifo->raw_press[pushed],
+    };
+    struct bmp280_compensated_sample compensated = {
+      .temp = fifo->temp[pushed],
+      .press = fifo->press[pushed],
+    };
+    status = bmp280_iio_push_sample(indio_dev, &sample, &compensated,
+				    fifo->timestamp[pushed]);
+    if (status) {
+      break;
+    }
+  }
+  // Drop whatever was pushed, and anything that failed to be, so a bad
+  // sample does not block the FIFO forever.
+  u32 dropped = status ? pushed + 1 : pushed;
+  u32 left = fifo->count - dropped;
+  memmove(fifo->raw_temp, fifo->raw_temp + dropped,
+	  left * sizeof(fifo->raw_temp[0]));
+  memmove(fifo->raw_press, fifo->raw_press + dropped,
+	  left * sizeof(fifo->raw_press[0]));
+  memmove(fifo->timestamp, fifo->timestamp + dropped,
+	  left * sizeof(fifo->timestamp[0]));
+  fifo->count = left;
+  if (status && !pushed) {
+    return status;
+  }
+  return pushed;
+}
+
+int store_bmp280_fifo_sample(struct iio_dev *indio_dev,
+			     const struct bmp280_raw_sample *sample,
+			     s64 timestamp) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_fifo *fifo = &bmp280->fifo;
+  int status = 0;
+  mutex_lock(&fifo->lock);
+  if (fifo->watermark <= 1 && !fifo->count) {
+    // No batching, skip the copy.
+    struct bmp280_compensated_sample compensated = { 0 };
+    compensate_bmp280_fifo_samples(indio_dev, &sample->raw_temp,
+				   &sample->raw_press, &timestamp,
+				   &compensated.temp, &compensated.press, 1);
+    status = bmp280_iio_push_sample(indio_dev, sample, &compensated,
+				    timestamp);
+    goto out;
+  }
+  fifo->raw_temp[fifo->count] = sample->raw_temp;
+  fifo->raw_press[fifo->count] = sample->raw_press;
+  fifo->timestamp[fifo->count] = timestamp;
+  fifo->count++;
+  if (fifo->count >= fifo->watermark) {
+    int pushed = __flush_bmp280_fifo(indio_dev, fifo->count);
+    if (pushed < 0) {
+      status = pushed;
+    }
+  }
+ out:
+  mutex_unlock(&fifo->lock);
+  return status;
+}
+
+int flush_bmp280_fifo(struct iio_dev *indio_dev, unsigned int count) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  mutex_lock(&bmp280->fifo.lock);
+  int pushed = __flush_bmp280_fifo(indio_dev, count);
+  mutex_unlock(&bmp280->fifo.lock);
+  return pushed;
+}
+
+int drain_bmp280_fifo(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_fifo *fifo = &bmp280->fifo;
+  mutex_lock(&fifo->lock);
+  int status = 0;
+  while (fifo->count) {
+    int pushed = __flush_bmp280_fifo(indio_dev, fifo->count);
+    if (pushed < 0) {
+      status = pushed;
+    }
+  }
+  fifo->watermark = 1;
+  mutex_unlock(&fifo->lock);
+  return status;
+}
+
+/**
+ * `hwfifo_watermark` buffer attribute show function.
+ */
+static ssize_t bmp280_fifo_watermark_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  mutex_lock(&bmp280->fifo.lock);
+  u32 watermark = bmp280->fifo.watermark;
+  mutex_unlock(&bmp280->fifo.lock);
+  return sysfs_emit(buf, "%u\n", watermark);
+}
+
+/**
+ * `hwfifo_enabled` buffer attribute show function.
+ * The FIFO only batches samples while a capture is running, with a watermark
+ * above 1.
+ */
+static ssize_t bmp280_fifo_enabled_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf) {
+  struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  mutex_lock(&bmp280->fifo.lock);
+  bool enabled = iio_buffer_enabled(indio_dev) && bmp280->fifo.watermark > 1;
+  mutex_unlock(&bmp280->fifo.lock);
+  return sysfs_emit(buf, "%d\n", enabled);
+}
@@ -0,0 +1,278 @@
+/**
+ * This file implements two ways of reducing what the driver hands to
+ * userspace, for consumers that only want slow moving values.
+ * Rolling statistics keep the mean, minimum and maximum of the processed
+ * temperature and pressure, over a window of configurable length, exposed as
+ * the `in_temp_rolling_*` and `in_pressure_rolling_*` channel attributes. The
+ * window is split into BMP280_ROLLING_BUCKETS buckets, so the statistics take
+ * constant memory and constant time per sample, at any sampling rate, and
+ * follow the window with the granularity of a bucket.
+ * Decimation averages every `decimation_factor` samples into one, right
+ * before they are pushed to the IIO buffers. It is a boxcar filter followed
+ * by downsampling, i.e. a first order CIC filter, so high rate sampling turns
+ * into a low rate, lower noise capture.
+ * Rolling statistics see every sample read from the sensor, as it refreshes
+ * the cache: sysfs reads, the event sampler, and captures alike, so they do
+ * not need a capture running. They have their own lock, taken with the bus
+ * mutex held. Decimation sees every sample the trigger handler pushes,
+ * including those batched by the software FIFO, and runs with the FIFO lock
+ * held.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/lockdep.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/time64.h>
+#include <linux/types.h>
+
+#include "bmp280.h"
+
+/**
+ * Positions of the values in the decimation block.
+ */
+enum {
+  BMP280_BLOCK_RAW_TEMP,
+  BMP280_BLOCK_RAW_PRESS,
+  BMP280_BLOCK_TEMP,
+  BMP280_BLOCK_PRESS,
+};
+
+/**
+ * Adds a value to an accumulator.
+ */
+static void accumulate_bmp280_value(struct bmp280_accumulator *acc,
+				    s64 value) {
+  if (!acc->count || value < acc->min) {
+    acc->min = value;
+  }
+  if (!acc->count || value > acc->max) {
+    acc->max = value;
+  }
+  acc->sum += value;
+  acc->count++;
+}
+
+/**
+ * Adds up two accumulators into the first one.
+ */
+static void merge_bmp280_accumulator(struct bmp280_accumulator *acc,
+				     const struct bmp280_accumulator *other) {
+  if (!other->count) {
+    return;
+  }
+  if (!acc->count || other->min < acc->min) {
+    acc->min = other->min;
+  }
+  if (!acc->count || other->max > acc->max) {
+    acc->max = other->max;
+  }
+  acc->sum += other->sum;
+  acc->count += other->count;
+}
+
+/**
+ * Mean of the values in a non empty accumulator, rounded to the closest
+ * integer.
+ */
+static s64 bmp280_accumulator_mean(const struct bmp280_accumulator *acc) {
+  s64 half = acc->count / 2;
+  return div_s64(acc->sum + (acc->sum < 0 ? -half : half), acc->count);
+}
+
+/**
+ * Length of each rolling statistics bucket, in nanoseconds.
+ */
+static s64 bmp280_rolling_bucket_ns(const struct bmp280_filter *filter) {
+  return (s64)filter->window_ms * NSEC_PER_MSEC / BMP280_ROLLING_BUCKETS;
+}
+
+/**
+ * Empties every rolling statistics bucket.
+ */
+static void clear_bmp280_rolling(struct bmp280_filter *filter) {
+  memset(filter->buckets, 0, sizeof(filter->buckets));
+  filter->head = 0;
+  filter->buckets[0].start = S64_MIN;
+}
+
+void setup_bmp280_filter(struct bmp280_ctx *bmp280) {
+  struct bmp280_filter *filter = &bmp280->filter;
+  memset(filter, 0, sizeof(*filter));
+  mutex_init(&filter->rolling_lock);
+  clear_bmp280_rolling(filter);
+  filter->decimation_factor = 1;
+}
+
+void reset_bmp280_decimation(struct bmp280_ctx *bmp280) {
+  mutex_lock(&bmp280->fifo.lock);
+  bmp280->filter.decimation_count = 0;
+  memset(bmp280->filter.block, 0, sizeof(bmp280->filter.block));
+  mutex_unlock(&bmp280->fifo.lock);
+}
+
+bool bmp280_rolling_enabled(struct bmp280_ctx *bmp280) {
+  return READ_ONCE(bmp280->filter.window_ms) != 0;
+}
+
+/**
+ * Adds the processed values of a sample to the bucket of its timestamp,
+ * starting a new bucket when the sample is past the newest one. Samples
+ * older than the newest bucket go into it.
+ */
+static void
+update_bmp280_rolling(struct bmp280_filter *filter,
+		      const struct bmp280_compensated_sample *compensated,
+		      s64 timestamp) {
+  s64 bucket_ns = bmp280_rolling_bucket_ns(filter);
+  if (!bucket_ns) {
+    return;
+  }
+  struct bmp280_rolling_bucket *bucket = &filter->buckets[filter->head];
+  if (timestamp >= bucket->start + bucket_ns || bucket->start == S64_MIN) {
+    filter->head = (filter->head + 1) % BMP280_ROLLING_BUCKETS;
+    bucket = &filter->buckets[filter->head];
+    memset(bucket, 0, sizeof(*bucket));
+    // Timestamps count from boot, or from the epoch, so they are positive.
+    u64 remainder;
+    div64_u64_rem(timestamp, bucket_ns, &remainder);
+    bucket->start = timestamp - remainder;
+  }
+  if (compensated->temp != BMP280_GAP_TEMP) {
+    accumulate_bmp280_value(&bucket->values[BMP280_ROLLING_TEMP],
+			    compensated->temp);
+  }
+  if (compensated->press != BMP280_GAP_PRESS) {
+    accumulate_bmp280_value(&bucket->values[BMP280_ROLLING_PRESS],
+			    compensated->press);
+  }
+}
+
+/**
+ * Adds a sample to the decimation block. At the end of the block, replaces
+ * the sample with the means of the block, and starts the next one.
+ * Returns whether the block is complete.
+ */
+static bool
+decimate_bmp280_sample(struct bmp280_filter *filter,
+		       struct bmp280_raw_sample *sample,
+		       struct bmp280_compensated_sample *compensated) {
+  struct bmp280_accumulator *block = filter->block;
+  if (sample->raw_temp != BMP280_RAW_SKIPPED) {
+    accumulate_bmp280_value(&block[BMP280_BLOCK_RAW_TEMP], sample->raw_temp);
+  }
+  if (sample->raw_press != BMP280_RAW_SKIPPED) {
+    accumulate_bmp280_value(&block[BMP280_BLOCK_RAW_PRESS],
+			    sample->raw_press);
+  }
+  if (compensated->temp != BMP280_GAP_TEMP) {
+    accumulate_bmp280_value(&block[BMP280_BLOCK_TEMP], compensated->temp);
+  }
+  if (compensated->press != BMP280_GAP_PRESS) {
+    accumulate_bmp280_value(&block[BMP280_BLOCK_PRESS], compensated->press);
+  }
+  if (++filter->decimation_count < filter->decimation_factor) {
+    return false;
+  }
+  sample->raw_temp = block[BMP280_BLOCK_RAW_TEMP].count ?
+    bmp280_accumulator_mean(&block[BMP280_BLOCK_RAW_TEMP]) :
+    BMP280_RAW_SKIPPED;
+  sample->raw_press = block[BMP280_BLOCK_RAW_PRESS].count ?
+    bmp280_accumulator_mean(&block[BMP280_BLOCK_RAW_PRESS]) :
+    BMP280_RAW_SKIPPED;
+  compensated->temp = block[BMP280_BLOCK_TEMP].count ?
+    bmp280_accumulator_mean(&block[BMP280_BLOCK_TEMP]) : BMP280_GAP_TEMP;
+  compensated->press = block[BMP280_BLOCK_PRESS].count ?
+    bmp280_accumulator_mean(&block[BMP280_BLOCK_PRESS]) : BMP280_GAP_PRESS;
+  filter->decimation_count = 0;
+  memset(filter->block, 0, sizeof(filter->block));
+  return true;
+}
+
+void update_bmp280_rolling_stats(struct bmp280_ctx *bmp280,
+				 const struct bmp280_raw_sample *sample,
+				 s64 timestamp) {
+  if (!bmp280_rolling_enabled(bmp280)) {
+    return;
+  }
+  struct bmp280_compensated_sample compensated;
+  compensate_bmp280_samples(bmp280, &sample->raw_temp, &sample->raw_press,
+			    &compensated.temp, &compensated.press, 1);
+  mutex_lock(&bmp280->filter.rolling_lock);
+  update_bmp280_rolling(&bmp280->filter, &compensated, timestamp);
+  mutex_unlock(&bmp280->filter.rolling_lock);
+}
+
+bool filter_bmp280_sample(struct bmp280_ctx *bmp280,
+			  struct bmp280_raw_sample *sample,
+			  struct bmp280_compensated_sample *compensated) {
+  struct bmp280_filter *filter = &bmp280->filter;
+  lockdep_assert_held(&bmp280->fifo.lock);
+  if (filter->decimation_factor <= 1) {
+    return true;
+  }
+  return decimate_bmp280_sample(filter, sample, compensated);
+}
+
+int read_bmp280_rolling_stat(struct bmp280_ctx *bmp280,
+			     enum bmp280_rolling_value value,
+			     enum bmp280_rolling_stat stat, s64 now,
+			     s64 *result) {
+  struct bmp280_filter *filter = &bmp280->filter;
+  struct bmp280_accumulator total = { 0 };
+  mutex_lock(&filter->rolling_lock);
+  s64 bucket_ns = bmp280_rolling_bucket_ns(filter);
+  // Every bucket that ends within the window counts, so the window may reach
+  // up to a bucket's length further back.
+  s64 oldest = now - (s64)filter->window_ms * NSEC_PER_MSEC;
+  for (unsigned int i = 0; bucket_ns && i < BMP280_ROLLING_BUCKETS; i++) {
+    const struct bmp280_rolling_bucket *bucket = &filter->buckets[i];
+    if (bucket->start != S64_MIN && bucket->start + bucket_ns > oldest) {
+      merge_bmp280_accumulator(&total, &bucket->values[value]);
+    }
+  }
+  mutex_unlock(&filter->rolling_lock);
+  if (!total.count) {
+    return -ENODATA;
+  }
+  if (stat == BMP280_ROLLING_MIN) {
+    *result = total.min;
+  } else if (stat == BMP280_ROLLING_MAX) {
+    *result = total.max;
+  } else {
+    *result = bmp280_accumulator_mean(&total);
+  }
+  return 0;
+}
+
+u32 get_bmp280_rolling_window(struct bmp280_ctx *bmp280) {
+  return READ_ONCE(bmp280->filter.window_ms);
+}
+
+void set_bmp280_rolling_window(struct bmp280_ctx *bmp280, u32 window_ms) {
+  mutex_lock(&bmp280->filter.rolling_lock);
+  clear_bmp280_rolling(&bmp280->filter);
+  WRITE_ONCE(bmp280->filter.window_ms, window_ms);
+  mutex_unlock(&bmp280->filter.rolling_lock);
+}
+
+u32 get_bmp280_decimation_factor(struct bmp280_ctx *bmp280) {
+  return READ_ONCE(bmp280->filter.decimation_factor);
+}
+
+int set_bmp280_decimation_factor(struct bmp280_ctx *bmp280, u32 factor) {
+  if (factor < 1 || factor > BMP280_DECIMATION_MAX_FACTOR) {
+    return -EINVAL;
+  }
+  mutex_lock(&bmp280->fifo.lock);
+  WRITE_ONCE(bmp280->filter.decimation_factor, factor);
+  bmp280->filter.decimation_count = 0;
+  memset(bmp280->filter.block, 0, sizeof(bmp280->filter.block));
+  mutex_unlock(&bmp280->fifo.lock);
+  return 0;
+}
@@ -5,39 +5,117 @@
 #include <linux/i2c.h>
 #include <linux/iio/buffer.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/sysfs.h>
+#include <linux/iio/trigger.h>
 #include <linux/iio/trigger_consumer.h>
 #include <linux/iio/triggered_buffer.h>
 #include <linux/iio/types.h>
 #include <linux/kernel.h>
+#include <linux/kstrtox.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/pm.h>
+#include <linux/pm_runtime.h>
 #include <linux/printk.h>
-#include <linux/slab.h>
+#include <linux/property.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
 #include <linux/types.h>
 
 #include "bmp280.h"
 
+// This file defines the trace events, see bmp280-trace.h.
+#define CREATE_TRACE_POINTS
+#include "bmp280-trace.h"
+
 /**
  * IIO channel macro for calibration values.
- * For triggered buffer reads, `scan_index` sets the position of this channel
- * data within the sample. `scan_type` tells that the channel data takes up 16
- * bits without any padding, and follows the CPU's endianness.
+ * Calibration values never change, so they are not scan elements: a scan
+ * index of -1 keeps them out of triggered buffers, instead of copying them
+ * into every scan. Buffer readers get them once, from the `calibration`
+ * attribute.
  */
-#define BMP280_CALIBR_CHANNNEL(_type, _index, _scan_index, _sign, _address) { \
+#define BMP280_CALIBR_CHANNNEL(_type, _index, _address) {		\
     .type = (_type),							\
     .indexed = 1,							\
     .channel = (_index),						\
     .address = (_address),						\
     .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),			\
-    .scan_index = (_scan_index),					\
-    .scan_type = {							\
-      .sign = (_sign),							\
-      .realbits = 16,							\
-      .storagebits = 16,						\
-      .shift = 0,							\
-      .endianness = IIO_CPU,						\
-    },									\
+    .scan_index = -1,							\
     .output = 0,							\
 }
 
+/**
+ * Runtime configuration attributes for the raw and processed temperature and
+ * pressure channels. Oversampling is set independently for temperature and
+ * pressure, so it is shared by channel type. Sampling frequency and IIR
+ * filter coefficient apply to the whole sensor, so they are shared by all
+ * channels. The IIR filter coefficient is exposed as the low pass filter
+ * attribute, as the upstream BMP280 family driver does.
+ */
+#define BMP280_CONFIG_SHARED_BY_TYPE BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO)
+#define BMP280_CONFIG_SHARED_BY_ALL (BIT(IIO_CHAN_INFO_SAMP_FREQ) |	\
+				     BIT(IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY))
+
+static ssize_t bmp280_iio_rolling_read(struct iio_dev *indio_dev,
+				       uintptr_t private,
+				       struct iio_chan_spec const *chan,
+				       char *buf);
+
+/**
+ * Rolling statistics attributes of the processed channels, see
+ * bmp280-filter.c. Each attribute's private value is the statistic it reads.
+ */
+static const struct iio_chan_spec_ext_info bmp280_iio_rolling_ext_info[] = {
+  {
+    .name = "rolling_mean",
+    .shared = IIO_SEPARATE,
+    .read = bmp280_iio_rolling_read,
+    .private = BMP280_ROLLING_MEAN,
+  },
+  {
+    .name = "rolling_min",
+    .shared = IIO_SEPARATE,
+    .read = bmp280_iio_rolling_read,
+    .private = BMP280_ROLLING_MIN,
+  },
+  {
+    .name = "rolling_max",
+    .shared = IIO_SEPARATE,
+    .read = bmp280_iio_rolling_read,
+    .private = BMP280_ROLLING_MAX,
+  },
+  { /* sentinel */ },
+};
+
+/**
+ * Events of the processed channels, see bmp280-events.c: rising and falling
+ * thresholds, and rising and falling rates of change. Each has its own
+ * `_en` and `_value` files, e.g. `events/in_pressure_thresh_falling_en`.
+ */
+static const struct iio_event_spec bmp280_iio_events[] = {
+  {
+    .type = IIO_EV_TYPE_THRESH,
+    .dir = IIO_EV_DIR_RISING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  },
+  {
+    .type = IIO_EV_TYPE_THRESH,
+    .dir = IIO_EV_DIR_FALLING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  },
+  {
+    .type = IIO_EV_TYPE_ROC,
+    .dir = IIO_EV_DIR_RISING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  },
+  {
+    .type = IIO_EV_TYPE_ROC,
+    .dir = IIO_EV_DIR_FALLING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  },
+};
+
 /**
  * IIO channels.
  * We make the following channels available:
@@ -47,19 +125,37 @@
  *     * Nine pressure calibration values.
  *     * One raw pressure value.
  *     * One final, processed pressure value.
+ *     * One altitude above sea level, derived from the processed pressure.
+ *     * One timestamp, only available through triggered buffers.
  * Within `/sys/bus/iio/devices/iio:deviceX/`, these will be:
- * `in_temp{0-3}_raw`, `in_temp_input`, `in_pressure{0-9}_raw`, and
- * `in_pressure_input`, respectively.
+ * `in_temp{0-3}_raw`, `in_temp_input`, `in_pressure{0-9}_raw`,
+ * `in_pressure_input`, and `in_distance_input`, respectively. IIO has no
+ * altitude channel type, so altitude is a distance, in meters, from sea
+ * level. The sea level pressure it is computed against, in Pascal, is
+ * `in_distance_calibbias`.
+ * The sensor configuration is exposed as `in_temp_oversampling_ratio`,
+ * `in_pressure_oversampling_ratio`, `sampling_frequency` and
+ * `filter_low_pass_3db_frequency`, each with a matching `*_available` file.
+ * The processed channels also have `in_temp_rolling_{mean,min,max}` and
+ * `in_pressure_rolling_{mean,min,max}`, and threshold and rate of change
+ * events.
+ * Only the raw and processed values, the altitude, and the timestamp, are scan
+ * elements. Their scan indices follow their order in this array, which
+ * bmp280_iio_push_sample relies on. The array order itself is what device
+ * tree `io-channels` entries refer to, so it must not change: new channels go
+ * at the end, before the timestamp.
+ * Capturing just the two raw values gives 16 bytes scans, timestamp
+ * included.
  */
 static const struct iio_chan_spec bmp280_iio_channels[] = {
   // Temperature calibration values, refered to as dig_T1 to dig_T3 on the
   // datasheet. Corresponding sysfs files: `in_temp{0-2}_raw`.
   // Note: each calibration value is 16 bits, thus the address deltas.
-  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 0, 0, 'u',
+  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 0,
 			 BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS),
-  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 1, 1, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 1,
 			 BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS + 2),
-  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 2, 2, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_TEMP, 2,
 			 BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS + 4),
   // Raw temperature value, as directly read from the sensor.
   // Corresponding sysfs file: `in_temp3_raw`
@@ -69,7 +165,11 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
     .channel = 3,
     .address = BMP280_TEMP_RAW_REG_ADDRESS,
     .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    .scan_index = 3,
+    .info_mask_shared_by_type = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_type_available = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_all = BMP280_CONFIG_SHARED_BY_ALL,
+    .info_mask_shared_by_all_available = BMP280_CONFIG_SHARED_BY_ALL,
+    .scan_index = BMP280_SCAN_RAW_TEMP,
     // Channel data is signed (2 complement), takes up 20 bits within a 32 bits
     // field, with the 4 LS bits being padding bits, and follows the host
     // CPU's endianness.
@@ -88,7 +188,14 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
     .type = IIO_TEMP,
     .indexed = 0,
     .info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
-    .scan_index = 4,
+    .info_mask_shared_by_type = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_type_available = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_all = BMP280_CONFIG_SHARED_BY_ALL,
+    .info_mask_shared_by_all_available = BMP280_CONFIG_SHARED_BY_ALL,
+    .scan_index = BMP280_SCAN_TEMP,
+    .ext_info = bmp280_iio_rolling_ext_info,
+    .event_spec = bmp280_iio_events,
+    .num_event_specs = ARRAY_SIZE(bmp280_iio_events),
     // Channel data is signed (2 complement), takes up 32 bits,
     // and follows the host CPU's endianness.
     .scan_type = {
@@ -103,23 +210,23 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
   // Pressure calibration values, refered to as dig_P1 to dig_P9 on the
   // datasheet. Corresponding sysfs files: `in_pressure{0-8}_raw`.
   // Note: each calibration value is 16 bits, thus the address deltas.
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 0, 5, 'u',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 0,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 1, 6, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 1,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 2),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 2, 7, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 2,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 4),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 3, 8, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 3,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 6),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 4, 9, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 4,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 8),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 5, 10, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 5,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 10),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 6, 11, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 6,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 12),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 7, 12, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 7,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 14),
-  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 8, 13, 's',
+  BMP280_CALIBR_CHANNNEL(IIO_PRESSURE, 8,
 			 BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS + 16),
   // Raw pressure value, as directly read from the sensor.
   // Corresponding sysfs file: `in_pressure9_raw`
@@ -129,7 +236,11 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
     .channel = 9,
     .address = BMP280_PRESS_RAW_REG_ADDRESS,
     .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
-    .scan_index = 14,
+    .info_mask_shared_by_type = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_type_available = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_all = BMP280_CONFIG_SHARED_BY_ALL,
+    .info_mask_shared_by_all_available = BMP280_CONFIG_SHARED_BY_ALL,
+    .scan_index = BMP280_SCAN_RAW_PRESS,
     // Channel data is signed (2 complement), takes up 20 bits within a 32 bits
     // field, with the 4 LS bits being padding bits, and follows the host
     // CPU's endianness.
@@ -148,7 +259,14 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
     .type = IIO_PRESSURE,
     .indexed = 0,
     .info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
-    .scan_index = 15,
+    .info_mask_shared_by_type = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_type_available = BMP280_CONFIG_SHARED_BY_TYPE,
+    .info_mask_shared_by_all = BMP280_CONFIG_SHARED_BY_ALL,
+    .info_mask_shared_by_all_available = BMP280_CONFIG_SHARED_BY_ALL,
+    .scan_index = BMP280_SCAN_PRESS,
+    .ext_info = bmp280_iio_rolling_ext_info,
+    .event_spec = bmp280_iio_events,
+    .num_event_specs = ARRAY_SIZE(bmp280_iio_events),
     // Channel data is unsigned, takes up 32 bits,
     // and follows the host CPU's endianness.
     .scan_type = {
@@ -160,184 +278,875 @@ static const struct iio_chan_spec bmp280_iio_channels[] = {
     },
     .output = 0,
   },
+  // Altitude above sea level, in millimeters, computed from the processed
+  // pressure, and the sea level pressure set through calibbias.
+  // Corresponding sysfs files: `in_distance_input`, `in_distance_calibbias`
+  {
+    .type = IIO_DISTANCE,
+    .indexed = 0,
+    .info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED) |
+			  BIT(IIO_CHAN_INFO_CALIBBIAS),
+    .scan_index = BMP280_SCAN_ALTITUDE,
+    // Channel data is signed (2 complement), takes up 32 bits,
+    // and follows the host CPU's endianness.
+    .scan_type = {
+      .sign = 's',
+      .realbits = 32,
+      .storagebits = 32,
+      .shift = 0,
+      .endianness = IIO_CPU,
+    },
+    .output = 0,
+  },
+  // Timestamp of each triggered buffer scan, as recorded by
+  // iio_pollfunc_store_time when the trigger fires.
+  // Corresponding scan element: `in_timestamp`
+  IIO_CHAN_SOFT_TIMESTAMP(BMP280_SCAN_TIMESTAMP),
 };
 
 static int bmp280_iio_read_raw(struct iio_dev *indio_dev,
 			       struct iio_chan_spec const *chan,
 			       int *val, int *val2, long mask);
+static int bmp280_iio_read_avail(struct iio_dev *indio_dev,
+				 struct iio_chan_spec const *chan,
+				 const int **vals, int *type, int *length,
+				 long mask);
+static int bmp280_iio_write_raw(struct iio_dev *indio_dev,
+				struct iio_chan_spec const *chan,
+				int val, int val2, long mask);
 static irqreturn_t bmp280_iio_trigger_handler(int irq, void *p);
 
+static ssize_t bmp280_iio_power_mode_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf);
+static ssize_t bmp280_iio_power_mode_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count);
+static ssize_t bmp280_iio_cache_window_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf);
+static ssize_t bmp280_iio_cache_window_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count);
+static ssize_t bmp280_iio_health_counter_show(struct device *dev,
+					      struct device_attribute *attr,
+					      char *buf);
+static ssize_t bmp280_iio_filter_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf);
+static ssize_t bmp280_iio_filter_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count);
+static ssize_t bmp280_iio_calibration_read(struct file *file,
+					   struct kobject *kobj,
+					   struct bin_attribute *attr,
+					   char *buf, loff_t offset,
+					   size_t count);
+
+/**
+ * Sysfs device attribute files for configuration that does not map to a
+ * standard IIO channel attribute.
+ * `power_mode` selects between normal mode, where the sensor samples
+ * continuously, and forced mode, where each read runs a single conversion.
+ * `sample_cache_window_us` sets for how long a sample read from the sensor is
+ * reused by sysfs reads.
+ * `rolling_window_ms` and `decimation_factor` configure the rolling
+ * statistics and decimation, see bmp280-filter.c.
+ * The remaining files are read-only bus error counters: failed register
+ * accesses, retries, accesses failed fast while the sensor was faulted,
+ * re-probes, and buffer scans pushed as gaps. Each attribute's address is its
+ * counter's offset in struct bmp280_health.
+ */
+static IIO_DEVICE_ATTR(power_mode, 0644, bmp280_iio_power_mode_show,
+		       bmp280_iio_power_mode_store, 0);
+static IIO_CONST_ATTR(power_mode_available, "normal forced");
+static IIO_DEVICE_ATTR(sample_cache_window_us, 0644,
+		       bmp280_iio_cache_window_show,
+		       bmp280_iio_cache_window_store, 0);
+static IIO_DEVICE_ATTR(rolling_window_ms, 0644, bmp280_iio_filter_show,
+		       bmp280_iio_filter_store, 0);
+static IIO_DEVICE_ATTR(decimation_factor, 0644, bmp280_iio_filter_show,
+		       bmp280_iio_filter_store, 0);
+static IIO_DEVICE_ATTR(transfer_errors, 0444, bmp280_iio_health_counter_show,
+		       NULL, offsetof(struct bmp280_health, transfer_errors));
+static IIO_DEVICE_ATTR(transfer_retries, 0444, bmp280_iio_health_counter_show,
+		       NULL, offsetof(struct bmp280_health, retries));
+static IIO_DEVICE_ATTR(fast_fails, 0444, bmp280_iio_health_counter_show,
+		       NULL, offsetof(struct bmp280_health, fast_fails));
+static IIO_DEVICE_ATTR(reprobes, 0444, bmp280_iio_health_counter_show,
+		       NULL, offsetof(struct bmp280_health, reprobes));
+static IIO_DEVICE_ATTR(scan_gaps, 0444, bmp280_iio_health_counter_show,
+		       NULL, offsetof(struct bmp280_health, gaps));
+
+static struct attribute *bmp280_iio_attributes[] = {
+  &iio_dev_attr_power_mode.dev_attr.attr,
+  &iio_const_attr_power_mode_available.dev_attr.attr,
+  &iio_dev_attr_sample_cache_window_us.dev_attr.attr,
+  &iio_dev_attr_rolling_window_ms.dev_attr.attr,
+  &iio_dev_attr_decimation_factor.dev_attr.attr,
+  &iio_dev_attr_transfer_errors.dev_attr.attr,
+  &iio_dev_attr_transfer_retries.dev_attr.attr,
+  &iio_dev_attr_fast_fails.dev_attr.attr,
+  &iio_dev_attr_reprobes.dev_attr.attr,
+  &iio_dev_attr_scan_gaps.dev_attr.attr,
+  NULL,
+};
+
 /**
- * IIO hooks. We only need to read from the device.
+ * Read-only binary file with the calibration values, as stored on the sensor
+ * from 0x88 to 0x9f: dig_T1 to dig_T3, then dig_P1 to dig_P9, each 16 bits
+ * little endian. Buffer captures only carry raw values, and this is what
+ * userspace needs to compensate them.
+ */
+static BIN_ATTR(calibration, 0444, bmp280_iio_calibration_read, NULL,
+		BMP280_CALIBRATION_LENGTH);
+
+static struct bin_attribute *bmp280_iio_bin_attributes[] = {
+  &bin_attr_calibration,
+  NULL,
+};
+
+static const struct attribute_group bmp280_iio_attribute_group = {
+  .attrs = bmp280_iio_attributes,
+  .bin_attrs = bmp280_iio_bin_attributes,
+};
+
+/**
+ * IIO hooks. We read from the device, and write runtime configuration to it.
  */
 static const struct iio_info bmp280_iio_info = {
   .read_raw = bmp280_iio_read_raw,
+  .read_avail = bmp280_iio_read_avail,
+  .write_raw = bmp280_iio_write_raw,
+  .attrs = &bmp280_iio_attribute_group,
+  .hwfifo_set_watermark = set_bmp280_fifo_watermark,
+  .hwfifo_flush_to_buffer = flush_bmp280_fifo,
+  .read_event_config = read_bmp280_event_config,
+  .write_event_config = write_bmp280_event_config,
+  .read_event_value = read_bmp280_event_value,
+  .write_event_value = write_bmp280_event_value,
+};
+
+static int bmp280_iio_buffer_preenable(struct iio_dev *indio_dev);
+static int bmp280_iio_buffer_postenable(struct iio_dev *indio_dev);
+static int bmp280_iio_buffer_predisable(struct iio_dev *indio_dev);
+static int bmp280_iio_buffer_postdisable(struct iio_dev *indio_dev);
+
+/**
+ * Triggered buffer hooks. They keep the software FIFO in step with the
+ * capture: it starts empty, and nothing is left in it when the capture ends.
+ * They also tell the bus group whether the capture runs on its trigger, and
+ * keep the sensor awake for as long as the capture runs.
+ */
+static const struct iio_buffer_setup_ops bmp280_iio_buffer_setup_ops = {
+  .preenable = bmp280_iio_buffer_preenable,
+  .postenable = bmp280_iio_buffer_postenable,
+  .predisable = bmp280_iio_buffer_predisable,
+  .postdisable = bmp280_iio_buffer_postdisable,
 };
 
+/**
+ * How long the sensor stays idle before it goes to sleep, by default.
+ * Userspace can change it through the device's `power/autosuspend_delay_ms`.
+ */
+#define BMP280_AUTOSUSPEND_DELAY_MS 2000
+
+static int bmp280_iio_runtime_suspend(struct device *dev);
+static int bmp280_iio_runtime_resume(struct device *dev);
+
+/**
+ * Power management operations. System sleep goes through the runtime PM
+ * callbacks, so the sensor sleeps across system suspend, and gets its
+ * configuration back on resume.
+ */
+DEFINE_RUNTIME_DEV_PM_OPS(bmp280_iio_pm_ops, bmp280_iio_runtime_suspend,
+			  bmp280_iio_runtime_resume, NULL);
+
+/**
+ * Power mode names, as written to and read from the `power_mode` attribute,
+ * and the ctrl_meas register encoding for each of them.
+ */
+static const char * const bmp280_power_mode_names[] = { "normal", "forced" };
+static const u8 bmp280_power_modes[] = {
+  BMP280_MODE_NORMAL, BMP280_MODE_FORCED,
+};
+
+/**
+ * Available oversampling ratios and IIR filter coefficients. In both cases,
+ * the register encoding for value `v` is its position in the list (plus one,
+ * for oversampling, since encoding 0 means the measurement is skipped).
+ */
+static const int bmp280_oversampling_ratio_avail[] = { 1, 2, 4, 8, 16 };
+static const int bmp280_filter_coefficient_avail[] = { 1, 2, 4, 8, 16 };
+
 /**
  * Sets up an IIO device and registers it with the IIO subsystem.
  */
-int register_bmp280_iio_device(struct i2c_client *client) {
+int register_bmp280_iio_device(struct device *dev, struct regmap *regmap,
+			       const char *name) {
   // Allocate IIO device structure.
   // devm_* methods do not require corresponding free/unregister calls.
-  // When client->dev is removed, the reverse operation happens automatically.
+  // When dev is removed, the reverse operation happens automatically.
   struct iio_dev *indio_dev =
-    devm_iio_device_alloc(&client->dev,
-			  /*sizeof_priv*/sizeof(struct bmp280_ctx));
+    devm_iio_device_alloc(dev, /*sizeof_priv*/sizeof(struct bmp280_ctx));
   if (!indio_dev) {
     return -ENOMEM;
   }
-  indio_dev->dev.parent = &client->dev;
-  indio_dev->name = client->name;
+  indio_dev->dev.parent = dev;
+  indio_dev->name = name;
+  // With several sensors loaded, the DT `label` tells them apart. It shows up
+  // in the device's `label` sysfs file. It is optional, so errors are fine.
+  device_property_read_string(dev, "label", &indio_dev->label);
   indio_dev->info = &bmp280_iio_info;
   indio_dev->modes = INDIO_DIRECT_MODE | INDIO_BUFFER_TRIGGERED;
   indio_dev->channels = bmp280_iio_channels;
   indio_dev->num_channels = ARRAY_SIZE(bmp280_iio_channels);
   struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
-  int status = setup_bmp280(client, bmp280);
+  // NULL for sensors on SPI.
+  bmp280->client = i2c_verify_client(dev);
+  int status = setup_bmp280(dev, regmap, bmp280);
   if (status) {
     pr_err("Failed to setup BMP280 device.");
     return status;
   }
+  // Sensors on the same I2C adapter share a trigger that reads them together.
+  status = join_bmp280_bus_group(indio_dev);
+  if (status) {
+    pr_err("Failed to join BMP280 bus group.");
+    return status;
+  }
+  // Our own trigger fires in step with the sensor's sampling. Other triggers
+  // can still be selected through the buffer's `trigger/current_trigger`.
+  status = register_bmp280_trigger(indio_dev);
+  if (status) {
+    pr_err("Failed to setup BMP280 trigger.");
+    return status;
+  }
+  // The software FIFO adds its attributes to the buffer's sysfs directory.
+  setup_bmp280_fifo(bmp280);
+  setup_bmp280_filter(bmp280);
+  status = setup_bmp280_events(indio_dev);
+  if (status) {
+    pr_err("Failed to setup BMP280 events.");
+    return status;
+  }
   // iio_pollfunc_store_time is the top-half IRQ handler, which means it runs in
   // interrupt context. It is defined by the IIO core, and its only work is to
   // record the current timestamp.
   // bmp280_iio_trigger_handler is our bottom half, which does the real trigger
   // handling. It runs in a kernel thread, which means we can perform operations
   // that might block, like talking with the sensor over I2C.
-  status = devm_iio_triggered_buffer_setup(&client->dev, indio_dev,
-					   iio_pollfunc_store_time,
-					   bmp280_iio_trigger_handler, NULL);
+  status = devm_iio_triggered_buffer_setup_ext(dev, indio_dev,
+					       iio_pollfunc_store_time,
+					       bmp280_iio_trigger_handler,
+					       IIO_BUFFER_DIRECTION_IN,
+					       &bmp280_iio_buffer_setup_ops,
+					       bmp280_fifo_attributes);
   if (status) {
     pr_err("Failed to setup IIO triggered buffer support.");
     return status;
   }
+  // The runtime PM callbacks find the IIO device through dev.
+  dev_set_drvdata(dev, indio_dev);
+  // setup_bmp280 left the sensor configured and running, so runtime PM starts
+  // out active, and lets the sensor sleep once it has been idle for a while.
+  pm_runtime_get_noresume(dev);
+  pm_runtime_set_active(dev);
+  status = devm_pm_runtime_enable(dev);
+  if (status) {
+    pm_runtime_put_noidle(dev);
+    pr_err("Failed to enable runtime PM.");
+    return status;
+  }
+  pm_runtime_set_autosuspend_delay(dev, BMP280_AUTOSUSPEND_DELAY_MS);
+  pm_runtime_use_autosuspend(dev);
+  pm_runtime_put(dev);
   // Register device with the IIO subsystem
-  status = devm_iio_device_register(&client->dev, indio_dev);
+  status = devm_iio_device_register(dev, indio_dev);
   if (status) {
     pr_err("Failed to register with IIO subsystem.");
     return status;
   }
+  // Hot path statistics, in the directory the IIO core just created.
+  register_bmp280_debugfs(indio_dev);
   return 0;
 }
 
 /**
- * IIO driver's read method.
- * This method identifies which of the IIO channels is being requested,
- * and assembles the result from sensor specific methos.
+ * Wakes the sensor up, if it was sleeping, and keeps it awake until the
+ * matching bmp280_iio_pm_put.
  */
-static int bmp280_iio_read_from_channel(struct iio_dev *indio_dev,
-					struct iio_chan_spec const *chan,
-					int *val, int *val2) {
-  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+static int bmp280_iio_pm_get(struct bmp280_ctx *bmp280) {
+  return pm_runtime_resume_and_get(bmp280->dev);
+}
+
+/**
+ * Lets the sensor go back to sleep, once it has been idle for the autosuspend
+ * delay.
+ */
+static void bmp280_iio_pm_put(struct bmp280_ctx *bmp280) {
+  pm_runtime_mark_last_busy(bmp280->dev);
+  pm_runtime_put_autosuspend(bmp280->dev);
+}
+
+/**
+ * Assembles the value of a single channel from an already read and
+ * compensated sample.
+ * It never talks with the sensor, so any number of channels can be built from
+ * the same burst read. Processed values are returned unscaled, in units of
+ * 1/100 degrees Celcius, 1/256 Pascal and millimeters.
+ */
+static int
+bmp280_iio_value_from_sample(struct bmp280_ctx *bmp280,
+			     struct iio_chan_spec const *chan,
+			     const struct bmp280_raw_sample *sample,
+			     const struct bmp280_compensated_sample *compensated,
+			     int *val) {
   if (chan->type == IIO_TEMP) {
     if (iio_channel_has_info(chan, IIO_CHAN_INFO_RAW) && chan->indexed &&
 	0 <= chan->channel && chan->channel < 3) {
-      // One of the constant temperature calibration values.
-      *val = bmp280->dig_T[chan->channel + 1];
-      return IIO_VAL_INT;      
+      *val = bmp280_calibration_value(bmp280->calibration.dig_T,
+				      chan->channel);
     } else if (iio_channel_has_info(chan, IIO_CHAN_INFO_RAW) && chan->indexed &&
 	       chan->channel == 3) {
-      // Raw temperature value
-      s32 raw_temp;
-      int status = read_bmp280_raw_temperature(bmp280, &raw_temp);
-      if (status) {
-	return status;
-      }
-      *val = raw_temp;
-      return IIO_VAL_INT;
+      *val = sample->raw_temp;
     } else if (iio_channel_has_info(chan, IIO_CHAN_INFO_PROCESSED)) {
-      // Processed temperature value. *val contains the temperature in
-      // 100ths of Celcius. So we set *val2 and return IIO_VAL_FRACTIONAL such
-      // that the IIO core produces a fractional value to userspace.
-      s32 temp;
-      int status = read_bmp280_processed_temperature(bmp280, &temp);
-      if (status) {
-	return status;
-      }
-      *val = temp;
-      *val2 = 100;
-      return IIO_VAL_FRACTIONAL;
+      *val = compensated->temp;
     } else {
       pr_err("Unexpected temperature channel\n");
       return -EINVAL;
     }
-  } else if(chan->type == IIO_PRESSURE) {
+  } else if (chan->type == IIO_PRESSURE) {
     if (iio_channel_has_info(chan, IIO_CHAN_INFO_RAW) && chan->indexed &&
 	0 <= chan->channel && chan->channel < 9) {
-      // One of the constant pressure calibration values.
-      *val = bmp280->dig_P[chan->channel + 1];
-      return IIO_VAL_INT;
+      *val = bmp280_calibration_value(bmp280->calibration.dig_P,
+				      chan->channel);
     } else if (iio_channel_has_info(chan, IIO_CHAN_INFO_RAW) && chan->indexed &&
 	       chan->channel == 9) {
-      // Raw pressure value
-      s32 raw_press;
-      int status = read_bmp280_raw_pressure(bmp280, &raw_press);
-      if (status) {
-	return status;
-      }
-      *val = raw_press;
-      return IIO_VAL_INT;
+      *val = sample->raw_press;
     } else if (iio_channel_has_info(chan, IIO_CHAN_INFO_PROCESSED)) {
-      // Processed pressure value. *val contains the pressure in
-      // 1/256 of Pascal. So we set *val2 and return IIO_VAL_FRACTIONAL such
-      // that the IIO core produces a fractional value to userspace.
-      u32 press;
-      int status = read_bmp280_processed_pressure(bmp280, &press);
-      if (status) {
-	return status;
-      }
-      *val = press;
-      *val2 = 256;
-      return IIO_VAL_FRACTIONAL;
+      *val = compensated->press;
     } else {
       pr_err("Unexpected pressure channel\n");
       return -EINVAL;
     }
+  } else if (chan->type == IIO_DISTANCE) {
+    *val = compensate_bmp280_altitude(bmp280, compensated->press);
   } else {
     pr_err("Unexpected channel type: %d\n", chan->type);
     return -EINVAL;
   }
+  return 0;
+}
+
+/**
+ * Whether the channel is one of the constant calibration values, which we
+ * keep in the BMP280 context structure, and do not need the sensor for.
+ */
+static bool bmp280_iio_is_calibration_channel(struct iio_chan_spec const *chan) {
+  if (!iio_channel_has_info(chan, IIO_CHAN_INFO_RAW) || !chan->indexed) {
+    return false;
+  }
+  int count = chan->type == IIO_TEMP ? 3 : 9;
+  return 0 <= chan->channel && chan->channel < count;
+}
+
+/**
+ * IIO driver's read method.
+ * This method identifies which of the IIO channels is being requested,
+ * and assembles the result from sensor specific methods.
+ * Processed values are returned along with their scale, so that the IIO core
+ * produces a fractional value to userspace: temperature is in 100ths of
+ * Celcius, pressure is in 1/256 of Pascal, and altitude is in millimeters.
+ * Measurements come from read_bmp280_cached_sample. If a buffer capture is
+ * running, we cannot claim direct mode, so we do not talk with the sensor at
+ * all, and return the last sample read by the trigger handler instead.
+ * Reading the sensor wakes it up, if it was sleeping.
+ */
+static int bmp280_iio_read_from_channel(struct iio_dev *indio_dev,
+					struct iio_chan_spec const *chan,
+					int *val, int *val2) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_raw_sample sample = { 0 };
+  struct bmp280_compensated_sample compensated = { 0 };
+  if (!bmp280_iio_is_calibration_channel(chan)) {
+    int status = iio_device_claim_direct_mode(indio_dev);
+    if (status == 0) {
+      status = bmp280_iio_pm_get(bmp280);
+      if (status == 0) {
+	status = read_bmp280_cached_sample(bmp280, &sample);
+	bmp280_iio_pm_put(bmp280);
+      }
+      iio_device_release_direct_mode(indio_dev);
+    } else if (peek_bmp280_cached_sample(bmp280, &sample)) {
+      status = 0;
+    }
+    if (status) {
+      return status;
+    }
+    compensate_bmp280_samples(bmp280, &sample.raw_temp, &sample.raw_press,
+			      &compensated.temp, &compensated.press, 1);
+  }
+  int status = bmp280_iio_value_from_sample(bmp280, chan, &sample,
+					    &compensated, val);
+  if (status) {
+    return status;
+  }
+  if (iio_channel_has_info(chan, IIO_CHAN_INFO_PROCESSED)) {
+    *val2 = chan->type == IIO_TEMP ? 100 :
+      chan->type == IIO_PRESSURE ? 256 : 1000;
+    return IIO_VAL_FRACTIONAL;
+  }
+  return IIO_VAL_INT;
+}
+
+/**
+ * Converts a sampling period, in microseconds, to a frequency in Hz, in the
+ * IIO_VAL_INT_PLUS_MICRO format.
+ */
+static void bmp280_iio_period_to_frequency(u32 period_us, int *val, int *val2) {
+  u64 frequency_uhz = div_u64(1000000000000ULL, period_us);
+  u32 remainder_uhz;
+  *val = div_u64_rem(frequency_uhz, 1000000, &remainder_uhz);
+  *val2 = remainder_uhz;
 }
 
 /**
  * IIO driver's read method.
  * This method is callbed when directly reading from the sysfs channel files.
+ * Channel values are read from the sensor, while configuration values come
+ * from the configuration last written to it.
  */
 static int bmp280_iio_read_raw(struct iio_dev *indio_dev,
 			       struct iio_chan_spec const *chan,
 			       int *val, int *val2, long mask) {
-  return bmp280_iio_read_from_channel(indio_dev, chan, val, val2);
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  if (mask == IIO_CHAN_INFO_RAW || mask == IIO_CHAN_INFO_PROCESSED) {
+    return bmp280_iio_read_from_channel(indio_dev, chan, val, val2);
+  } else if (mask == IIO_CHAN_INFO_CALIBBIAS) {
+    *val = get_bmp280_sea_level_pressure(bmp280);
+    return IIO_VAL_INT;
+  }
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  if (mask == IIO_CHAN_INFO_OVERSAMPLING_RATIO) {
+    u8 osrs = chan->type == IIO_TEMP ? config.osrs_t : config.osrs_p;
+    *val = bmp280_oversampling_ratio(osrs);
+    return IIO_VAL_INT;
+  } else if (mask == IIO_CHAN_INFO_SAMP_FREQ) {
+    bmp280_iio_period_to_frequency(compute_bmp280_sampling_period_us(&config),
+				   val, val2);
+    return IIO_VAL_INT_PLUS_MICRO;
+  } else if (mask == IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY) {
+    *val = bmp280_filter_coefficient(config.filter);
+    return IIO_VAL_INT;
+  } else {
+    return -EINVAL;
+  }
 }
 
 /**
- * IIO driver's triggered buffered handler.
- * This method is called (in a separate kernel thread), for each fired trigger,
- * when using triggered buffer mode.
- * It computes the result for each of a subset of enabled channels,
- * and assembles them together into a buffer, according to each channel's
- * scan_type information.
+ * IIO driver's read available values method.
+ * This method is called when reading from the sysfs `*_available` files.
+ * Available sampling frequencies depend on the measurement time, and thus on
+ * the current oversampling ratios, so we recompute them on every call.
  */
-static irqreturn_t bmp280_iio_trigger_handler(int irq, void *p) {
-  struct iio_poll_func *pf = (struct iio_poll_func *)p;
-  struct iio_dev *indio_dev = pf->indio_dev;
-  void *data = kzalloc(indio_dev->scan_bytes, GFP_KERNEL);
-  if (!data) {
-    pr_err("Failed allocating memory during trigger handling.\n");
-    goto trigger_notify;
-  }
-  void *data_ptr = data;
-  int i;
-  for_each_set_bit(i, indio_dev->active_scan_mask, indio_dev->num_channels) {
+static int bmp280_iio_read_avail(struct iio_dev *indio_dev,
+				 struct iio_chan_spec const *chan,
+				 const int **vals, int *type, int *length,
+				 long mask) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  if (mask == IIO_CHAN_INFO_OVERSAMPLING_RATIO) {
+    *vals = bmp280_oversampling_ratio_avail;
+    *type = IIO_VAL_INT;
+    *length = ARRAY_SIZE(bmp280_oversampling_ratio_avail);
+    return IIO_AVAIL_LIST;
+  } else if (mask == IIO_CHAN_INFO_SAMP_FREQ) {
+    // List from the slowest (longest standby) to the fastest frequency.
+    // Concurrent readers all write the same values, unless oversampling
+    // changes in between, in which case the list is refreshed on next read.
+    struct bmp280_config config;
+    get_bmp280_config(bmp280, &config);
+    int *avail = bmp280->sampling_frequency_avail;
+    for (int t_sb = BMP280_T_SB_MAX; t_sb >= 0; t_sb--, avail += 2) {
+      config.t_sb = t_sb;
+      bmp280_iio_period_to_frequency(compute_bmp280_sampling_period_us(&config),
+				     &avail[0], &avail[1]);
+    }
+    *vals = bmp280->sampling_frequency_avail;
+    *type = IIO_VAL_INT_PLUS_MICRO;
+    *length = ARRAY_SIZE(bmp280->sampling_frequency_avail);
+    return IIO_AVAIL_LIST;
+  } else if (mask == IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY) {
+    *vals = bmp280_filter_coefficient_avail;
+    *type = IIO_VAL_INT;
+    *length = ARRAY_SIZE(bmp280_filter_coefficient_avail);
+    return IIO_AVAIL_LIST;
+  } else {
+    return -EINVAL;
+  }
+}
+
+/**
+ * Finds the position of `val` in one of the available values lists.
+ * Returns -EINVAL if the value is not in the list.
+ */
+static int bmp280_iio_find_avail(const int *avail, size_t length, int val) {
+  for (size_t i = 0; i < length; i++) {
+    if (avail[i] == val) {
+      return i;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * Applies a single configuration attribute write. Called with direct mode
+ * claimed. See bmp280_iio_write_raw.
+ */
+static int bmp280_iio_write_config(struct iio_dev *indio_dev,
+				   struct iio_chan_spec const *chan,
+				   int val, int val2, long mask) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  if (mask == IIO_CHAN_INFO_OVERSAMPLING_RATIO) {
+    int index = bmp280_iio_find_avail(bmp280_oversampling_ratio_avail,
+				      ARRAY_SIZE(bmp280_oversampling_ratio_avail),
+				      val);
+    if (index < 0 || val2 != 0) {
+      return -EINVAL;
+    }
+    if (chan->type == IIO_TEMP) {
+      config.osrs_t = index + 1;
+    } else {
+      config.osrs_p = index + 1;
+    }
+  } else if (mask == IIO_CHAN_INFO_SAMP_FREQ) {
+    if (val < 0 || val2 < 0 || (val == 0 && val2 == 0)) {
+      return -EINVAL;
+    }
+    u64 requested_uhz = (u64)val * 1000000 + val2;
+    u64 best_diff = U64_MAX;
+    for (int t_sb = 0; t_sb <= BMP280_T_SB_MAX; t_sb++) {
+      struct bmp280_config candidate = config;
+      candidate.t_sb = t_sb;
+      u64 frequency_uhz = div_u64(1000000000000ULL,
+				  compute_bmp280_sampling_period_us(&candidate));
+      u64 diff = frequency_uhz > requested_uhz ?
+	frequency_uhz - requested_uhz : requested_uhz - frequency_uhz;
+      if (diff < best_diff) {
+	best_diff = diff;
+	config.t_sb = t_sb;
+      }
+    }
+  } else if (mask == IIO_CHAN_INFO_LOW_PASS_FILTER_3DB_FREQUENCY) {
+    int index = bmp280_iio_find_avail(bmp280_filter_coefficient_avail,
+				      ARRAY_SIZE(bmp280_filter_coefficient_avail),
+				      val);
+    if (index < 0 || val2 != 0) {
+      return -EINVAL;
+    }
+    config.filter = index;
+  } else {
+    return -EINVAL;
+  }
+  return write_bmp280_config(bmp280, &config);
+}
+
+/**
+ * IIO driver's write method.
+ * This method is called when writing to the sysfs configuration files.
+ * Oversampling ratio and IIR filter coefficient must be one of the values
+ * listed in the respective `*_available` files. For the sampling frequency,
+ * we pick the standby time that gets us the closest to the requested value.
+ * Configuration cannot change while a buffer capture is running. Claiming
+ * direct mode also serializes concurrent writers, so the read-modify-write
+ * of the configuration does not lose updates.
+ * The sensor is woken up for the write, so a sleeping sensor does not start
+ * sampling before it is due to resume.
+ * The sea level pressure, in whole Pascals, is not written to the sensor, so
+ * it can change at any time, even while capturing.
+ */
+static int bmp280_iio_write_raw(struct iio_dev *indio_dev,
+				struct iio_chan_spec const *chan,
+				int val, int val2, long mask) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  if (mask == IIO_CHAN_INFO_CALIBBIAS) {
+    if (val < 0 || val2 != 0) {
+      return -EINVAL;
+    }
+    return set_bmp280_sea_level_pressure(bmp280, val);
+  }
+  int status = iio_device_claim_direct_mode(indio_dev);
+  if (status) {
+    return status;
+  }
+  status = bmp280_iio_pm_get(bmp280);
+  if (status == 0) {
+    status = bmp280_iio_write_config(indio_dev, chan, val, val2, mask);
+    bmp280_iio_pm_put(bmp280);
+  }
+  iio_device_release_direct_mode(indio_dev);
+  return status;
+}
+
+/**
+ * `power_mode` sysfs attribute show function.
+ */
+static ssize_t bmp280_iio_power_mode_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  const char *name = config.mode == BMP280_MODE_FORCED ? "forced" : "normal";
+  return sysfs_emit(buf, "%s\n", name);
+}
+
+/**
+ * `power_mode` sysfs attribute store function.
+ * Accepts one of the names listed in `power_mode_available`.
+ */
+static ssize_t bmp280_iio_power_mode_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count) {
+  struct iio_dev *indio_dev = dev_to_iio_dev(dev);
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  int index = sysfs_match_string(bmp280_power_mode_names, buf);
+  if (index < 0) {
+    return index;
+  }
+  // Same as for bmp280_iio_write_raw: no changes while capturing, concurrent
+  // writers are serialized, and the sensor is awake for the write.
+  int status = iio_device_claim_direct_mode(indio_dev);
+  if (status) {
+    return status;
+  }
+  status = bmp280_iio_pm_get(bmp280);
+  if (status == 0) {
+    struct bmp280_config config;
+    get_bmp280_config(bmp280, &config);
+    config.mode = bmp280_power_modes[index];
+    status = write_bmp280_config(bmp280, &config);
+    bmp280_iio_pm_put(bmp280);
+  }
+  iio_device_release_direct_mode(indio_dev);
+  if (status) {
+    return status;
+  }
+  return count;
+}
+
+/**
+ * `sample_cache_window_us` sysfs attribute show function.
+ * Shows the window currently in effect, even when it follows the sensor's
+ * sampling period.
+ */
+static ssize_t bmp280_iio_cache_window_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  return sysfs_emit(buf, "%u\n", compute_bmp280_cache_window_us(bmp280));
+}
+
+/**
+ * `sample_cache_window_us` sysfs attribute store function.
+ * Accepts a window in microseconds, where 0 disables the cache, or "auto" to
+ * have the window follow the sensor's sampling period.
+ */
+static ssize_t bmp280_iio_cache_window_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  if (sysfs_streq(buf, "auto")) {
+    WRITE_ONCE(bmp280->cache_window_us, BMP280_CACHE_WINDOW_AUTO);
+    return count;
+  }
+  s32 window_us;
+  // base=0 means autodetect base
+  int status = kstrtos32(buf, /*base=*/0, &window_us);
+  if (status) {
+    return status;
+  }
+  if (window_us < 0) {
+    return -EINVAL;
+  }
+  WRITE_ONCE(bmp280->cache_window_us, window_us);
+  return count;
+}
+
+/**
+ * Bus error counter sysfs attributes show function.
+ */
+static ssize_t bmp280_iio_health_counter_show(struct device *dev,
+					      struct device_attribute *attr,
+					      char *buf) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  const atomic_t *counter =
+    (const void *)&bmp280->health + to_iio_dev_attr(attr)->address;
+  return sysfs_emit(buf, "%d\n", atomic_read(counter));
+}
+
+/**
+ * `rolling_window_ms` and `decimation_factor` sysfs attributes show function.
+ */
+static ssize_t bmp280_iio_filter_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  u32 value = attr == &iio_dev_attr_rolling_window_ms.dev_attr ?
+    get_bmp280_rolling_window(bmp280) : get_bmp280_decimation_factor(bmp280);
+  return sysfs_emit(buf, "%u\n", value);
+}
+
+/**
+ * `rolling_window_ms` and `decimation_factor` sysfs attributes store
+ * function. Both can change while capturing.
+ */
+static ssize_t bmp280_iio_filter_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count) {
+  struct bmp280_ctx *bmp280 = iio_priv(dev_to_iio_dev(dev));
+  u32 value;
+  // base=0 means autodetect base
+  int status = kstrtou32(buf, /*base=*/0, &value);
+  if (status) {
+    return status;
+  }
+  if (attr == &iio_dev_attr_rolling_window_ms.dev_attr) {
+    set_bmp280_rolling_window(bmp280, value);
+  } else {
+    status = set_bmp280_decimation_factor(bmp280, value);
+  }
+  if (status) {
+    return status;
+  }
+  return count;
+}
+
+/**
+ * Rolling statistics channel attributes read function. Values are in the
+ * units of the processed channels, and there are none until a sample has
+ * been read from the sensor within the window, by a sysfs read, the event
+ * sampler or a capture.
+ */
+static ssize_t bmp280_iio_rolling_read(struct iio_dev *indio_dev,
+				       uintptr_t private,
+				       struct iio_chan_spec const *chan,
+				       char *buf) {
+  enum bmp280_rolling_value value =
+    chan->type == IIO_TEMP ? BMP280_ROLLING_TEMP : BMP280_ROLLING_PRESS;
+  s64 result;
+  int status = read_bmp280_rolling_stat(iio_priv(indio_dev), value, private,
+					ktime_get_ns(), &result);
+  if (status) {
+    return status;
+  }
+  // Same format as the IIO core gives IIO_VAL_FRACTIONAL values, such as
+  // in_temp_input and in_pressure_input.
+  s64 nano = div_s64(result * 1000000000LL, chan->type == IIO_TEMP ? 100 : 256);
+  s32 fraction;
+  s64 integer = div_s64_rem(nano, 1000000000, &fraction);
+  const char *sign = nano < 0 && integer == 0 ? "-" : "";
+  return sysfs_emit(buf, "%s%lld.%09d\n", sign, integer, abs(fraction));
+}
+
+/**
+ * Triggered buffer preenable hook. Wakes the sensor up for the whole capture,
+ * and drops samples left over from a previous capture, including a partial
+ * decimation block.
+ */
+static int bmp280_iio_buffer_preenable(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  int status = bmp280_iio_pm_get(bmp280);
+  if (status) {
+    return status;
+  }
+  reset_bmp280_fifo(bmp280);
+  reset_bmp280_decimation(bmp280);
+  return 0;
+}
+
+/**
+ * Triggered buffer postenable hook. The trigger is attached by now, so we
+ * know whether the sensor should be read with the rest of its bus group.
+ */
+static int bmp280_iio_buffer_postenable(struct iio_dev *indio_dev) {
+  set_bmp280_bus_batched(indio_dev, using_bmp280_bus_trigger(indio_dev));
+  return 0;
+}
+
+/**
+ * Triggered buffer predisable hook. Pushes the samples still in the FIFO,
+ * while the IIO buffers can take them.
+ */
+static int bmp280_iio_buffer_predisable(struct iio_dev *indio_dev) {
+  set_bmp280_bus_batched(indio_dev, false);
+  return drain_bmp280_fifo(indio_dev);
+}
+
+/**
+ * Triggered buffer postdisable hook. The capture is over, so the sensor can
+ * go to sleep once it has been idle for a while.
+ */
+static int bmp280_iio_buffer_postdisable(struct iio_dev *indio_dev) {
+  bmp280_iio_pm_put(iio_priv(indio_dev));
+  return 0;
+}
+
+/**
+ * Runtime PM suspend callback. Puts the sensor to sleep.
+ */
+static int bmp280_iio_runtime_suspend(struct device *dev) {
+  struct iio_dev *indio_dev = dev_get_drvdata(dev);
+  return suspend_bmp280(iio_priv(indio_dev));
+}
+
+/**
+ * Runtime PM resume callback. Restores the sensor configuration from the
+ * shadow copy in bmp280_ctx, which also covers sensors that lost power during
+ * system suspend.
+ */
+static int bmp280_iio_runtime_resume(struct device *dev) {
+  struct iio_dev *indio_dev = dev_get_drvdata(dev);
+  return resume_bmp280(iio_priv(indio_dev));
+}
+
+int bmp280_iio_push_sample(struct iio_dev *indio_dev,
+			   const struct bmp280_raw_sample *pushed_sample,
+			   const struct bmp280_compensated_sample *pushed,
+			   s64 timestamp) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  check_bmp280_events(indio_dev, pushed, timestamp);
+  // Decimation only lets the mean of each block through.
+  struct bmp280_raw_sample filtered_sample = *pushed_sample;
+  struct bmp280_compensated_sample filtered = *pushed;
+  if (!filter_bmp280_sample(bmp280, &filtered_sample, &filtered)) {
+    return 0;
+  }
+  const struct bmp280_raw_sample *sample = &filtered_sample;
+  const struct bmp280_compensated_sample *compensated = &filtered;
+  // Clear any leftovers from the previous scan, so padding bytes are zero.
+  memset(&bmp280->scan, 0, sizeof(bmp280->scan));
+  u8 *data_ptr = bmp280->scan.data;
+  for (int i = 0; i < indio_dev->num_channels; i++) {
     const struct iio_chan_spec *chan = &indio_dev->channels[i];
-    int val, val2; // val2 is not used here.
-    int status = bmp280_iio_read_from_channel(indio_dev, chan, &val, &val2);
+    if (chan->scan_index < 0 || chan->type == IIO_TIMESTAMP ||
+	!test_bit(chan->scan_index, indio_dev->active_scan_mask)) {
+      // Not captured, or filled in by iio_push_to_buffers_with_timestamp.
+      continue;
+    }
+    int val;
+    int status = bmp280_iio_value_from_sample(bmp280, chan, sample,
+					      compensated, &val);
     if (status < 0) {
       pr_err("Failed to read from channel #%d.\n", i);
-      goto free_data;
+      return status;
     }
     // Store data, handling the possible data types.
     if (chan->scan_type.storagebits == 16) {
+      data_ptr = PTR_ALIGN(data_ptr, sizeof(u16));
       if (chan->scan_type.sign == 's') {
 	*((s16 *)data_ptr) = (s16)val;
       } else {
@@ -345,6 +1154,7 @@ static irqreturn_t bmp280_iio_trigger_handler(int irq, void *p) {
       }
       data_ptr += 2; // Advance 16 bits
     } else if (chan->scan_type.storagebits == 32) {
+      data_ptr = PTR_ALIGN(data_ptr, sizeof(u32));
       if (chan->scan_type.sign == 's') {
 	*((s32 *)data_ptr) = (s32)val;
       } else {
@@ -354,17 +1164,108 @@ static irqreturn_t bmp280_iio_trigger_handler(int irq, void *p) {
     } else {
       pr_err("Unexpected channel storage bits %d.\n",
 	     chan->scan_type.storagebits);
-      goto free_data;
+      return -EINVAL;
     }
   }
-  int status = iio_push_to_buffers(indio_dev, data);
+  int status = iio_push_to_buffers_with_timestamp(indio_dev, &bmp280->scan,
+						  timestamp);
+  trace_bmp280_push(indio_dev, sample->raw_temp, sample->raw_press,
+		    compensated->temp, compensated->press, timestamp, status);
+  if (status) {
+    count_bmp280_stat(bmp280, BMP280_STAT_SAMPLES_DROPPED, 1);
+    pr_err_ratelimited("Failed to push data to IIO buffers.\n");
+    return status;
+  }
+  count_bmp280_stat(bmp280, BMP280_STAT_SAMPLES_PUSHED, 1);
+  // The timestamp is in the device's clock, like iio_get_time_ns. A batched
+  // sample's latency includes the time it waited in the FIFO.
+  s64 latency_ns = iio_get_time_ns(indio_dev) - timestamp;
+  if (latency_ns > 0) {
+    record_bmp280_latency(bmp280, BMP280_LATENCY_TRIGGER_TO_PUSH, latency_ns);
+  }
+  return 0;
+}
+
+/**
+ * IIO driver's triggered buffered handler.
+ * This method is called (in a separate kernel thread), for each fired trigger,
+ * when using triggered buffer mode.
+ * It reads a full sample from the sensor with a single burst read, and hands
+ * it to the software FIFO, which either pushes it to the IIO buffers right
+ * away, or holds it until a full batch is ready. The sample is timestamped
+ * with the time recorded by iio_pollfunc_store_time, or with the end of the
+ * conversion when our own trigger saw it.
+ * A scan that cannot be read, even after retries, is still pushed, as a gap:
+ * its raw values are BMP280_RAW_SKIPPED.
+ */
+static irqreturn_t bmp280_iio_trigger_handler(int irq, void *p) {
+  struct iio_poll_func *pf = (struct iio_poll_func *)p;
+  struct iio_dev *indio_dev = pf->indio_dev;
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  s64 timestamp = pf->timestamp;
+  trace_bmp280_trigger(indio_dev, timestamp);
+  struct bmp280_trigger_cycle cycle;
+  bool own_trigger = iio_trigger_using_own(indio_dev);
+  if (own_trigger) {
+    start_bmp280_trigger_cycle(indio_dev, &cycle, &timestamp);
+  }
+  struct bmp280_raw_sample sample;
+  int status;
+  trace_bmp280_read_start(indio_dev, timestamp);
+  if (using_bmp280_bus_trigger(indio_dev)) {
+    // Read together with every sensor on the adapter, with their timestamp.
+    status = read_bmp280_bus_sample(indio_dev, &sample, &timestamp);
+  } else {
+    // One I2C transfer per trigger, regardless of how many channels are
+    // enabled.
+    status = read_bmp280_raw_sample(bmp280, &sample);
+  }
   if (status) {
-    pr_err("Failed to push data to IIO buffers.\n");
-    goto free_data;
+    // Report the failed scan as a gap, rather than dropping it, so readers
+    // see where the capture lost samples. The bus errors themselves were
+    // already logged and counted.
+    atomic_inc(&bmp280->health.gaps);
+    sample.raw_temp = BMP280_RAW_SKIPPED;
+    sample.raw_press = BMP280_RAW_SKIPPED;
+  }
+  trace_bmp280_read_end(indio_dev, sample.raw_temp, sample.raw_press,
+			timestamp, status);
+  // Gaps skip the duplicate check, and go straight to the FIFO.
+  if (!status && own_trigger &&
+      !accept_bmp280_trigger_sample(indio_dev, &cycle)) {
+    goto rearm;
+  }
+  // Goes straight to the IIO buffers, unless the FIFO holds it for a batch.
+  status = store_bmp280_fifo_sample(indio_dev, &sample, timestamp);
+  if (status) {
+    pr_err_ratelimited("Failed to store sample.\n");
+  }
+ rearm:
+  if (own_trigger) {
+    finish_bmp280_trigger_cycle(indio_dev, &cycle);
   }
- free_data:
-  kfree(data);
- trigger_notify:
   iio_trigger_notify_done(indio_dev->trig);
   return IRQ_HANDLED;
 }
+
+/**
+ * `calibration` attribute read function.
+ */
+static ssize_t bmp280_iio_calibration_read(struct file *file,
+					   struct kobject *kobj,
+					   struct bin_attribute *attr,
+					   char *buf, loff_t offset,
+					   size_t count) {
+  struct iio_dev *indio_dev = dev_to_iio_dev(kobj_to_dev(kobj));
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  const struct bmp280_calibration *calibration = &bmp280->calibration;
+  __le16 words[BMP280_CALIBRATION_LENGTH / sizeof(__le16)];
+  int n = 0;
+  for (int i = 0; i < ARRAY_SIZE(calibration->dig_T); i++) {
+    words[n++] = cpu_to_le16(calibration->dig_T[i]);
+  }
+  for (int i = 0; i < ARRAY_SIZE(calibration->dig_P); i++) {
+    words[n++] = cpu_to_le16(calibration->dig_P[i]);
+  }
+  return memory_read_from_buffer(buf, count, &offset, words, sizeof(words));
+}
@@ -0,0 +1,147 @@
+/**
+ * This file implements the hot path statistics, exposed in debugfs.
+ * Each sensor gets two files in its IIO device's debugfs directory,
+ * `/sys/kernel/debug/iio/iio:deviceX/`: `stats`, with event and bus error
+ * counters, and `latency`, with log2 histograms of bus transfer, compensation
+ * and trigger to push times.
+ * Counters are kept per CPU, and updated with this_cpu operations, see the
+ * inline helpers in bmp280.h, so the hot path never takes a lock or bounces a
+ * cache line for them. Reading the files adds up all CPUs. On 32 bit CPUs, a
+ * value can be read while it is half updated, which is fine for statistics.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/iio/iio.h>
+#include <linux/kconfig.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include "bmp280.h"
+
+/**
+ * Names of the event counters and latencies in the debugfs files, indexed by
+ * enum bmp280_stat and enum bmp280_latency respectively.
+ */
+static const char * const bmp280_stat_names[BMP280_STAT_COUNT] = {
+  "samples_pushed", "samples_dropped", "cache_hits", "cache_misses",
+  "bus_bytes",
+};
+static const char * const bmp280_latency_names[BMP280_LATENCY_COUNT] = {
+  "transfer", "compensation", "trigger_to_push",
+};
+
+int setup_bmp280_stats(struct device *dev, struct bmp280_ctx *bmp280) {
+  if (!IS_ENABLED(CONFIG_DEBUG_FS)) {
+    return 0;
+  }
+  bmp280->stats = devm_alloc_percpu(dev, struct bmp280_cpu_stats);
+  if (!bmp280->stats) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * Adds up one event counter over all CPUs.
+ */
+static u64 sum_bmp280_stat(const struct bmp280_ctx *bmp280,
+			   enum bmp280_stat stat) {
+  u64 sum = 0;
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    sum += per_cpu_ptr(bmp280->stats, cpu)->counters[stat];
+  }
+  return sum;
+}
+
+/**
+ * Adds up one latency histogram, and its total time, over all CPUs.
+ */
+static void sum_bmp280_latency(const struct bmp280_ctx *bmp280,
+			       enum bmp280_latency latency,
+			       u64 hist[BMP280_LATENCY_BUCKETS],
+			       u64 *total_ns) {
+  memset(hist, 0, BMP280_LATENCY_BUCKETS * sizeof(*hist));
+  *total_ns = 0;
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    const struct bmp280_cpu_stats *stats = per_cpu_ptr(bmp280->stats, cpu);
+    for (int i = 0; i < BMP280_LATENCY_BUCKETS; i++) {
+      hist[i] += stats->latency_hist[latency][i];
+    }
+    *total_ns += stats->latency_total_ns[latency];
+  }
+}
+
+/**
+ * `stats` debugfs file. One `name value` pair per line. The bus error
+ * counters are the same as the device's sysfs attributes.
+ */
+static int bmp280_stats_show(struct seq_file *s, void *unused) {
+  struct bmp280_ctx *bmp280 = s->private;
+  for (int i = 0; i < BMP280_STAT_COUNT; i++) {
+    seq_printf(s, "%s %llu\n", bmp280_stat_names[i],
+	       sum_bmp280_stat(bmp280, i));
+  }
+  struct bmp280_health *health = &bmp280->health;
+  seq_printf(s, "transfer_errors %d\n", atomic_read(&health->transfer_errors));
+  seq_printf(s, "transfer_retries %d\n", atomic_read(&health->retries));
+  seq_printf(s, "fast_fails %d\n", atomic_read(&health->fast_fails));
+  seq_printf(s, "reprobes %d\n", atomic_read(&health->reprobes));
+  seq_printf(s, "scan_gaps %d\n", atomic_read(&health->gaps));
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bmp280_stats);
+
+/**
+ * `latency` debugfs file. For each latency, a summary line with the number of
+ * measurements and their mean, then one line per non-empty bucket, with its
+ * range in nanoseconds and its count.
+ */
+static int bmp280_latency_show(struct seq_file *s, void *unused) {
+  struct bmp280_ctx *bmp280 = s->private;
+  for (int i = 0; i < BMP280_LATENCY_COUNT; i++) {
+    u64 hist[BMP280_LATENCY_BUCKETS];
+    u64 total_ns;
+    sum_bmp280_latency(bmp280, i, hist, &total_ns);
+    u64 count = 0;
+    for (int b = 0; b < BMP280_LATENCY_BUCKETS; b++) {
+      count += hist[b];
+    }
+    seq_printf(s, "%s: count %llu, mean %llu ns\n", bmp280_latency_names[i],
+	       count, count ? div64_u64(total_ns, count) : 0);
+    for (int b = 0; b < BMP280_LATENCY_BUCKETS; b++) {
+      if (!hist[b]) {
+	continue;
+      }
+      u64 low = b ? 1ULL << b : 0;
+      if (b == BMP280_LATENCY_BUCKETS - 1) {
+	seq_printf(s, "  [%llu, inf) %llu\n", low, hist[b]);
+      } else {
+	seq_printf(s, "  [%llu, %llu] %llu\n", low, (2ULL << b) - 1, hist[b]);
+      }
+    }
+  }
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bmp280_latency);
+
+void register_bmp280_debugfs(struct iio_dev *indio_dev) {
+  struct dentry *dir = iio_get_debugfs_dentry(indio_dev);
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  if (!IS_ENABLED(CONFIG_DEBUG_FS) || !dir) {
+    return;
+  }
+  // The IIO core removes the whole directory when the device is
+  // unregistered. Debugfs errors are not fatal, so we do not check them.
+  debugfs_create_file("stats", 0444, dir, bmp280, &bmp280_stats_fops);
+  debugfs_create_file("latency", 0444, dir, bmp280, &bmp280_latency_fops);
+}
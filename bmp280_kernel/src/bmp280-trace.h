@@ -0,0 +1,137 @@
+/**
+ * Trace events for sample acquisition, following a sample from the trigger
+ * handler to the IIO buffers:
+ *     * bmp280_trigger: the trigger handler starts.
+ *     * bmp280_read_start and bmp280_read_end: the sample is read from the
+ * sensor, on its own or with the rest of its bus group.
+ *     * bmp280_compensate: the sample is compensated, possibly in a batch.
+ *     * bmp280_push: the sample is pushed to the IIO buffers.
+ * Every event carries the IIO device id, and the sample's timestamp, which is
+ * the pollfunc timestamp (or the end of the conversion, with our own
+ * trigger), so a sample can be followed across events, and lined up with
+ * hrtimer, I2C and scheduler events. Tracepoints are static keys, so they
+ * cost a no-op jump when nobody is tracing.
+ * Enable them with e.g. `trace-cmd record -e bmp280`.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bmp280
+
+#if !defined(BMP280_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define BMP280_TRACE_H_
+
+#include <linux/iio/iio.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+/**
+ * Events carrying only the device id and the sample timestamp, for when the
+ * sample has not been read yet.
+ */
+DECLARE_EVENT_CLASS(bmp280_timestamp_class,
+  TP_PROTO(struct iio_dev *indio_dev, s64 timestamp),
+  TP_ARGS(indio_dev, timestamp),
+  TP_STRUCT__entry(
+    __field(int, id)
+    __field(s64, timestamp)
+  ),
+  TP_fast_assign(
+    __entry->id = iio_device_id(indio_dev);
+    __entry->timestamp = timestamp;
+  ),
+  TP_printk("iio:device%d timestamp=%lld", __entry->id, __entry->timestamp)
+);
+
+DEFINE_EVENT(bmp280_timestamp_class, bmp280_trigger,
+  TP_PROTO(struct iio_dev *indio_dev, s64 timestamp),
+  TP_ARGS(indio_dev, timestamp)
+);
+
+DEFINE_EVENT(bmp280_timestamp_class, bmp280_read_start,
+  TP_PROTO(struct iio_dev *indio_dev, s64 timestamp),
+  TP_ARGS(indio_dev, timestamp)
+);
+
+/**
+ * The sample as read, or the gap it was replaced with if status is an error.
+ * The timestamp can change while reading, e.g. to the bus group's one.
+ */
+TRACE_EVENT(bmp280_read_end,
+  TP_PROTO(struct iio_dev *indio_dev, s32 raw_temp, s32 raw_press,
+	   s64 timestamp, int status),
+  TP_ARGS(indio_dev, raw_temp, raw_press, timestamp, status),
+  TP_STRUCT__entry(
+    __field(int, id)
+    __field(s32, raw_temp)
+    __field(s32, raw_press)
+    __field(s64, timestamp)
+    __field(int, status)
+  ),
+  TP_fast_assign(
+    __entry->id = iio_device_id(indio_dev);
+    __entry->raw_temp = raw_temp;
+    __entry->raw_press = raw_press;
+    __entry->timestamp = timestamp;
+    __entry->status = status;
+  ),
+  TP_printk("iio:device%d raw_temp=0x%06x raw_press=0x%06x timestamp=%lld "
+	    "status=%d", __entry->id, __entry->raw_temp, __entry->raw_press,
+	    __entry->timestamp, __entry->status)
+);
+
+/**
+ * Events carrying a whole sample, raw and compensated. Compensated values of
+ * channels that are not captured are not computed, and show up as gaps:
+ * BMP280_GAP_TEMP and BMP280_GAP_PRESS.
+ * status is the result of pushing the sample, and is always 0 for
+ * bmp280_compensate.
+ */
+DECLARE_EVENT_CLASS(bmp280_sample_class,
+  TP_PROTO(struct iio_dev *indio_dev, s32 raw_temp, s32 raw_press,
+	   s32 temp, u32 press, s64 timestamp, int status),
+  TP_ARGS(indio_dev, raw_temp, raw_press, temp, press, timestamp, status),
+  TP_STRUCT__entry(
+    __field(int, id)
+    __field(s32, raw_temp)
+    __field(s32, raw_press)
+    __field(s32, temp)
+    __field(u32, press)
+    __field(s64, timestamp)
+    __field(int, status)
+  ),
+  TP_fast_assign(
+    __entry->id = iio_device_id(indio_dev);
+    __entry->raw_temp = raw_temp;
+    __entry->raw_press = raw_press;
+    __entry->temp = temp;
+    __entry->press = press;
+    __entry->timestamp = timestamp;
+    __entry->status = status;
+  ),
+  TP_printk("iio:device%d raw_temp=0x%06x raw_press=0x%06x temp=%d press=%u "
+	    "timestamp=%lld status=%d", __entry->id, __entry->raw_temp,
+	    __entry->raw_press, __entry->temp, __entry->press,
+	    __entry->timestamp, __entry->status)
+);
+
+DEFINE_EVENT(bmp280_sample_class, bmp280_compensate,
+  TP_PROTO(struct iio_dev *indio_dev, s32 raw_temp, s32 raw_press,
+	   s32 temp, u32 press, s64 timestamp, int status),
+  TP_ARGS(indio_dev, raw_temp, raw_press, temp, press, timestamp, status)
+);
+
+DEFINE_EVENT(bmp280_sample_class, bmp280_push,
+  TP_PROTO(struct iio_dev *indio_dev, s32 raw_temp, s32 raw_press,
+	   s32 temp, u32 press, s64 timestamp, int status),
+  TP_ARGS(indio_dev, raw_temp, raw_press, temp, press, timestamp, status)
+);
+
+#endif  // BMP280_TRACE_H_
+
+// The header is included again by the tracing core, from its own directory,
+// so it must be told where to find it. The Makefile adds src/ to the include
+// path of the file defining CREATE_TRACE_POINTS.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bmp280-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,238 @@
+/**
+ * This file implements the driver's own IIO trigger.
+ * In normal mode the sensor samples on its own clock, once per measurement
+ * plus standby period. A generic timer trigger drifts against that clock, so
+ * it either reads the same sample twice or skips one. Instead, our trigger
+ * fires shortly before the sensor is expected to end a conversion. The
+ * trigger handler then polls the status register until the conversion ends,
+ * reads the fresh sample, and re-arms the timer from that point. This keeps
+ * the timer locked to the sensor's phase, and we read each sample once.
+ * In forced mode the handler starts conversions itself, so the timer simply
+ * fires once per sampling period.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/ktime.h>
+#include <linux/minmax.h>
+#include <linux/printk.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "bmp280.h"
+
+/**
+ * Shortest time between two status register reads while waiting for the
+ * conversion to end, in microseconds.
+ */
+#define BMP280_TRIGGER_MIN_POLL_US 100
+
+/**
+ * Shortest time the timer fires before the expected end of a conversion, in
+ * microseconds.
+ */
+#define BMP280_TRIGGER_MIN_LEAD_US 200
+
+static enum hrtimer_restart bmp280_trigger_timer_fn(struct hrtimer *timer);
+static int bmp280_trigger_set_state(struct iio_trigger *trig, bool state);
+static void bmp280_trigger_cancel_timer(void *data);
+
+/**
+ * Trigger hooks. The trigger can only be used by the device it belongs to,
+ * since its timing follows that device's sensor.
+ */
+static const struct iio_trigger_ops bmp280_trigger_ops = {
+  .set_trigger_state = bmp280_trigger_set_state,
+  .validate_device = iio_trigger_validate_own_device,
+};
+
+int register_bmp280_trigger(struct iio_dev *indio_dev) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_trigger_sync *trigger = &bmp280->trigger;
+  struct device *dev = indio_dev->dev.parent;
+  trigger->trig = devm_iio_trigger_alloc(dev, "%s-dev%d", indio_dev->name,
+					 iio_device_id(indio_dev));
+  if (!trigger->trig) {
+    return -ENOMEM;
+  }
+  trigger->trig->ops = &bmp280_trigger_ops;
+  iio_trigger_set_drvdata(trigger->trig, indio_dev);
+  spin_lock_init(&trigger->lock);
+  trigger->enabled = false;
+  hrtimer_init(&trigger->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  trigger->timer.function = bmp280_trigger_timer_fn;
+  // Registered before the trigger, so it runs after the trigger is gone.
+  int status = devm_add_action_or_reset(dev, bmp280_trigger_cancel_timer,
+					trigger);
+  if (status) {
+    return status;
+  }
+  status = devm_iio_trigger_register(dev, trigger->trig);
+  if (status) {
+    pr_err("Failed to register IIO trigger.\n");
+    return status;
+  }
+  // The IIO core drops this reference when the device is released.
+  indio_dev->trig = iio_trigger_get(trigger->trig);
+  return 0;
+}
+
+/**
+ * Timer callback. It runs in interrupt context, and only kicks the trigger
+ * handler, which re-arms the timer once it knows when the sensor will be done
+ * with its next conversion.
+ */
+static enum hrtimer_restart bmp280_trigger_timer_fn(struct hrtimer *timer) {
+  struct bmp280_trigger_sync *trigger =
+    container_of(timer, struct bmp280_trigger_sync, timer);
+  iio_trigger_poll(trigger->trig);
+  return HRTIMER_NORESTART;
+}
+
+/**
+ * Starts the timer when a buffer is enabled on our device, and stops it when
+ * the buffer is disabled.
+ * The configuration cannot change while the buffer is enabled, so we compute
+ * the sampling period once here.
+ */
+static int bmp280_trigger_set_state(struct iio_trigger *trig, bool state) {
+  struct iio_dev *indio_dev = iio_trigger_get_drvdata(trig);
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_trigger_sync *trigger = &bmp280->trigger;
+  if (!state) {
+    spin_lock(&trigger->lock);
+    trigger->enabled = false;
+    spin_unlock(&trigger->lock);
+    hrtimer_cancel(&trigger->timer);
+    return 0;
+  }
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  u32 measurement_us = compute_bmp280_measurement_time_us(&config,
+							  /*max=*/false);
+  trigger->period_ns = compute_bmp280_sampling_period_us(&config) *
+    NSEC_PER_USEC;
+  trigger->lead_ns = max_t(u32, measurement_us / 8,
+			   BMP280_TRIGGER_MIN_LEAD_US) * NSEC_PER_USEC;
+  trigger->reference = ktime_get();
+  trigger->reference_exact = false;
+  trigger->pushed = false;
+  spin_lock(&trigger->lock);
+  trigger->enabled = true;
+  // Fire right away. We do not know the sensor's phase yet, the first few
+  // cycles find it.
+  hrtimer_start(&trigger->timer, trigger->reference, HRTIMER_MODE_ABS);
+  spin_unlock(&trigger->lock);
+  return 0;
+}
+
+/**
+ * Makes sure the timer is not left pending when the device goes away.
+ */
+static void bmp280_trigger_cancel_timer(void *data) {
+  struct bmp280_trigger_sync *trigger = data;
+  hrtimer_cancel(&trigger->timer);
+}
+
+void start_bmp280_trigger_cycle(struct iio_dev *indio_dev,
+				struct bmp280_trigger_cycle *cycle,
+				s64 *timestamp) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  *cycle = (struct bmp280_trigger_cycle){ 0 };
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  if (config.mode != BMP280_MODE_NORMAL) {
+    return;
+  }
+  // Poll a few times within the lead time, which bounds both the number of
+  // status reads and how late we notice the end of the conversion.
+  u32 poll_us = max_t(u32, bmp280->trigger.lead_ns / NSEC_PER_USEC / 4,
+		      BMP280_TRIGGER_MIN_POLL_US);
+  u32 timeout_us = compute_bmp280_measurement_time_us(&config, /*max=*/true);
+  bool was_measuring = false;
+  if (wait_bmp280_conversion(bmp280, poll_us, timeout_us, &was_measuring) ||
+      !was_measuring) {
+    return;
+  }
+  cycle->synced = true;
+  cycle->sync_time = ktime_get();
+  *timestamp = iio_get_time_ns(indio_dev);
+}
+
+bool accept_bmp280_trigger_sample(struct iio_dev *indio_dev,
+				  struct bmp280_trigger_cycle *cycle) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_trigger_sync *trigger = &bmp280->trigger;
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  // Each forced mode read runs a new conversion, so it is always fresh. In
+  // normal mode, the status register shows the sensor measuring for the whole
+  // conversion, so when we did not see it, we read during standby, and the
+  // data registers hold whatever conversion ended last. That is a new one if
+  // a whole period went by since the one we last pushed. Comparing values
+  // would not do: a stable environment gives the same raw values in a row.
+  bool fresh = config.mode != BMP280_MODE_NORMAL || cycle->synced ||
+    !trigger->pushed ||
+    !ktime_before(ktime_get(), ktime_add_ns(trigger->reference,
+					     trigger->period_ns));
+  trigger->pushed = trigger->pushed || fresh;
+  cycle->fresh = fresh;
+  return fresh;
+}
+
+void finish_bmp280_trigger_cycle(struct iio_dev *indio_dev,
+				 const struct bmp280_trigger_cycle *cycle) {
+  struct bmp280_ctx *bmp280 = iio_priv(indio_dev);
+  struct bmp280_trigger_sync *trigger = &bmp280->trigger;
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  ktime_t now = ktime_get();
+  ktime_t next;
+  if (config.mode != BMP280_MODE_NORMAL) {
+    // Fixed rate. Counting from the previous deadline, rather than from now,
+    // keeps the handler's run time from adding up.
+    next = ktime_add_ns(trigger->reference, trigger->period_ns);
+  } else {
+    if (cycle->synced) {
+      if (trigger->reference_exact) {
+	// Two conversion ends in a row: follow the sensor's actual period.
+	// Anything far off means we missed a conversion, so ignore it.
+	s64 measured_ns = ktime_to_ns(ktime_sub(cycle->sync_time,
+						trigger->reference));
+	s64 error_ns = measured_ns - trigger->period_ns;
+	if (abs(error_ns) < trigger->period_ns / 8) {
+	  trigger->period_ns = (3 * (s64)trigger->period_ns + measured_ns) / 4;
+	}
+      }
+      trigger->reference = cycle->sync_time;
+      trigger->reference_exact = true;
+    } else if (cycle->fresh) {
+      // We fired after the conversion ended, so we only know it ended before
+      // now. Assume we were late by the lead time, which makes the next cycle
+      // fire earlier, until we land within a conversion again.
+      trigger->reference = ktime_sub_ns(now, trigger->lead_ns);
+      trigger->reference_exact = false;
+    }
+    // Otherwise, we fired before the conversion started, and the estimate of
+    // its end still holds.
+    next = ktime_sub_ns(ktime_add_ns(trigger->reference, trigger->period_ns),
+			trigger->lead_ns);
+  }
+  if (!ktime_after(next, now)) {
+    // Behind schedule. Back off for half a measurement, rather than polling
+    // the sensor for data it does not have yet.
+    next = ktime_add_ns(now, 4 * trigger->lead_ns);
+  }
+  if (config.mode != BMP280_MODE_NORMAL) {
+    trigger->reference = next;
+  }
+  spin_lock(&trigger->lock);
+  if (trigger->enabled) {
+    hrtimer_start(&trigger->timer, next, HRTIMER_MODE_ABS);
+  }
+  spin_unlock(&trigger->lock);
+}
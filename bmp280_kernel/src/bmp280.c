@@ -1,95 +1,605 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/delay.h>
+#include <linux/device.h>
 #include <linux/errno.h>
-#include <linux/i2c.h>
+#include <linux/iopoll.h>
+#include <linux/ktime.h>
+#include <linux/lockdep.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
 #include <linux/types.h>
 #include <linux/printk.h>
+#include <linux/regmap.h>
 
 #include "bmp280.h"
 
+/**
+ * How often we poll the status register while waiting for a forced mode
+ * conversion, in microseconds.
+ */
+#define BMP280_STATUS_POLL_US 500
+
+/**
+ * Bus error handling. A failed register access is retried up to
+ * BMP280_TRANSFER_RETRIES times, waiting BMP280_RETRY_BACKOFF_US before the
+ * first retry, and twice as long before each of the next ones. That is at most
+ * 700 us, so a flaky bus never stalls the trigger handler for long.
+ * After BMP280_FAULT_THRESHOLD consecutive failed accesses, the sensor is
+ * faulted, and re-probed after a backoff window, starting at
+ * BMP280_REPROBE_BACKOFF_MIN_MS, and doubling up to
+ * BMP280_REPROBE_BACKOFF_MAX_MS.
+ */
+#define BMP280_TRANSFER_RETRIES 3
+#define BMP280_RETRY_BACKOFF_US 100
+#define BMP280_FAULT_THRESHOLD 8
+#define BMP280_REPROBE_BACKOFF_MIN_MS 10
+#define BMP280_REPROBE_BACKOFF_MAX_MS 5000
+
+/**
+ * Whether a register address belongs to the data block, holding the raw
+ * pressure and temperature of the latest conversion.
+ */
+static bool is_bmp280_data_reg(unsigned int reg) {
+  return BMP280_DATA_BLOCK_REG_ADDRESS <= reg &&
+    reg < BMP280_DATA_BLOCK_REG_ADDRESS + BMP280_DATA_BLOCK_LENGTH;
+}
+
+static bool bmp280_regmap_readable_reg(struct device *dev, unsigned int reg) {
+  return (BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS <= reg &&
+	  reg < BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS +
+	  BMP280_CALIBRATION_LENGTH) ||
+    reg == BMP280_ID_REG || reg == BMP280_STATUS_REG_ADDRESS ||
+    reg == BMP280_CTRL_MEAS_REG_ADDRESS || reg == BMP280_CONFIG_REG_ADDRESS ||
+    is_bmp280_data_reg(reg);
+}
+
+static bool bmp280_regmap_writeable_reg(struct device *dev, unsigned int reg) {
+  return reg == BMP280_CTRL_MEAS_REG_ADDRESS || reg == BMP280_CONFIG_REG_ADDRESS;
+}
+
+/**
+ * The status and data registers change with every conversion. Everything
+ * else only changes when we write it, so it can be served from the cache.
+ * ctrl_meas is not quite constant either: after a forced mode conversion,
+ * the sensor clears its mode bits on its own. We never read it back for
+ * anything but the sampling settings, and always write it in full, so the
+ * cache is still good enough for it.
+ */
+static bool bmp280_regmap_volatile_reg(struct device *dev, unsigned int reg) {
+  return reg == BMP280_STATUS_REG_ADDRESS || is_bmp280_data_reg(reg);
+}
+
+const struct regmap_config bmp280_regmap_config = {
+  .name = "bmp280",
+  .reg_bits = 8,
+  .val_bits = 8,
+  .max_register = BMP280_DATA_BLOCK_REG_ADDRESS + BMP280_DATA_BLOCK_LENGTH - 1,
+  .readable_reg = bmp280_regmap_readable_reg,
+  .writeable_reg = bmp280_regmap_writeable_reg,
+  .volatile_reg = bmp280_regmap_volatile_reg,
+  .cache_type = REGCACHE_RBTREE,
+};
+
+static int reprobe_bmp280(struct bmp280_ctx *bmp280);
+
+/**
+ * Whether a bus error is worth retrying. NAKs show up as -EREMOTEIO or
+ * -ENXIO, depending on the adapter, and lost arbitration or a stuck clock as
+ * -EAGAIN, -EIO or -ETIMEDOUT. Everything else, e.g. -EINVAL, will fail
+ * again.
+ */
+static bool is_bmp280_transient_error(int status) {
+  return status == -EIO || status == -EREMOTEIO || status == -ENXIO ||
+    status == -EAGAIN || status == -ETIMEDOUT;
+}
+
+/**
+ * Called before every register access. Lets it through while the sensor is
+ * healthy, and while it is being re-probed. Otherwise, fails fast until the
+ * backoff window is over, then re-probes the sensor.
+ */
+static int begin_bmp280_transfer(struct bmp280_ctx *bmp280) {
+  struct bmp280_health *health = &bmp280->health;
+  lockdep_assert_held(&bmp280->lock);
+  if (!health->faulted || health->reprobing) {
+    return 0;
+  }
+  if (ktime_before(ktime_get(), health->next_reprobe)) {
+    atomic_inc(&health->fast_fails);
+    return -EIO;
+  }
+  return reprobe_bmp280(bmp280);
+}
+
+/**
+ * Called after every failed attempt at a register access. Returns whether
+ * to try again, after waiting for the next backoff step. Re-probes only get
+ * one attempt per access, since the sensor is likely gone already.
+ */
+static bool retry_bmp280_transfer(struct bmp280_ctx *bmp280, int status,
+				  int *attempt) {
+  if (!status || bmp280->health.reprobing ||
+      !is_bmp280_transient_error(status) ||
+      *attempt >= BMP280_TRANSFER_RETRIES) {
+    return false;
+  }
+  atomic_inc(&bmp280->health.retries);
+  fsleep(BMP280_RETRY_BACKOFF_US << *attempt);
+  (*attempt)++;
+  return true;
+}
+
+/**
+ * Called after every register access, retries included. Counts failures, and
+ * marks the sensor faulted after too many of them in a row.
+ */
+static void end_bmp280_transfer(struct bmp280_ctx *bmp280, unsigned int reg,
+				int status) {
+  struct bmp280_health *health = &bmp280->health;
+  if (!status) {
+    if (!health->reprobing) {
+      health->consecutive_failures = 0;
+    }
+    return;
+  }
+  atomic_inc(&health->transfer_errors);
+  dev_err_ratelimited(bmp280->dev, "Failed to access register 0x%02x: %d\n",
+		      reg, status);
+  if (health->faulted || health->reprobing ||
+      ++health->consecutive_failures < BMP280_FAULT_THRESHOLD) {
+    return;
+  }
+  health->faulted = true;
+  health->reprobe_backoff_ms = BMP280_REPROBE_BACKOFF_MIN_MS;
+  health->next_reprobe = ktime_add_ms(ktime_get(),
+				      health->reprobe_backoff_ms);
+  dev_err(bmp280->dev, "Sensor stopped responding, re-probing in %u ms.\n",
+	  health->reprobe_backoff_ms);
+}
+
+void account_bmp280_transfer(struct bmp280_ctx *bmp280, unsigned int reg,
+			     size_t len, int status) {
+  lockdep_assert_held(&bmp280->lock);
+  // Reads of cached registers never reach the bus.
+  if (!status && bmp280_regmap_volatile_reg(bmp280->dev, reg)) {
+    count_bmp280_stat(bmp280, BMP280_STAT_BUS_BYTES, 1 + len);
+  }
+  end_bmp280_transfer(bmp280, reg, status);
+}
+
+int read_bmp280_regs(struct bmp280_ctx *bmp280, unsigned int reg, void *val,
+		     size_t len) {
+  int status = begin_bmp280_transfer(bmp280);
+  if (status) {
+    return status;
+  }
+  int attempt = 0;
+  u64 start_ns = bmp280_stats_clock();
+  do {
+    status = regmap_bulk_read(bmp280->regmap, reg, val, len);
+  } while (retry_bmp280_transfer(bmp280, status, &attempt));
+  record_bmp280_latency_since(bmp280, BMP280_LATENCY_TRANSFER, start_ns);
+  account_bmp280_transfer(bmp280, reg, len, status);
+  return status;
+}
+
+/**
+ * Reads a single register, like read_bmp280_regs.
+ */
+static int read_bmp280_reg(struct bmp280_ctx *bmp280, unsigned int reg,
+			   unsigned int *val) {
+  int status = begin_bmp280_transfer(bmp280);
+  if (status) {
+    return status;
+  }
+  int attempt = 0;
+  u64 start_ns = bmp280_stats_clock();
+  do {
+    status = regmap_read(bmp280->regmap, reg, val);
+  } while (retry_bmp280_transfer(bmp280, status, &attempt));
+  record_bmp280_latency_since(bmp280, BMP280_LATENCY_TRANSFER, start_ns);
+  if (!status && bmp280_regmap_volatile_reg(bmp280->dev, reg)) {
+    count_bmp280_stat(bmp280, BMP280_STAT_BUS_BYTES, 2);
+  }
+  end_bmp280_transfer(bmp280, reg, status);
+  return status;
+}
+
+/**
+ * Writes a single register, like read_bmp280_regs. Every register we write
+ * is written in full, so retrying a write is safe.
+ */
+static int write_bmp280_reg(struct bmp280_ctx *bmp280, unsigned int reg,
+			    unsigned int val) {
+  int status = begin_bmp280_transfer(bmp280);
+  if (status) {
+    return status;
+  }
+  int attempt = 0;
+  u64 start_ns = bmp280_stats_clock();
+  do {
+    status = regmap_write(bmp280->regmap, reg, val);
+  } while (retry_bmp280_transfer(bmp280, status, &attempt));
+  record_bmp280_latency_since(bmp280, BMP280_LATENCY_TRANSFER, start_ns);
+  if (!status) {
+    count_bmp280_stat(bmp280, BMP280_STAT_BUS_BYTES, 2);
+  }
+  end_bmp280_transfer(bmp280, reg, status);
+  return status;
+}
+
+/**
+ * Reads the status register, for read_poll_timeout. Returns the register
+ * value, or a negative error code.
+ */
+static int read_bmp280_status(struct bmp280_ctx *bmp280) {
+  unsigned int status_reg;
+  int status = read_bmp280_reg(bmp280, BMP280_STATUS_REG_ADDRESS, &status_reg);
+  return status ? status : status_reg;
+}
+
+/**
+ * Standby times in normal mode, in microseconds, indexed by their t_sb
+ * register encoding.
+ */
+static const u32 bmp280_standby_times_us[BMP280_T_SB_MAX + 1] = {
+  500, 62500, 125000, 250000, 500000, 1000000, 2000000, 4000000,
+};
+
+/**
+ * Oversampling ratio (1 to 16) for an osrs_t or osrs_p register encoding.
+ * Encodings above 0x5 also mean x16. Zero means the measurement is skipped.
+ */
+u32 bmp280_oversampling_ratio(u8 osrs) {
+  if (osrs == 0) {
+    return 0;
+  }
+  return 1 << (min_t(u8, osrs, BMP280_OSRS_MAX) - 1);
+}
+
+/**
+ * IIR filter coefficient for a filter register encoding. Encodings above
+ * 0x4 also mean 16. We report the "filter off" encoding as a coefficient of 1,
+ * since each new value then fully replaces the previous one.
+ */
+u32 bmp280_filter_coefficient(u8 filter) {
+  return 1 << min_t(u8, filter, BMP280_FILTER_MAX);
+}
+
+/**
+ * Standby time between two measurements in normal mode, in microseconds.
+ */
+u32 bmp280_standby_time_us(u8 t_sb) {
+  return bmp280_standby_times_us[t_sb & BMP280_T_SB_MAX];
+}
+
+/**
+ * Time taken by a single measurement with the given oversampling settings,
+ * in microseconds.
+ * See the datasheet, section 3.8.1 - Measurement time. All values are scaled
+ * from milliseconds to microseconds.
+ */
+u32 compute_bmp280_measurement_time_us(const struct bmp280_config *config,
+				       bool max) {
+  u32 osr_t = bmp280_oversampling_ratio(config->osrs_t);
+  u32 osr_p = bmp280_oversampling_ratio(config->osrs_p);
+  if (max) {
+    return 1250 + 2300 * osr_t + (osr_p ? 2300 * osr_p + 575 : 0);
+  }
+  return 1000 + 2000 * osr_t + (osr_p ? 2000 * osr_p + 500 : 0);
+}
+
+/**
+ * Time between two consecutive samples in normal mode, in microseconds.
+ * See the datasheet, section 3.8.2 - Measurement rate in normal mode.
+ */
+u32 compute_bmp280_sampling_period_us(const struct bmp280_config *config) {
+  return compute_bmp280_measurement_time_us(config, /*max=*/false) +
+    bmp280_standby_time_us(config->t_sb);
+}
+
+/**
+ * Encodes a configuration into ctrl_meas and config register values.
+ * In forced mode, the sensor sleeps until we ask for a conversion, so the
+ * encoded power mode is sleep mode.
+ */
+static void encode_bmp280_config(const struct bmp280_config *config,
+				 u8 *ctrl_meas, u8 *config_reg) {
+  // No 3-wire SPI interface. We use either I2C or 4-wire SPI.
+  u8 spi3w_en = 0x0;
+  u8 mode = config->mode == BMP280_MODE_FORCED ?
+    BMP280_MODE_SLEEP : config->mode;
+  *ctrl_meas = (config->osrs_t << 5) | (config->osrs_p << 2) | mode;
+  *config_reg = (config->t_sb << 5) | (config->filter << 2) | spi3w_en;
+}
+
+/**
+ * Writes a new configuration to the ctrl_meas and config registers.
+ * The datasheet warns that writes to the config register might be ignored in
+ * normal mode, so when it changes, we first put the sensor to sleep, then
+ * write the config register, and only then write the new power mode to
+ * ctrl_meas. The previous register values come from the regmap cache, so
+ * this never reads from the sensor.
+ * In forced mode, we leave the sensor asleep. See run_bmp280_forced_conversion.
+ * The new configuration is published under the state seqlock, so readers
+ * never see it half updated.
+ * Must be called with the bus mutex held.
+ */
+static int __write_bmp280_config(struct bmp280_ctx *bmp280,
+				 const struct bmp280_config *config) {
+  lockdep_assert_held(&bmp280->lock);
+  // These options are combined into the ctrl_meas and config registers
+  u8 ctrl_meas;
+  u8 config_reg;
+  encode_bmp280_config(config, &ctrl_meas, &config_reg);
+  // Both reads come from the register cache, after the first one.
+  unsigned int old_ctrl_meas;
+  unsigned int old_config_reg;
+  int status = read_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS,
+			       &old_ctrl_meas);
+  if (!status) {
+    status = read_bmp280_reg(bmp280, BMP280_CONFIG_REG_ADDRESS,
+			     &old_config_reg);
+  }
+  if (status) {
+    pr_err("Failed to read configuration registers: %d\n", status);
+    return status;
+  }
+  // The config register is only reliably written in sleep mode, so changing
+  // it takes a trip through sleep mode. Oversampling and power mode changes
+  // only touch ctrl_meas, and cost a single write.
+  if (config_reg != old_config_reg) {
+    if ((old_ctrl_meas & 0x3) == BMP280_MODE_NORMAL) {
+      status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS,
+				old_ctrl_meas & ~0x3);
+      if (status) {
+	pr_err("Failed to put sensor to sleep: %d\n", status);
+	return status;
+      }
+    }
+    status = write_bmp280_reg(bmp280, BMP280_CONFIG_REG_ADDRESS, config_reg);
+    if (status) {
+      pr_err("Failed to write config register: %d\n", status);
+      return status;
+    }
+  }
+  status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS, ctrl_meas);
+  if (status) {
+    pr_err("Failed to write ctrl_meas register: %d\n", status);
+    return status;
+  }
+  write_seqlock(&bmp280->state_lock);
+  bmp280->config = *config;
+  // Samples taken with the old configuration are no longer representative.
+  bmp280->cached_sample_valid = false;
+  write_sequnlock(&bmp280->state_lock);
+  return 0;
+}
+
+/**
+ * Writes a new configuration, see __write_bmp280_config. Register writes are
+ * serialized with all other bus transfers by the bus mutex.
+ */
+int write_bmp280_config(struct bmp280_ctx *bmp280,
+			const struct bmp280_config *config) {
+  mutex_lock(&bmp280->lock);
+  int status = __write_bmp280_config(bmp280, config);
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
+/**
+ * Copies the current sensor configuration.
+ * Never waits for bus transfers, since config is published under the state
+ * seqlock.
+ */
+void get_bmp280_config(struct bmp280_ctx *bmp280,
+		       struct bmp280_config *config) {
+  unsigned int seq;
+  do {
+    seq = read_seqbegin(&bmp280->state_lock);
+    *config = bmp280->config;
+  } while (read_seqretry(&bmp280->state_lock, seq));
+}
+
+int suspend_bmp280(struct bmp280_ctx *bmp280) {
+  mutex_lock(&bmp280->lock);
+  int status = 0;
+  // In forced mode, the sensor is already asleep between conversions.
+  if (bmp280->config.mode == BMP280_MODE_NORMAL) {
+    u8 ctrl_meas;
+    u8 config_reg;
+    encode_bmp280_config(&bmp280->config, &ctrl_meas, &config_reg);
+    status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS,
+			      ctrl_meas & ~0x3);
+    if (status) {
+      pr_err("Failed to put sensor to sleep: %d\n", status);
+    }
+  }
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
+/**
+ * Writes the shadow configuration back to the sensor, whatever state it is
+ * in: it might have been put to sleep by us, or have lost power, and come
+ * back in its reset state. Sleep mode comes first, so the config register
+ * write holds, then the config register, then the power mode.
+ * Must be called with the bus mutex held.
+ */
+static int restore_bmp280_config(struct bmp280_ctx *bmp280) {
+  u8 ctrl_meas;
+  u8 config_reg;
+  encode_bmp280_config(&bmp280->config, &ctrl_meas, &config_reg);
+  int status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS,
+				ctrl_meas & ~0x3);
+  if (!status) {
+    status = write_bmp280_reg(bmp280, BMP280_CONFIG_REG_ADDRESS, config_reg);
+  }
+  if (!status) {
+    status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS, ctrl_meas);
+  }
+  return status;
+}
+
+int resume_bmp280(struct bmp280_ctx *bmp280) {
+  mutex_lock(&bmp280->lock);
+  int status = restore_bmp280_config(bmp280);
+  if (status) {
+    pr_err("Failed to restore sensor configuration: %d\n", status);
+    goto out;
+  }
+  write_seqlock(&bmp280->state_lock);
+  bmp280->cached_sample_valid = false;
+  write_sequnlock(&bmp280->state_lock);
+  if (bmp280->config.mode == BMP280_MODE_NORMAL) {
+    // The data registers still hold whatever was there before we suspended.
+    // Wait for the first conversion, so the next read is fresh.
+    fsleep(compute_bmp280_measurement_time_us(&bmp280->config,
+					      /*max=*/true));
+  }
+ out:
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
 /**
  * Performs a device id sanity check, then initializes the BMP280 sensor.
- * We are using the following configuration:
+ * We are using the following default configuration, which can be changed at
+ * runtime through write_bmp280_config:
  *     * maximum temperature and pressure oversampling (x16): this gives us
  * 20 bits of resolution.
  *     * Normal power mode: the sensor will continuously collecting samples.
  *     * 1000ms standby mode: samples are collected once per second.
  *     * No filtering: disable data smoothing over time.
- *     * No 3-wire SPI: we only use I2C
+ *     * No 3-wire SPI: we use either I2C or 4-wire SPI
+ * Must be called with the bus mutex held.
  */
 static int initialize_bmp280(struct bmp280_ctx *bmp280) {
   // Try to read the sensor ID, and verify if it matches the expected BMP280 ID.
-  u8 sensor_id = i2c_smbus_read_byte_data(bmp280->client, BMP280_ID_REG);
+  unsigned int sensor_id;
+  int status = read_bmp280_reg(bmp280, BMP280_ID_REG, &sensor_id);
+  if (status) {
+    pr_err("Failed to read sensor id: %d\n", status);
+    return status;
+  }
   if (sensor_id != BMP280_ID) {
     pr_err("Unexpected sensor id 0x%02x. Expecting 0x%02x\n",
 	   sensor_id, BMP280_ID);
     return -ENODEV;
   }
-  // Maximum temperature oversampling (x16)
-  u8 osrs_t = 0x5;
-  // Maximum pressure oversampling (x16)
-  u8 osrs_p = 0x5;
-  // Normal power mode
-  u8 mode = 0x3;
-  // Standby time. In normal power mode, take a measurement every 1000ms (1s)
-  u8 t_sb = 0x5;
-  // No filtering
-  u8 filter = 0x0;
-  // No 3-wire SPI interface. We only use I2C
-  u8 spi3w_en = 0x0;
-  // These options are combined into the ctrl_meas and config registers
-  u8 ctrl_meas = (osrs_t << 5) | (osrs_p << 2) | mode;
-  u8 config = (t_sb << 5) | (filter << 2) | spi3w_en;
-  i2c_smbus_write_byte_data(bmp280->client, BMP280_CONFIG_REG_ADDRESS, config);
-  i2c_smbus_write_byte_data(bmp280->client, BMP280_CTRL_MEAS_REG_ADDRESS,
-			    ctrl_meas);
+  struct bmp280_config config = {
+    // Maximum temperature oversampling (x16)
+    .osrs_t = 0x5,
+    // Maximum pressure oversampling (x16)
+    .osrs_p = 0x5,
+    // Normal power mode
+    .mode = BMP280_MODE_NORMAL,
+    // Standby time. In normal power mode, take a measurement every 1000ms (1s)
+    .t_sb = 0x5,
+    // No filtering
+    .filter = 0x0,
+  };
+  return __write_bmp280_config(bmp280, &config);
+}
+
+/**
+ * Reads the BMP280 constant calibration values into calib.
+ * These are 16 bit little endian values, stored from 0x88 to 0x9f on the
+ * sensor register bank.
+ */
+static int read_bmp280_calibration(struct bmp280_ctx *bmp280,
+				   struct bmp280_calibration *calib) {
+  // Temperature and pressure calibration values are contiguous, so we read
+  // them all with a single bulk read.
+  const int n_temp = ARRAY_SIZE(calib->dig_T);
+  const int n_press = ARRAY_SIZE(calib->dig_P);
+  __le16 calib_buffer[BMP280_CALIBRATION_LENGTH / sizeof(__le16)];
+  int status = read_bmp280_regs(bmp280,
+				BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS,
+				calib_buffer, sizeof(calib_buffer));
+  if (status) {
+    pr_err("Failed to read calibration values: %d\n", status);
+    return status;
+  }
+  for (int i = 0; i < n_temp; i++) {
+    calib->dig_T[i] = le16_to_cpu(calib_buffer[i]);
+  }
+  for (int i = 0; i < n_press; i++) {
+    calib->dig_P[i] = le16_to_cpu(calib_buffer[n_temp + i]);
+  }
   return 0;
 }
 
 /**
- * Reads the BMP280 constant calibration values, and stores them in the context
- * structure's dig_T and dig_P fields.
- * These are 16 bit values, stored from 0x88 to 0xa1 on the sensor register
- * bank.
+ * Reads the calibration values, and stores them in the context structure's
+ * calibration field, as well as the coefficients derived from them.
+ * Must be called with the bus mutex held.
  */
 static int read_bmp280_calibration_values(struct bmp280_ctx *bmp280) {
-  // Read all temperature calibration values, then all pressure calibration
-  // values, to minimize the number of I2C reads during setup.
-  // Note: `n_read` is specified in bytes.
-  u16 temp_calib_buffer[3];
-  s32 read = i2c_smbus_read_i2c_block_data(
-      bmp280->client, BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS, 
-      /*n_read=*/3 * 2, (u8 *)temp_calib_buffer);
-  if (read != 3 * 2) {
-    pr_err("Expected 6 temperature calibration bytes. Read %d instead\n", read);
-    return -EIO;
+  int status = read_bmp280_calibration(bmp280, &bmp280->calibration);
+  if (status) {
+    return status;
   }
-  u16 press_calib_buffer[9];
-  read = i2c_smbus_read_i2c_block_data(
-      bmp280->client, BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS,
-      /*n_read=*/9 * 2, (u8 *)press_calib_buffer);
-  if (read != 9 * 2) {
-    pr_err("Expected 18 pressure calibration bytes. Read %d instead\n", read);
-    return -EIO;
+  compute_bmp280_coeffs(&bmp280->calibration, &bmp280->coeffs);
+  return 0;
+}
+
+/**
+ * Checks that a faulted sensor is back, and is still the same sensor, then
+ * restores its configuration.
+ * The chip id and calibration registers are dropped from the register cache
+ * first, so we read them from the sensor itself. Calibration values must not
+ * change: the compensation constants are read without the bus mutex, so we
+ * cannot swap them under running captures.
+ * On failure, the sensor stays faulted, and the backoff window doubles.
+ * Must be called with the bus mutex held.
+ */
+static int reprobe_bmp280(struct bmp280_ctx *bmp280) {
+  struct bmp280_health *health = &bmp280->health;
+  atomic_inc(&health->reprobes);
+  health->reprobing = true;
+  regcache_drop_region(bmp280->regmap,
+		       BMP280_TEMP_CALIBRATION_BASE_REG_ADDRESS,
+		       BMP280_ID_REG);
+  unsigned int sensor_id;
+  struct bmp280_calibration calib;
+  int status = read_bmp280_reg(bmp280, BMP280_ID_REG, &sensor_id);
+  if (!status && sensor_id != BMP280_ID) {
+    status = -ENODEV;
   }
-  // ignoring index zero to match the indexes starting from 1 in the
-  // datasheet algorithm.
-  bmp280->dig_T[0] = 0;
-  bmp280->dig_P[0] = 0;
-  // dig_T1 and dig_P1 should be treated as unsigned 16 bits, whereas all other
-  // calibration values should be treated as signed 16 bits.
-  for (int i = 1; i <= 3; i++) {
-    bmp280->dig_T[i] = temp_calib_buffer[i-1];
-    if(i != 1 && bmp280->dig_T[i] > 32767) {
-      bmp280->dig_T[i] -= 65536;
-    }
+  if (!status) {
+    status = read_bmp280_calibration(bmp280, &calib);
   }
-  for (int i = 1; i <= 9; i++) {
-    bmp280->dig_P[i] = press_calib_buffer[i-1];
-    if(i != 1 && bmp280->dig_P[i] > 32767) {
-      bmp280->dig_P[i] -= 65536;
-    }
+  if (!status && memcmp(&calib, &bmp280->calibration, sizeof(calib))) {
+    dev_err(bmp280->dev, "Calibration values changed, is this the same "
+	    "sensor?\n");
+    status = -ENODEV;
   }
+  if (!status) {
+    status = restore_bmp280_config(bmp280);
+  }
+  health->reprobing = false;
+  if (status) {
+    health->reprobe_backoff_ms = min(2 * health->reprobe_backoff_ms,
+				     (u32)BMP280_REPROBE_BACKOFF_MAX_MS);
+    health->next_reprobe = ktime_add_ms(ktime_get(),
+					health->reprobe_backoff_ms);
+    dev_err_ratelimited(bmp280->dev, "Re-probe failed: %d, next one in %u "
+			"ms.\n", status, health->reprobe_backoff_ms);
+    return -EIO;
+  }
+  health->faulted = false;
+  health->consecutive_failures = 0;
+  write_seqlock(&bmp280->state_lock);
+  bmp280->cached_sample_valid = false;
+  write_sequnlock(&bmp280->state_lock);
+  dev_info(bmp280->dev, "Sensor is back after re-probe.\n");
   return 0;
 }
 
@@ -97,88 +607,396 @@ static int read_bmp280_calibration_values(struct bmp280_ctx *bmp280) {
  * Calls sensor initialization functions, then reads the constant calibration
  * values from the sensor and sets the BMP280 context structure.
  */
-int setup_bmp280(struct i2c_client *client, struct bmp280_ctx *bmp280) {
-  // Make the I2C client available from the context structure
-  bmp280->client = client;
-  // Initialize sensor
-  int status = initialize_bmp280(bmp280);
+int setup_bmp280(struct device *dev, struct regmap *regmap,
+		 struct bmp280_ctx *bmp280) {
+  bmp280->dev = dev;
+  bmp280->regmap = regmap;
+  mutex_init(&bmp280->lock);
+  seqlock_init(&bmp280->state_lock);
+  bmp280->cached_sample_valid = false;
+  bmp280->cache_window_us = BMP280_CACHE_WINDOW_AUTO;
+  bmp280->sea_level_pressure = BMP280_SEA_LEVEL_PRESSURE_DEFAULT;
+  memset(&bmp280->health, 0, sizeof(bmp280->health));
+  // Statistics first, since every register access updates them.
+  int status = setup_bmp280_stats(dev, bmp280);
+  if (status) {
+    return status;
+  }
+  // Initialize sensor. Nobody else can reach it yet, but every register
+  // access expects the bus mutex held.
+  mutex_lock(&bmp280->lock);
+  status = initialize_bmp280(bmp280);
+  if (!status) {
+    status = read_bmp280_calibration_values(bmp280);
+  }
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
+/**
+ * Starts a single forced mode conversion, then waits for it to be done.
+ * We first sleep for the typical measurement time for the current
+ * oversampling settings, then poll the status register until the measuring
+ * bit is cleared, giving up after the maximum measurement time.
+ * The sensor goes back to sleep mode on its own after the conversion.
+ */
+static int run_bmp280_forced_conversion(struct bmp280_ctx *bmp280) {
+  const struct bmp280_config *config = &bmp280->config;
+  u8 ctrl_meas = (config->osrs_t << 5) | (config->osrs_p << 2) |
+    BMP280_MODE_FORCED;
+  int status = write_bmp280_reg(bmp280, BMP280_CTRL_MEAS_REG_ADDRESS,
+				ctrl_meas);
   if (status) {
     return status;
   }
-  status = read_bmp280_calibration_values(bmp280);
+  u32 typical_us = compute_bmp280_measurement_time_us(config, /*max=*/false);
+  u32 max_us = compute_bmp280_measurement_time_us(config, /*max=*/true);
+  fsleep(typical_us);
+  int status_reg;
+  status = read_poll_timeout(read_bmp280_status, status_reg,
+			     status_reg < 0 ||
+			     !(status_reg & BMP280_STATUS_MEASURING),
+			     BMP280_STATUS_POLL_US, max_us - typical_us,
+			     /*sleep_before_read=*/false, bmp280);
   if (status) {
+    dev_err_ratelimited(bmp280->dev,
+			"Timed out waiting for forced mode conversion.\n");
     return status;
   }
+  if (status_reg < 0) {
+    return status_reg;
+  }
   return 0;
 }
 
+int wait_bmp280_conversion(struct bmp280_ctx *bmp280, u32 poll_us,
+			   u32 timeout_us, bool *was_measuring) {
+  mutex_lock(&bmp280->lock);
+  int status = 0;
+  int status_reg = read_bmp280_status(bmp280);
+  if (status_reg < 0) {
+    status = status_reg;
+    goto out;
+  }
+  *was_measuring = status_reg & BMP280_STATUS_MEASURING;
+  if (!*was_measuring) {
+    goto out;
+  }
+  status = read_poll_timeout(read_bmp280_status, status_reg,
+			     status_reg < 0 ||
+			     !(status_reg & BMP280_STATUS_MEASURING),
+			     poll_us, timeout_us,
+			     /*sleep_before_read=*/true, bmp280);
+  if (status) {
+    dev_err_ratelimited(bmp280->dev,
+			"Timed out waiting for conversion to end.\n");
+    goto out;
+  }
+  if (status_reg < 0) {
+    status = status_reg;
+  }
+ out:
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
+int prepare_bmp280_sample(struct bmp280_ctx *bmp280) {
+  lockdep_assert_held(&bmp280->lock);
+  // Configuration only changes with the bus mutex held as well, so we can
+  // read it directly.
+  if (bmp280->config.mode != BMP280_MODE_FORCED) {
+    return 0;
+  }
+  return run_bmp280_forced_conversion(bmp280);
+}
+
 /**
  * Reads the raw temperature value from the sensor.
  * It takes up the 20 MS bits of three consecutive 8 bit registers.
- * We read the three registers at once so we don't run the risk of the sensor
- * updating them while we are reading.
+ * The value comes from read_bmp280_cached_sample, so reads within the cache
+ * freshness window do not talk with the sensor.
  */
 int read_bmp280_raw_temperature(struct bmp280_ctx *bmp280, s32 *raw_temp) {
-  u8 values[3] = {0, 0, 0};
-  s32 read = i2c_smbus_read_i2c_block_data(
-      bmp280->client, BMP280_TEMP_RAW_REG_ADDRESS, /*length=*/3, values);
-  if (read != 3) {
-    pr_err("Expected to read 3 raw temperature bytes. Read %d instead\n", read);
-    return -EIO;
+  struct bmp280_raw_sample sample;
+  int status = read_bmp280_cached_sample(bmp280, &sample);
+  if (status) {
+    return status;
   }
-  s32 val1 = values[0];
-  s32 val2 = values[1];
-  s32 val3 = values[2];
-  // The LS 4 bits of val3 are irrelevant. We do not right shift on this method,
-  // we just return the raw value, as read from the sensor.
-  *raw_temp = ((val1 << 16) | (val2 << 8) | val3);
+  *raw_temp = sample.raw_temp;
   return 0;
 }
 
 /**
  * Reads the raw pressure value from the sensor.
  * It takes up the 20 MS bits of three consecutive 8 bit registers.
- * We read the three registers at once so we don't run the risk of the sensor
- * updating them while we are reading.
+ * The value comes from read_bmp280_cached_sample, so reads within the cache
+ * freshness window do not talk with the sensor.
  */
 int read_bmp280_raw_pressure(struct bmp280_ctx *bmp280, s32 *raw_press) {
-  u8 values[3] = {0, 0, 0};
-  s32 read = i2c_smbus_read_i2c_block_data(
-      bmp280->client, BMP280_PRESS_RAW_REG_ADDRESS, /*length=*/3, values);
-  if (read != 3) {
-    pr_err("Expected to read 3 raw pressure bytes. Read %d instead\n", read);
-    return -EIO;
+  struct bmp280_raw_sample sample;
+  int status = read_bmp280_cached_sample(bmp280, &sample);
+  if (status) {
+    return status;
+  }
+  *raw_press = sample.raw_press;
+  return 0;
+}
+
+void decode_bmp280_sample(const u8 *block,
+			  struct bmp280_raw_sample *sample) {
+  s32 p1 = block[0];
+  s32 p2 = block[1];
+  s32 p3 = block[2];
+  s32 t1 = block[3];
+  s32 t2 = block[4];
+  s32 t3 = block[5];
+  // The LS 4 bits of p3 and t3 are irrelevant. We do not right shift on this
+  // method, we just return the raw values, as read from the sensor.
+  sample->raw_press = (p1 << 16) | (p2 << 8) | p3;
+  sample->raw_temp = (t1 << 16) | (t2 << 8) | t3;
+}
+
+void publish_bmp280_sample(struct bmp280_ctx *bmp280,
+			   const struct bmp280_raw_sample *sample) {
+  lockdep_assert_held(&bmp280->lock);
+  write_seqlock(&bmp280->state_lock);
+  bmp280->cached_sample = *sample;
+  bmp280->cached_sample_time = ktime_get();
+  bmp280->cached_sample_valid = true;
+  write_sequnlock(&bmp280->state_lock);
+  // Reads served from the cache do not get here, so each sample only counts
+  // once.
+  update_bmp280_rolling_stats(bmp280, sample,
+			      ktime_to_ns(bmp280->cached_sample_time));
+}
+
+/**
+ * Reads both raw pressure and raw temperature with a single 6 bytes block
+ * read. Pressure registers come before temperature registers. We read all of
+ * them at once to avoid the risk of the sensor changing either of them in
+ * between reads, and to only pay for one I2C transfer per sample.
+ * Must be called with the bus mutex held.
+ */
+static int __read_bmp280_raw_sample(struct bmp280_ctx *bmp280,
+				    struct bmp280_raw_sample *sample) {
+  int status = prepare_bmp280_sample(bmp280);
+  if (status) {
+    return status;
   }
-  s32 val1 = values[0];
-  s32 val2 = values[1];
-  s32 val3 = values[2];
-  // The LS 4 bits of val3 are irrelevant. We do not right shift on this method,
-  // we just return the raw value, as read from the sensor.
-  *raw_press = ((val1 << 16) | (val2 << 8) | val3);
+  u8 values[BMP280_DATA_BLOCK_LENGTH];
+  status = read_bmp280_regs(bmp280, BMP280_DATA_BLOCK_REG_ADDRESS, values,
+			    BMP280_DATA_BLOCK_LENGTH);
+  if (status) {
+    return status;
+  }
+  decode_bmp280_sample(values, sample);
+  // Every sample we read refreshes the cache, including the ones read by the
+  // triggered buffer handler.
+  publish_bmp280_sample(bmp280, sample);
   return 0;
 }
 
 /**
- * `t_fine` is an intermediate temperature value, required by both the final
- * processed temperature, as well as for pressure computation. See the
- * datasheet for details.
- * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
- * (Section 3.11.3 - Compensation formula)
+ * Reads both raw pressure and raw temperature with a single 6 bytes block
+ * read, waiting for any other bus transfer on this sensor to finish first.
+ * Always talks with the sensor, and refreshes the cache with the new sample.
  */
-static s32 compute_bmp280_t_fine(s32 raw_temp, const s32 dig_T[]) {
-  // This rather cryptic set of operations is described in the datasheet
-  s32 var1 = (((raw_temp >> 3) - (dig_T[1] << 1)) * dig_T[2]) >> 11;
-  s32 var2 = (((((raw_temp >> 4) - dig_T[1]) * ((raw_temp >> 4) - dig_T[1])) >> 12)
-	      * dig_T[3]) >> 14;
-  return var1 + var2;
+int read_bmp280_raw_sample(struct bmp280_ctx *bmp280,
+			   struct bmp280_raw_sample *sample) {
+  mutex_lock(&bmp280->lock);
+  int status = __read_bmp280_raw_sample(bmp280, sample);
+  mutex_unlock(&bmp280->lock);
+  return status;
 }
 
 /**
- * Computes the final temperature, in units of 1/100 degrees Celcius.
+ * Cache freshness window, in microseconds.
+ * Unless set explicitly, the window is the time it takes the sensor to
+ * produce a new sample: the sampling period in normal mode, or the
+ * measurement time in forced mode. Reading faster than that in normal mode
+ * would return the same data registers anyway.
+ */
+u32 compute_bmp280_cache_window_us(struct bmp280_ctx *bmp280) {
+  s32 window_us = READ_ONCE(bmp280->cache_window_us);
+  if (window_us != BMP280_CACHE_WINDOW_AUTO) {
+    return window_us;
+  }
+  struct bmp280_config config;
+  get_bmp280_config(bmp280, &config);
+  if (config.mode == BMP280_MODE_FORCED) {
+    return compute_bmp280_measurement_time_us(&config, /*max=*/false);
+  }
+  return compute_bmp280_sampling_period_us(&config);
+}
+
+/**
+ * Copies the cached sample, and when it was read, if it is valid and younger
+ * than `max_age_us`. Never waits for bus transfers, since the cache is
+ * published under the state seqlock.
+ */
+static bool lookup_bmp280_cached_sample(struct bmp280_ctx *bmp280,
+					u32 max_age_us,
+					struct bmp280_raw_sample *sample,
+					ktime_t *time) {
+  unsigned int seq;
+  bool hit;
+  do {
+    seq = read_seqbegin(&bmp280->state_lock);
+    hit = bmp280->cached_sample_valid &&
+      ktime_us_delta(ktime_get(), bmp280->cached_sample_time) < max_age_us;
+    *sample = bmp280->cached_sample;
+    *time = bmp280->cached_sample_time;
+  } while (read_seqretry(&bmp280->state_lock, seq));
+  return hit;
+}
+
+/**
+ * Copies the cached sample, however old it is.
+ * Returns false if there is no valid sample in the cache.
+ */
+bool peek_bmp280_cached_sample(struct bmp280_ctx *bmp280,
+			       struct bmp280_raw_sample *sample) {
+  ktime_t time;
+  return lookup_bmp280_cached_sample(bmp280, U32_MAX, sample, &time);
+}
+
+/**
+ * Returns the last sample read from the sensor if it was read within the
+ * cache freshness window, or reads a new one otherwise.
+ * If someone else is already talking with the sensor, we do not line up
+ * behind them as long as the cached sample is at most two windows old.
+ * Otherwise, once we get the bus mutex, we check the cache again, since
+ * whoever held the mutex before us most likely refreshed it.
+ */
+int read_bmp280_timed_cached_sample(struct bmp280_ctx *bmp280,
+				    struct bmp280_raw_sample *sample,
+				    ktime_t *time) {
+  u32 window_us = compute_bmp280_cache_window_us(bmp280);
+  if (lookup_bmp280_cached_sample(bmp280, window_us, sample, time)) {
+    count_bmp280_stat(bmp280, BMP280_STAT_CACHE_HITS, 1);
+    return 0;
+  }
+  if (!mutex_trylock(&bmp280->lock)) {
+    if (lookup_bmp280_cached_sample(bmp280, 2 * window_us, sample, time)) {
+      count_bmp280_stat(bmp280, BMP280_STAT_CACHE_HITS, 1);
+      return 0;
+    }
+    mutex_lock(&bmp280->lock);
+  }
+  int status = 0;
+  if (lookup_bmp280_cached_sample(bmp280, window_us, sample, time)) {
+    count_bmp280_stat(bmp280, BMP280_STAT_CACHE_HITS, 1);
+  } else {
+    count_bmp280_stat(bmp280, BMP280_STAT_CACHE_MISSES, 1);
+    status = __read_bmp280_raw_sample(bmp280, sample);
+    // Only published with the bus mutex held, which we still hold.
+    *time = bmp280->cached_sample_time;
+  }
+  mutex_unlock(&bmp280->lock);
+  return status;
+}
+
+int read_bmp280_cached_sample(struct bmp280_ctx *bmp280,
+			      struct bmp280_raw_sample *sample) {
+  ktime_t time;
+  return read_bmp280_timed_cached_sample(bmp280, sample, &time);
+}
+
+/**
+ * Names of the pressure compensation engines, as written to and read from the
+ * `pressure_compensation` module parameter, indexed by engine.
+ */
+static const char * const bmp280_pressure_compensation_names[] = {
+  [BMP280_PRESSURE_COMPENSATION_S64] = "s64",
+  [BMP280_PRESSURE_COMPENSATION_S32] = "s32",
+};
+
+/**
+ * Pressure compensation engine in use, shared by every sensor. It can change
+ * at any time through the module parameter, so it is read with READ_ONCE.
+ */
+static int bmp280_pressure_compensation = BMP280_PRESSURE_COMPENSATION_DEFAULT;
+
+static int set_bmp280_pressure_compensation(const char *val,
+					    const struct kernel_param *kp) {
+  int engine = sysfs_match_string(bmp280_pressure_compensation_names, val);
+  if (engine < 0) {
+    return engine;
+  }
+  WRITE_ONCE(bmp280_pressure_compensation, engine);
+  return 0;
+}
+
+static int get_bmp280_pressure_compensation(char *buffer,
+					    const struct kernel_param *kp) {
+  int engine = READ_ONCE(bmp280_pressure_compensation);
+  return sysfs_emit(buffer, "%s\n", bmp280_pressure_compensation_names[engine]);
+}
+
+static const struct kernel_param_ops bmp280_pressure_compensation_ops = {
+  .set = set_bmp280_pressure_compensation,
+  .get = get_bmp280_pressure_compensation,
+};
+
+/**
+ * E.g. `sudo insmod bmp280-iio.ko pressure_compensation=s32`, or at runtime
+ * through `/sys/module/bmp280_iio/parameters/pressure_compensation`.
+ */
+module_param_cb(pressure_compensation, &bmp280_pressure_compensation_ops,
+		NULL, 0644);
+MODULE_PARM_DESC(pressure_compensation,
+		 "Pressure compensation engine: s64 (reference) or s32");
+
+/**
+ * Computes the final temperature, in units of 1/100 degrees Celcius, from a
+ * raw temperature value (including the 4 LS padding bits).
  * We do this using the calibration values and the conversion algorithm
- * described in the datasheet.
- * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
- * (Section 3.11.3 - Compensation formula)
+ * described in the datasheet, see bmp280-compensate.c.
+ */
+s32 compensate_bmp280_temperature(const struct bmp280_ctx *bmp280,
+				  s32 raw_temp) {
+  return compensate_bmp280_raw_temperature(&bmp280->coeffs, raw_temp);
+}
+
+/**
+ * Computes the final pressure, as an unsigned 32 bit integer,
+ * in units of 1 / 256 Pascal, from a raw sample (including the 4 LS padding
+ * bits of each value). Both raw values must come from the same measurement.
+ * We do this using the calibration values and the engine selected by the
+ * `pressure_compensation` module parameter.
+ */
+u32 compensate_bmp280_pressure(const struct bmp280_ctx *bmp280,
+			       const struct bmp280_raw_sample *sample) {
+  return compensate_bmp280_raw_pressure(
+      &bmp280->coeffs, READ_ONCE(bmp280_pressure_compensation),
+      sample->raw_temp, sample->raw_press);
+}
+
+void compensate_bmp280_samples(const struct bmp280_ctx *bmp280,
+			       const s32 *raw_temp, const s32 *raw_press,
+			       s32 *temp, u32 *press, size_t n) {
+  u64 start_ns = bmp280_stats_clock();
+  compensate_bmp280_batch(&bmp280->coeffs,
+			  READ_ONCE(bmp280_pressure_compensation),
+			  raw_temp, raw_press, temp, press, n);
+  // Skipped measurements and failed scans have no meaningful compensated
+  // value, so they get the gap markers instead. Temperature drives pressure
+  // compensation, so a skipped temperature voids both.
+  for (size_t i = 0; i < n; i++) {
+    if (temp && raw_temp[i] == BMP280_RAW_SKIPPED) {
+      temp[i] = BMP280_GAP_TEMP;
+    }
+    if (press && (raw_temp[i] == BMP280_RAW_SKIPPED ||
+		  raw_press[i] == BMP280_RAW_SKIPPED)) {
+      press[i] = BMP280_GAP_PRESS;
+    }
+  }
+  record_bmp280_latency_since(bmp280, BMP280_LATENCY_COMPENSATION, start_ns);
+}
+
+/**
+ * Computes the final temperature, in units of 1/100 degrees Celcius.
+ * Reads the raw temperature from the sensor, then compensates it.
  */
 int read_bmp280_processed_temperature(struct bmp280_ctx *bmp280, s32 *temp) {
   s32 raw_temp;
@@ -186,61 +1004,57 @@ int read_bmp280_processed_temperature(struct bmp280_ctx *bmp280, s32 *temp) {
   if (status) {
     return status;
   }
-  // LS 4 bits of raw temperature are ignored.
-  raw_temp >>= 4;
-  *temp = (compute_bmp280_t_fine(raw_temp, bmp280->dig_T) * 5 + 128) >> 8;
+  *temp = compensate_bmp280_temperature(bmp280, raw_temp);
   return 0;
 }
 
 /**
  * Computes the final pressure, as an unsigned 32 bit integer,
  * in units of 1 / 256 Pascal.
- * We do this using the calibration values and the conversion algorithm
- * described in the datasheet.
- * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp280-ds001.pdf
- * (Section 3.11.3 - Compensation formula)
+ * We need both the raw temperature, and the raw pressure values to compute
+ * the final pressure, so we read a full sample, then compensate it.
  */
 int read_bmp280_processed_pressure(struct bmp280_ctx *bmp280, u32 *press) {
-  // We need both the raw temperature, and the raw pressure values to compute
-  // the final pressure. Pressure registers come before. We read all of them
-  // at once to avoid the risk of the sensor chaning either of them in between
-  // reads.
-  u8 values[6];
-  int read = i2c_smbus_read_i2c_block_data(
-      bmp280->client, BMP280_PRESS_RAW_REG_ADDRESS, /*length=*/6, values);
-  if (read != 6) {
-    pr_err("Expected to read 6 temperature/pressure bytes. Read %d instead\n",
-	   read);
-    return -EIO;
+  struct bmp280_raw_sample sample;
+  int status = read_bmp280_cached_sample(bmp280, &sample);
+  if (status) {
+    return status;
   }
-  s32 p1 = values[0];
-  s32 p2 = values[1];
-  s32 p3 = values[2];
-  s32 raw_press = (p1 << 16) | (p2 << 8) | p3;
-  s32 t1 = values[3];
-  s32 t2 = values[4];
-  s32 t3 = values[5];
-  s32 raw_temp = (t1 << 16) | (t2 << 8) | t3;
-  // LS 4 bits of raw temperature and pressure are ignored.
-  raw_press >>= 4;
-  raw_temp >>= 4;
-  s64 t_fine = compute_bmp280_t_fine(raw_temp, bmp280->dig_T);
-  s64 var1 = t_fine - 128000;
-  s64 var2 = var1 * var1 * bmp280->dig_P[6];
-  var2 = var2 + ((var1 * bmp280->dig_P[5]) << 17);
-  var2 = var2 + (bmp280->dig_P[4] << 35);
-  var1 = (((var1 * var1 * bmp280->dig_P[3]) >> 8) +
-	  ((var1 * bmp280->dig_P[2]) << 12));
-  var1 = ((((s64)1) << 47) + var1) * bmp280->dig_P[1] >> 33;
-  if (var1 == 0) {
-    *press = 0;
-    return 0;
+  *press = compensate_bmp280_pressure(bmp280, &sample);
+  return 0;
+}
+
+s32 compensate_bmp280_altitude(const struct bmp280_ctx *bmp280, u32 press) {
+  if (press == BMP280_GAP_PRESS) {
+    return BMP280_GAP_ALTITUDE;
+  }
+  return compute_bmp280_altitude(press,
+				 READ_ONCE(bmp280->sea_level_pressure));
+}
+
+/**
+ * Computes the altitude above sea level, in millimeters, from the processed
+ * pressure, so it comes from the same sample.
+ */
+int read_bmp280_processed_altitude(struct bmp280_ctx *bmp280, s32 *altitude) {
+  u32 press;
+  int status = read_bmp280_processed_pressure(bmp280, &press);
+  if (status) {
+    return status;
+  }
+  *altitude = compensate_bmp280_altitude(bmp280, press);
+  return 0;
+}
+
+u32 get_bmp280_sea_level_pressure(struct bmp280_ctx *bmp280) {
+  return READ_ONCE(bmp280->sea_level_pressure);
+}
+
+int set_bmp280_sea_level_pressure(struct bmp280_ctx *bmp280, u32 pressure) {
+  if (pressure < BMP280_SEA_LEVEL_PRESSURE_MIN ||
+      pressure > BMP280_SEA_LEVEL_PRESSURE_MAX) {
+    return -EINVAL;
   }
-  s64 p = 1048576 - raw_press;
-  p = (((p << 31) - var2) * 3125) / var1;
-  var1 = (bmp280->dig_P[9] * (p >> 13) * (p >> 13)) >> 25;
-  var2 = (bmp280->dig_P[8] * p) >> 19;
-  p = ((p + var1 + var2) >> 8) + (bmp280->dig_P[7] << 4);
-  *press = (u32)p;
+  WRITE_ONCE(bmp280->sea_level_pressure, pressure);
   return 0;
 }
@@ -1,8 +1,33 @@
 #ifndef BMP280_H_
 #define BMP280_H_
 
+#include <linux/atomic.h>
+#include <linux/bits.h>
+#include <linux/hrtimer.h>
 #include <linux/i2c.h>
+#include <linux/iio/types.h>
+#include <linux/ktime.h>
+#include <linux/kconfig.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "bmp280-compensate.h"
+
+struct bmp280_bus_group;
+struct dev_pm_ops;
+struct iio_chan_spec;
+struct iio_dev;
+struct iio_dev_attr;
+struct iio_trigger;
+struct regmap;
+struct regmap_config;
 
 /**
  * Used as a sanity check during sensor initialization.
@@ -18,6 +43,28 @@
 #define BMP280_CTRL_MEAS_REG_ADDRESS 0xf4
 #define BMP280_CONFIG_REG_ADDRESS 0xf5
 
+/**
+ * Status register. The measuring bit is set while a conversion is running,
+ * and cleared once the results have been transferred to the data registers.
+ */
+#define BMP280_STATUS_REG_ADDRESS 0xf3
+#define BMP280_STATUS_MEASURING BIT(3)
+
+/**
+ * Power modes, as encoded in the 2 LS bits of the ctrl_meas register.
+ */
+#define BMP280_MODE_SLEEP 0x0
+#define BMP280_MODE_FORCED 0x1
+#define BMP280_MODE_NORMAL 0x3
+
+/**
+ * Largest register encodings for oversampling (x16), standby time (4000ms)
+ * and IIR filter coefficient (16).
+ */
+#define BMP280_OSRS_MAX 0x5
+#define BMP280_T_SB_MAX 0x7
+#define BMP280_FILTER_MAX 0x4
+
 /**
  * Register addresses for temperature reading.
  */
@@ -30,29 +77,866 @@
 #define BMP280_PRESS_CALIBRATION_BASE_REG_ADDRESS 0x8e
 #define BMP280_PRESS_RAW_REG_ADDRESS 0xf7
 
+/**
+ * Size of the whole calibration register range (0x88 to 0x9f), three
+ * temperature and nine pressure values of 16 bits each.
+ */
+#define BMP280_CALIBRATION_LENGTH 24
+
+/**
+ * The raw pressure and temperature registers are contiguous (0xf7 to 0xfc),
+ * so a full sample can be read with a single 6 bytes block read.
+ */
+#define BMP280_DATA_BLOCK_REG_ADDRESS BMP280_PRESS_RAW_REG_ADDRESS
+#define BMP280_DATA_BLOCK_LENGTH 6
+
+/**
+ * One raw sensor sample, as read from the data registers in a single burst.
+ * Like read_bmp280_raw_temperature and read_bmp280_raw_pressure, both values
+ * keep the 4 LS padding bits.
+ */
+struct bmp280_raw_sample {
+  s32 raw_temp;
+  s32 raw_press;
+};
+
+/**
+ * Raw value the sensor reports for a skipped measurement, including the 4 LS
+ * padding bits. The driver uses it as well for scans it failed to read, so
+ * gaps in a capture show up in the raw channels. The processed channels read
+ * BMP280_GAP_TEMP, BMP280_GAP_PRESS and BMP280_GAP_ALTITUDE for them.
+ */
+#define BMP280_RAW_SKIPPED 0x800000
+#define BMP280_GAP_TEMP S32_MIN
+#define BMP280_GAP_PRESS 0
+#define BMP280_GAP_ALTITUDE S32_MIN
+
+/**
+ * Pressure at sea level, in Pascal, that altitude is computed against: the
+ * standard atmosphere's by default, and within the sensor's range otherwise.
+ */
+#define BMP280_SEA_LEVEL_PRESSURE_DEFAULT 101325
+#define BMP280_SEA_LEVEL_PRESSURE_MIN 30000
+#define BMP280_SEA_LEVEL_PRESSURE_MAX 110000
+
+/**
+ * Compensated values of one raw sample, in units of 1/100 degrees Celcius and
+ * 1/256 Pascal.
+ */
+struct bmp280_compensated_sample {
+  s32 temp;
+  u32 press;
+};
+
+/**
+ * Sensor configuration, as written to the ctrl_meas and config registers.
+ * Each field holds the register encoding described in the datasheet, not the
+ * value it stands for. E.g. osrs_t = 0x5 means x16 temperature oversampling.
+ * mode is either BMP280_MODE_NORMAL, where the sensor samples continuously,
+ * or BMP280_MODE_FORCED, where the sensor sleeps, and every read starts a
+ * single conversion and waits for it.
+ */
+struct bmp280_config {
+  u8 osrs_t;
+  u8 osrs_p;
+  u8 mode;
+  u8 t_sb;
+  u8 filter;
+};
+
+/**
+ * Engine used when the module is loaded. Can be set at build time, e.g. with
+ * `make PRESSURE_COMPENSATION=s32`, which avoids the 64 bit division, a slow
+ * library helper on 32 bit CPUs, at the cost of resolving whole Pascals only.
+ * See tools/bmp280-compensate-bench.c.
+ */
+#ifndef BMP280_PRESSURE_COMPENSATION_DEFAULT
+#define BMP280_PRESSURE_COMPENSATION_DEFAULT BMP280_PRESSURE_COMPENSATION_S64
+#endif
+
+/**
+ * Scan indices of the channels that can be captured in triggered buffers.
+ */
+enum bmp280_scan_index {
+  BMP280_SCAN_RAW_TEMP,
+  BMP280_SCAN_TEMP,
+  BMP280_SCAN_RAW_PRESS,
+  BMP280_SCAN_PRESS,
+  BMP280_SCAN_ALTITUDE,
+  BMP280_SCAN_TIMESTAMP,
+};
+
+/**
+ * Upper bound on the number of channels stored in a single triggered buffer
+ * scan, not counting the timestamp. Each of them takes at most 32 bits.
+ */
+#define BMP280_SCAN_MAX_CHANNELS BMP280_SCAN_TIMESTAMP
+
+/**
+ * Value of cache_window_us meaning the window follows the sensor's own
+ * sampling period. See compute_bmp280_cache_window_us.
+ */
+#define BMP280_CACHE_WINDOW_AUTO -1
+
+/**
+ * Bus error handling state, see bmp280.c. Every register access is retried a
+ * few times on transient errors. After too many consecutive failures, the
+ * sensor is marked faulted: accesses fail right away, without talking with
+ * the sensor, until next_reprobe, when we check its chip id and calibration
+ * again, and restore its configuration. Each failed re-probe doubles
+ * reprobe_backoff_ms, up to a limit.
+ * The first fields are only used with the bus mutex held. The counters are
+ * atomic, since they are read without it, from sysfs.
+ */
+struct bmp280_health {
+  u32 consecutive_failures;
+  bool faulted;
+  bool reprobing;
+  u32 reprobe_backoff_ms;
+  ktime_t next_reprobe;
+  atomic_t transfer_errors;
+  atomic_t retries;
+  atomic_t fast_fails;
+  atomic_t reprobes;
+  atomic_t gaps;
+};
+
+/**
+ * State of the driver's own trigger, see bmp280-trigger.c.
+ * timer fires once per sensor sampling period, and is re-armed by the trigger
+ * handler. enabled is only changed with lock held, so the handler never
+ * re-arms the timer after the trigger was disabled.
+ * reference is our best estimate of when the sensor ended the conversion we
+ * last pushed, and reference_exact tells whether we saw it happen in the
+ * status register, or only know it happened before we read the sample.
+ * period_ns starts at the nominal sampling period, and follows the sensor's
+ * measured period, since its oscillator does not match ours exactly.
+ * pushed tells that reference is the end of a pushed conversion, rather than
+ * the time the trigger was enabled.
+ */
+struct bmp280_trigger_sync {
+  struct iio_trigger *trig;
+  struct hrtimer timer;
+  spinlock_t lock;
+  bool enabled;
+  ktime_t reference;
+  bool reference_exact;
+  u32 period_ns;
+  u32 lead_ns;
+  bool pushed;
+};
+
+/**
+ * What the trigger handler learned about the sensor's timing during one cycle
+ * of the driver's own trigger.
+ * synced tells that we saw a conversion end, at sync_time. fresh tells that
+ * the sample read during this cycle was not pushed before.
+ */
+struct bmp280_trigger_cycle {
+  bool synced;
+  ktime_t sync_time;
+  bool fresh;
+};
+
+/**
+ * Capacity of the software FIFO, in samples. This is the largest accepted
+ * `hwfifo_watermark`.
+ */
+#define BMP280_FIFO_MAX_SAMPLES 32
+
+/**
+ * Software FIFO, see bmp280-fifo.c.
+ * The BMP280 has no FIFO of its own, so we keep raw samples here until
+ * watermark of them are ready, and push them to the IIO buffers together.
+ * Samples are only compensated when pushed, all the samples of a batch in one
+ * compensate_bmp280_samples call, into temp and press. Each field is its own
+ * array, indexed by position in the FIFO, oldest first. lock protects all of
+ * them, and is only taken by sleeping contexts: the trigger handler, buffer
+ * setup, and reads from the IIO buffer.
+ */
+struct bmp280_fifo {
+  struct mutex lock;
+  u32 watermark;
+  u32 count;
+  s32 raw_temp[BMP280_FIFO_MAX_SAMPLES];
+  s32 raw_press[BMP280_FIFO_MAX_SAMPLES];
+  s64 timestamp[BMP280_FIFO_MAX_SAMPLES];
+  s32 temp[BMP280_FIFO_MAX_SAMPLES];
+  u32 press[BMP280_FIFO_MAX_SAMPLES];
+};
+
+/**
+ * Number of buckets the rolling statistics window is split into. Statistics
+ * cover the window with a granularity of a bucket.
+ */
+#define BMP280_ROLLING_BUCKETS 16
+
+/**
+ * Largest accepted `decimation_factor`.
+ */
+#define BMP280_DECIMATION_MAX_FACTOR 4096
+
+/**
+ * Values the rolling statistics are kept for: the processed temperature and
+ * pressure.
+ */
+enum bmp280_rolling_value {
+  BMP280_ROLLING_TEMP,
+  BMP280_ROLLING_PRESS,
+  BMP280_ROLLING_VALUES,
+};
+
+/**
+ * Rolling statistics, as read from the `in_*_rolling_*` channel attributes.
+ */
+enum bmp280_rolling_stat {
+  BMP280_ROLLING_MEAN,
+  BMP280_ROLLING_MIN,
+  BMP280_ROLLING_MAX,
+};
+
+/**
+ * Count, sum, minimum and maximum of a series of values. Both processed
+ * values, and raw ones, fit in an s64 sum for as many values as we ever add.
+ */
+struct bmp280_accumulator {
+  u32 count;
+  s64 sum;
+  s64 min;
+  s64 max;
+};
+
+/**
+ * One bucket of the rolling statistics: the values of samples timestamped
+ * from start to start plus the bucket length.
+ */
+struct bmp280_rolling_bucket {
+  s64 start;
+  struct bmp280_accumulator values[BMP280_ROLLING_VALUES];
+};
+
+/**
+ * Rolling statistics and decimation stage, see bmp280-filter.c.
+ * The rolling statistics see every sample read from the sensor, and are
+ * protected by rolling_lock, which is taken with the bus mutex held.
+ * buckets is a ring of window_ms / BMP280_ROLLING_BUCKETS long buckets, where
+ * head is the newest one. A window of 0 disables the statistics.
+ * Decimation sees every sample pushed from the trigger handler, and is
+ * protected by the FIFO's lock, which is already held there.
+ * Decimation averages every decimation_factor samples into one. block holds
+ * the samples of the block so far, decimation_count of them, gaps included:
+ * raw temperature, raw pressure, temperature and pressure, in this order.
+ */
+struct bmp280_filter {
+  struct mutex rolling_lock;
+  u32 window_ms;
+  unsigned int head;
+  struct bmp280_rolling_bucket buckets[BMP280_ROLLING_BUCKETS];
+  u32 decimation_factor;
+  u32 decimation_count;
+  struct bmp280_accumulator block[4];
+};
+
+/**
+ * Events each of the processed temperature and pressure can signal: crossing
+ * a rising or falling threshold, and changing faster than a rising or falling
+ * rate.
+ */
+enum bmp280_event_kind {
+  BMP280_EVENT_THRESH_RISING,
+  BMP280_EVENT_THRESH_FALLING,
+  BMP280_EVENT_ROC_RISING,
+  BMP280_EVENT_ROC_FALLING,
+  BMP280_EVENT_KINDS,
+};
+
+/**
+ * Threshold and rate of change events, see bmp280-events.c.
+ * Every field below lock is only used with it held. enabled and fired have
+ * one bit per event, BMP280_EVENT_KINDS for the temperature, then as many for
+ * the pressure. values holds each event's threshold, in 1/100 degrees
+ * Celcius and 1/256 Pascal, or its rate, in the same units per second.
+ * previous is the last sample checked, for the rates of change.
+ * sampler reads the sensor while events are enabled and no buffer capture
+ * runs. During captures, the pushed samples are checked instead.
+ * sampled_time is when the sampler's last sample was read from the sensor,
+ * so a sample it gets from the cache again is not checked twice.
+ */
+struct bmp280_events {
+  struct iio_dev *indio_dev;
+  struct delayed_work sampler;
+  struct mutex lock;
+  u32 enabled;
+  u32 fired;
+  s64 values[2][BMP280_EVENT_KINDS];
+  bool previous_valid;
+  s64 previous[2];
+  s64 previous_timestamp;
+  ktime_t sampled_time;
+};
+
+/**
+ * Membership of a sensor in the group of sensors sharing its I2C adapter,
+ * see bmp280-bus.c.
+ * batched tells that the sensor's capture runs on the group's trigger, so
+ * it is read together with the rest of the group. The group reads sample,
+ * timestamps it and sets generation, all with the group's lock held. block
+ * and reg are this sensor's share of the group's I2C transfer.
+ */
+struct bmp280_bus_member {
+  struct bmp280_bus_group *group;
+  struct list_head node;
+  struct iio_dev *indio_dev;
+  bool batched;
+  u32 generation;
+  struct bmp280_raw_sample sample;
+  s64 timestamp;
+  u8 reg;
+  u8 block[BMP280_DATA_BLOCK_LENGTH];
+};
+
+/**
+ * Event counters kept by the hot path statistics, see bmp280-stats.c.
+ * Dropped samples are samples the IIO buffers did not take. Cache hits and
+ * misses count sysfs reads served from the sample cache, and the ones that
+ * had to talk with the sensor. Bus bytes count the register address and data
+ * bytes of every access that reached the sensor, but not the I2C address
+ * bytes, nor reads served from the regmap cache.
+ */
+enum bmp280_stat {
+  BMP280_STAT_SAMPLES_PUSHED,
+  BMP280_STAT_SAMPLES_DROPPED,
+  BMP280_STAT_CACHE_HITS,
+  BMP280_STAT_CACHE_MISSES,
+  BMP280_STAT_BUS_BYTES,
+  BMP280_STAT_COUNT,
+};
+
+/**
+ * Latencies measured by the hot path statistics: register accesses on the
+ * bus (retries included), compensation calls (batches count once), and the
+ * time from a sample's timestamp to its push into the IIO buffers.
+ */
+enum bmp280_latency {
+  BMP280_LATENCY_TRANSFER,
+  BMP280_LATENCY_COMPENSATION,
+  BMP280_LATENCY_TRIGGER_TO_PUSH,
+  BMP280_LATENCY_COUNT,
+};
+
+/**
+ * Latency histogram buckets. Bucket b counts latencies from 2^b to 2^(b+1)-1
+ * nanoseconds, and the last one everything above.
+ */
+#define BMP280_LATENCY_BUCKETS 32
+
+/**
+ * Hot path statistics of one sensor, on one CPU. Each CPU only updates its
+ * own copy, with this_cpu operations, so updates take no locks and share no
+ * cache lines. Readers add up all copies.
+ */
+struct bmp280_cpu_stats {
+  u64 counters[BMP280_STAT_COUNT];
+  u64 latency_total_ns[BMP280_LATENCY_COUNT];
+  u64 latency_hist[BMP280_LATENCY_COUNT][BMP280_LATENCY_BUCKETS];
+};
+
 /**
  * BMP280 context structure.
- * dig_T and dig_P are the sensor's calibration values, which are constant for
- * any given sensor, so we only read them once and keep store them here.
+ * coeffs holds the constants the compensation formulas derive from the
+ * sensor's calibration values. It comes first, since it is what every
+ * compensation reads. calibration keeps the values as read from the sensor,
+ * for the calibration channels.
+ * All register access goes through regmap, see bmp280_regmap_config, over
+ * either I2C or SPI. client is the underlying I2C client, which the bus group
+ * reads from directly, or NULL for sensors on SPI.
+ * config mirrors what was last written to the ctrl_meas and config registers.
+ * sampling_frequency_avail backs the `sampling_frequency_available` IIO
+ * attribute. It depends on the current oversampling, so it is refreshed on
+ * every read.
+ * cached_sample is the last sample read from the sensor, and
+ * cached_sample_time is when we read it. Sysfs reads within cache_window_us
+ * microseconds of it are served from the cache, without talking with the
+ * sensor.
+ * sea_level_pressure is the reference pressure of the altitude channel, in
+ * Pascal.
+ * Concurrency: lock serializes every transfer with the sensor, including
+ * configuration writes. config and the cached sample are only changed with
+ * lock held, and are published under state_lock, a seqlock, so readers can
+ * copy them without waiting behind bus transfers.
+ * scan is the triggered buffer scan, preallocated here so the trigger handler
+ * does not need to allocate memory. iio_push_to_buffers_with_timestamp stores
+ * the timestamp in the last 8 bytes of the scan, so it must be 8 byte aligned.
+ * trigger is the driver's own trigger, which is the default for the triggered
+ * buffer.
+ * fifo holds triggered buffer samples until a full batch is ready.
+ * filter keeps rolling statistics of the samples read, and decimates the
+ * pushed ones.
+ * events checks samples against the event thresholds.
+ * bus links the sensor with the other sensors on the same I2C adapter.
+ * health tracks bus errors, and whether the sensor is currently faulted.
+ * stats holds the hot path statistics, per CPU. It is only allocated, and
+ * only updated, when debugfs is enabled.
  */
 struct bmp280_ctx {
+  struct bmp280_coeffs coeffs;
+  struct device *dev;
+  struct regmap *regmap;
   struct i2c_client *client;
-  s32 dig_T[4];
-  s64 dig_P[10];
+  struct mutex lock;
+  seqlock_t state_lock;
+  struct bmp280_calibration calibration;
+  struct bmp280_config config;
+  int sampling_frequency_avail[(BMP280_T_SB_MAX + 1) * 2];
+  struct bmp280_raw_sample cached_sample;
+  ktime_t cached_sample_time;
+  bool cached_sample_valid;
+  s32 cache_window_us;
+  u32 sea_level_pressure;
+  struct {
+    u8 data[BMP280_SCAN_MAX_CHANNELS * sizeof(u32)];
+    s64 timestamp __aligned(8);
+  } scan;
+  struct bmp280_trigger_sync trigger;
+  struct bmp280_fifo fifo;
+  struct bmp280_filter filter;
+  struct bmp280_events events;
+  struct bmp280_bus_member bus;
+  struct bmp280_health health;
+  struct bmp280_cpu_stats __percpu *stats;
 };
 
 /**
- * Sets up an IIO device and registers it with the IIO subsystem.
+ * Power management operations of BMP280 IIO devices, for both bus drivers.
+ */
+extern const struct dev_pm_ops bmp280_iio_pm_ops;
+
+/**
+ * Sets up an IIO device for the sensor on dev, and registers it with the IIO
+ * subsystem. regmap reaches the sensor over whichever bus it sits on, and
+ * name is the IIO device name.
+ */
+int register_bmp280_iio_device(struct device *dev, struct regmap *regmap,
+			       const char *name);
+
+/**
+ * Takes the result for each of the enabled channels from a single sample, and
+ * its already compensated values, and assembles them together into the
+ * preallocated scan buffer, according to each channel's scan_type
+ * information. Each value is naturally aligned to its storage size, as the
+ * IIO core expects. Then pushes the scan to the IIO buffers, with the given
+ * timestamp appended by the IIO core.
+ * Every sample is checked against the events first, then goes through the
+ * rolling statistics and decimation, which may hold it back.
+ */
+int bmp280_iio_push_sample(struct iio_dev *indio_dev,
+			   const struct bmp280_raw_sample *sample,
+			   const struct bmp280_compensated_sample *compensated,
+			   s64 timestamp);
+
+// Hot path statistics, see bmp280-stats.c
+
+/**
+ * Allocates the statistics of a sensor, for the lifetime of dev. Does nothing
+ * when debugfs is disabled.
+ */
+int setup_bmp280_stats(struct device *dev, struct bmp280_ctx *bmp280);
+
+/**
+ * Adds the statistics files to the IIO device's debugfs directory. Must be
+ * called after the IIO device is registered, which creates the directory.
+ */
+void register_bmp280_debugfs(struct iio_dev *indio_dev);
+
+/**
+ * Current time for latency measurements, in nanoseconds. Never reads the
+ * clock when debugfs is disabled.
+ */
+static inline u64 bmp280_stats_clock(void) {
+  return IS_ENABLED(CONFIG_DEBUG_FS) ? ktime_get_ns() : 0;
+}
+
+/**
+ * Adds n to one of the event counters.
+ */
+static inline void count_bmp280_stat(const struct bmp280_ctx *bmp280,
+				     enum bmp280_stat stat, u64 n) {
+  if (IS_ENABLED(CONFIG_DEBUG_FS)) {
+    this_cpu_add(bmp280->stats->counters[stat], n);
+  }
+}
+
+/**
+ * Adds a latency of ns nanoseconds to one of the latency histograms.
+ */
+static inline void record_bmp280_latency(const struct bmp280_ctx *bmp280,
+					 enum bmp280_latency latency, u64 ns) {
+  if (!IS_ENABLED(CONFIG_DEBUG_FS)) {
+    return;
+  }
+  unsigned int bucket = min_t(unsigned int, ns ? ilog2(ns) : 0,
+			      BMP280_LATENCY_BUCKETS - 1);
+  this_cpu_inc(bmp280->stats->latency_hist[latency][bucket]);
+  this_cpu_add(bmp280->stats->latency_total_ns[latency], ns);
+}
+
+/**
+ * Adds the time elapsed since start_ns, as returned by bmp280_stats_clock, to
+ * one of the latency histograms.
+ */
+static inline void record_bmp280_latency_since(const struct bmp280_ctx *bmp280,
+					       enum bmp280_latency latency,
+					       u64 start_ns) {
+  record_bmp280_latency(bmp280, latency, bmp280_stats_clock() - start_ns);
+}
+
+// Software FIFO, see bmp280-fifo.c
+
+/**
+ * IIO buffer attributes describing the software FIFO: `hwfifo_enabled`,
+ * `hwfifo_watermark`, `hwfifo_watermark_min` and `hwfifo_watermark_max`.
+ */
+extern const struct iio_dev_attr *bmp280_fifo_attributes[];
+
+/**
+ * Initializes an empty FIFO, which passes every sample straight through.
+ */
+void setup_bmp280_fifo(struct bmp280_ctx *bmp280);
+
+/**
+ * Empties the FIFO, without pushing its samples. Called when a buffer is
+ * enabled.
+ */
+void reset_bmp280_fifo(struct bmp280_ctx *bmp280);
+
+/**
+ * Sets how many samples the FIFO holds before pushing them together.
+ * The value is clamped between 1 and BMP280_FIFO_MAX_SAMPLES, and 1 disables
+ * the FIFO. Used as the IIO `hwfifo_set_watermark` hook, which passes the IIO
+ * buffer's own `watermark`.
  */
-int register_bmp280_iio_device(struct i2c_client *client);
+int set_bmp280_fifo_watermark(struct iio_dev *indio_dev, unsigned int val);
+
+/**
+ * Adds a sample to the FIFO. Pushes the whole FIFO once it holds watermark
+ * samples.
+ */
+int store_bmp280_fifo_sample(struct iio_dev *indio_dev,
+			     const struct bmp280_raw_sample *sample,
+			     s64 timestamp);
+
+/**
+ * Pushes up to `count` of the oldest samples in the FIFO to the IIO buffers,
+ * and returns how many were pushed. Used as the IIO `hwfifo_flush_to_buffer`
+ * hook, so readers asking for more data than the IIO buffer holds do not have
+ * to wait for a full batch.
+ */
+int flush_bmp280_fifo(struct iio_dev *indio_dev, unsigned int count);
+
+/**
+ * Pushes every sample left in the FIFO, then disables it, so samples taken
+ * while the buffer is being disabled are not left behind.
+ */
+int drain_bmp280_fifo(struct iio_dev *indio_dev);
+
+// Rolling statistics and decimation, see bmp280-filter.c
+
+/**
+ * Initializes the filter: rolling statistics disabled, and no decimation.
+ */
+void setup_bmp280_filter(struct bmp280_ctx *bmp280);
+
+/**
+ * Drops the decimation block in progress. Called when a buffer is enabled.
+ */
+void reset_bmp280_decimation(struct bmp280_ctx *bmp280);
+
+/**
+ * Whether the rolling statistics are enabled.
+ */
+bool bmp280_rolling_enabled(struct bmp280_ctx *bmp280);
+
+/**
+ * Compensates a sample just read from the sensor, and adds it to the rolling
+ * statistics, when they are enabled. timestamp is when it was read, on the
+ * monotonic clock, in nanoseconds. Called by publish_bmp280_sample, with the
+ * bus mutex held.
+ */
+void update_bmp280_rolling_stats(struct bmp280_ctx *bmp280,
+				 const struct bmp280_raw_sample *sample,
+				 s64 timestamp);
+
+/**
+ * Adds a sample to the decimation block.
+ * Returns whether a sample should be pushed to the IIO buffers: with
+ * decimation, only at the end of each block, when sample and compensated are
+ * replaced by the means of the block. Values that are gaps are left out of
+ * the means, and a block without any value of a kind reads as a gap.
+ * Expects the FIFO lock to be held.
+ */
+bool filter_bmp280_sample(struct bmp280_ctx *bmp280,
+			  struct bmp280_raw_sample *sample,
+			  struct bmp280_compensated_sample *compensated);
+
+/**
+ * Reads one of the rolling statistics of value, over the window ending at
+ * now, on the monotonic clock, in the units of the processed channels.
+ * Returns -ENODATA when the window holds no value, e.g. with the statistics
+ * disabled, or before any sample was read within the window.
+ */
+int read_bmp280_rolling_stat(struct bmp280_ctx *bmp280,
+			     enum bmp280_rolling_value value,
+			     enum bmp280_rolling_stat stat, s64 now,
+			     s64 *result);
+
+/**
+ * Gets and sets the rolling statistics window, in milliseconds, 0 to disable
+ * them. Setting it starts the statistics over.
+ */
+u32 get_bmp280_rolling_window(struct bmp280_ctx *bmp280);
+void set_bmp280_rolling_window(struct bmp280_ctx *bmp280, u32 window_ms);
+
+/**
+ * Gets and sets how many samples are averaged into each pushed one, from 1,
+ * no decimation, to BMP280_DECIMATION_MAX_FACTOR. Setting it drops the block
+ * in progress.
+ */
+u32 get_bmp280_decimation_factor(struct bmp280_ctx *bmp280);
+int set_bmp280_decimation_factor(struct bmp280_ctx *bmp280, u32 factor);
+
+// Threshold and rate of change events, see bmp280-events.c
+
+/**
+ * Initializes the events, all disabled, and their sampler. The sampler is
+ * stopped when the device is removed.
+ */
+int setup_bmp280_events(struct iio_dev *indio_dev);
+
+/**
+ * Whether any event is enabled. Events need both processed values, even when
+ * the buffer does not capture them.
+ */
+bool bmp280_events_enabled(struct bmp280_ctx *bmp280);
+
+/**
+ * Checks a compensated sample against the enabled events, and pushes the
+ * events it fires to the IIO event queue, with timestamp.
+ */
+void check_bmp280_events(struct iio_dev *indio_dev,
+			 const struct bmp280_compensated_sample *compensated,
+			 s64 timestamp);
+
+/**
+ * IIO event callbacks, reading and writing whether each event is enabled,
+ * and its value.
+ */
+int read_bmp280_event_config(struct iio_dev *indio_dev,
+			     const struct iio_chan_spec *chan,
+			     enum iio_event_type type,
+			     enum iio_event_direction dir);
+int write_bmp280_event_config(struct iio_dev *indio_dev,
+			      const struct iio_chan_spec *chan,
+			      enum iio_event_type type,
+			      enum iio_event_direction dir, bool state);
+int read_bmp280_event_value(struct iio_dev *indio_dev,
+			    const struct iio_chan_spec *chan,
+			    enum iio_event_type type,
+			    enum iio_event_direction dir,
+			    enum iio_event_info info, int *val, int *val2);
+int write_bmp280_event_value(struct iio_dev *indio_dev,
+			     const struct iio_chan_spec *chan,
+			     enum iio_event_type type,
+			     enum iio_event_direction dir,
+			     enum iio_event_info info, int val, int val2);
+
+// Sensors sharing an I2C adapter, see bmp280-bus.c
+
+/**
+ * Adds the sensor to the group of sensors on its I2C adapter, creating the
+ * group and its shared trigger for the first one. The sensor leaves the group
+ * when its device is removed. Sensors on SPI do not join any group.
+ */
+int join_bmp280_bus_group(struct iio_dev *indio_dev);
+
+/**
+ * Tells whether the device's current trigger is its group's shared trigger.
+ */
+bool using_bmp280_bus_trigger(struct iio_dev *indio_dev);
+
+/**
+ * Marks the sensor as captured by its group's shared trigger, or not. Called
+ * when a buffer is enabled or disabled.
+ */
+void set_bmp280_bus_batched(struct iio_dev *indio_dev, bool batched);
+
+/**
+ * Returns this sensor's sample for the current shared trigger event. The
+ * first sensor handling an event reads the whole group, the others take the
+ * sample read for them. `*timestamp` is set to the group's timestamp.
+ */
+int read_bmp280_bus_sample(struct iio_dev *indio_dev,
+			   struct bmp280_raw_sample *sample, s64 *timestamp);
+
+// Driver's own trigger, see bmp280-trigger.c
+
+/**
+ * Allocates and registers an IIO trigger that fires once per sensor sampling
+ * period, and makes it the default trigger of the IIO device.
+ */
+int register_bmp280_trigger(struct iio_dev *indio_dev);
+
+/**
+ * Runs at the start of the trigger handler, when the device uses its own
+ * trigger. In normal mode, waits for a running conversion to end, so we read
+ * its result as soon as possible. If it does, `*timestamp` is set to the time
+ * the conversion ended.
+ */
+void start_bmp280_trigger_cycle(struct iio_dev *indio_dev,
+				struct bmp280_trigger_cycle *cycle,
+				s64 *timestamp);
+
+/**
+ * Tells whether the sample read by the trigger handler should be pushed. In
+ * normal mode, a sample is a duplicate when we neither saw its conversion end
+ * nor waited a whole sampling period since the previous pushed one, so the
+ * sensor has not ended a new conversion since.
+ */
+bool accept_bmp280_trigger_sample(struct iio_dev *indio_dev,
+				  struct bmp280_trigger_cycle *cycle);
+
+/**
+ * Runs at the end of the trigger handler, when the device uses its own
+ * trigger. Re-arms the timer to fire shortly before the sensor is expected to
+ * end its next conversion.
+ */
+void finish_bmp280_trigger_cycle(struct iio_dev *indio_dev,
+				 const struct bmp280_trigger_cycle *cycle);
 
 // BMP280 I2C communication methods
 
+/**
+ * Register map of the sensor. Calibration, identification and configuration
+ * registers are cached, so they are only read from the sensor once, and a
+ * configuration change only writes the registers it changes. The status and
+ * data registers are volatile.
+ */
+extern const struct regmap_config bmp280_regmap_config;
+
 /**
  * Calls sensor initialization functions, then reads the constant calibration
  * values from the sensor and sets the BMP280 context structure.
+ * Every register access goes through regmap, which must have been created
+ * from bmp280_regmap_config.
+ */
+int setup_bmp280(struct device *dev, struct regmap *regmap,
+		 struct bmp280_ctx *bmp280);
+
+/**
+ * Writes a new configuration to the ctrl_meas and config registers, and keeps
+ * a copy of it in the BMP280 context structure.
  */
-int setup_bmp280(struct i2c_client *client, struct bmp280_ctx *bmp280);
+int write_bmp280_config(struct bmp280_ctx *bmp280,
+			const struct bmp280_config *config);
+
+/**
+ * Copies the current sensor configuration, without waiting for bus transfers.
+ */
+void get_bmp280_config(struct bmp280_ctx *bmp280,
+		       struct bmp280_config *config);
+
+/**
+ * Puts the sensor to sleep, keeping its configuration. Used as the runtime
+ * PM suspend callback.
+ */
+int suspend_bmp280(struct bmp280_ctx *bmp280);
+
+/**
+ * Writes the configuration back to the sensor, then waits for its first
+ * conversion in normal mode. Used as the runtime PM resume callback, including
+ * after system suspend, where the sensor might have lost power.
+ */
+int resume_bmp280(struct bmp280_ctx *bmp280);
+
+/**
+ * Oversampling ratio (1 to 16) for an osrs_t or osrs_p register encoding.
+ */
+u32 bmp280_oversampling_ratio(u8 osrs);
+
+/**
+ * IIR filter coefficient (1 means no filtering) for a filter register
+ * encoding.
+ */
+u32 bmp280_filter_coefficient(u8 filter);
+
+/**
+ * Standby time between two measurements in normal mode, in microseconds, for
+ * a t_sb register encoding.
+ */
+u32 bmp280_standby_time_us(u8 t_sb);
+
+/**
+ * Time taken by a single measurement with the given oversampling settings,
+ * in microseconds. Returns the typical time, or the maximum time when
+ * `max` is true.
+ */
+u32 compute_bmp280_measurement_time_us(const struct bmp280_config *config,
+				       bool max);
+
+/**
+ * Time between two consecutive samples in normal mode, in microseconds.
+ * This is the typical measurement time, plus the standby time.
+ */
+u32 compute_bmp280_sampling_period_us(const struct bmp280_config *config);
+
+/**
+ * If the sensor is running a conversion, polls the status register every
+ * `poll_us` microseconds until it ends, for at most `timeout_us`.
+ * Sets `*was_measuring` to whether a conversion was running when we first
+ * read the status register.
+ */
+int wait_bmp280_conversion(struct bmp280_ctx *bmp280, u32 poll_us,
+			   u32 timeout_us, bool *was_measuring);
+
+/**
+ * Accounts for a read of len registers starting at reg that did not go
+ * through read_bmp280_regs, e.g. this sensor's share of a combined I2C
+ * transfer: counts its bus bytes if it succeeded, and its error otherwise,
+ * which marks the sensor faulted after too many of them in a row. Does not
+ * retry, callers fall back to read_bmp280_regs for that.
+ * Must be called with the bus mutex held.
+ */
+void account_bmp280_transfer(struct bmp280_ctx *bmp280, unsigned int reg,
+			     size_t len, int status);
+
+/**
+ * Reads len consecutive registers starting at reg, retrying on transient bus
+ * errors, and keeping track of the sensor's health. Fails right away while
+ * the sensor is faulted, or re-probes it once its backoff window is over.
+ * Must be called with the bus mutex held.
+ */
+int read_bmp280_regs(struct bmp280_ctx *bmp280, unsigned int reg, void *val,
+		     size_t len);
+
+/**
+ * Makes sure the data registers hold a sample we can read.
+ * In normal mode, the sensor keeps them up to date on its own, so there is
+ * nothing to do. In forced mode, we run a new conversion.
+ * Must be called with the bus mutex held.
+ */
+int prepare_bmp280_sample(struct bmp280_ctx *bmp280);
+
+/**
+ * Assembles a raw sample from the 6 bytes of the data registers, pressure
+ * first, as read in a single burst starting at BMP280_DATA_BLOCK_REG_ADDRESS.
+ */
+void decode_bmp280_sample(const u8 *block, struct bmp280_raw_sample *sample);
+
+/**
+ * Stores a sample just read from the sensor as the cached sample.
+ * Must be called with the bus mutex held.
+ */
+void publish_bmp280_sample(struct bmp280_ctx *bmp280,
+			   const struct bmp280_raw_sample *sample);
 
 /**
  * Reads the raw temperature value from the sensor.
@@ -66,6 +950,68 @@ int read_bmp280_raw_temperature(struct bmp280_ctx *bmp280, s32 *raw_temp);
  */
 int read_bmp280_raw_pressure(struct bmp280_ctx *bmp280, s32 *raw_press);
 
+/**
+ * Reads both raw pressure and raw temperature with a single 6 bytes block
+ * read, so both values belong to the same sensor measurement.
+ * Always talks with the sensor, and refreshes the sample cache.
+ */
+int read_bmp280_raw_sample(struct bmp280_ctx *bmp280,
+			   struct bmp280_raw_sample *sample);
+
+/**
+ * Cache freshness window in microseconds. Either the explicitly configured
+ * cache_window_us, or the time it takes the sensor to produce a new sample.
+ */
+u32 compute_bmp280_cache_window_us(struct bmp280_ctx *bmp280);
+
+/**
+ * Returns the last sample read from the sensor if it is still within the
+ * cache freshness window. Otherwise, reads a new sample, like
+ * read_bmp280_raw_sample.
+ */
+int read_bmp280_cached_sample(struct bmp280_ctx *bmp280,
+			      struct bmp280_raw_sample *sample);
+
+/**
+ * Like read_bmp280_cached_sample, but also gives when the sample was read
+ * from the sensor, in ktime_get() time, so callers can tell a cached sample
+ * they already saw from a new one.
+ */
+int read_bmp280_timed_cached_sample(struct bmp280_ctx *bmp280,
+				    struct bmp280_raw_sample *sample,
+				    ktime_t *time);
+
+/**
+ * Copies the cached sample, however old it is, without talking with the
+ * sensor. Returns false if no sample was read since the last configuration
+ * change.
+ */
+bool peek_bmp280_cached_sample(struct bmp280_ctx *bmp280,
+			       struct bmp280_raw_sample *sample);
+
+/**
+ * Computes the final temperature, in units of 1/100 degrees Celcius, from a
+ * raw temperature value. Does not talk with the sensor.
+ */
+s32 compensate_bmp280_temperature(const struct bmp280_ctx *bmp280,
+				  s32 raw_temp);
+
+/**
+ * Computes the final pressure, in units of 1/256 Pascal, from a raw sample.
+ * Does not talk with the sensor.
+ */
+u32 compensate_bmp280_pressure(const struct bmp280_ctx *bmp280,
+			       const struct bmp280_raw_sample *sample);
+
+/**
+ * Compensates n raw samples at once, with compensate_bmp280_batch and the
+ * engine selected by the `pressure_compensation` module parameter. Does not
+ * talk with the sensor.
+ */
+void compensate_bmp280_samples(const struct bmp280_ctx *bmp280,
+			       const s32 *raw_temp, const s32 *raw_press,
+			       s32 *temp, u32 *press, size_t n);
+
 /**
  * Computes the final temperature, in units of 1/100 degrees Celcius.
  */
@@ -77,4 +1023,28 @@ int read_bmp280_processed_temperature(struct bmp280_ctx *bmp280, s32 *temp);
  */
 int read_bmp280_processed_pressure(struct bmp280_ctx *bmp280, u32 *press);
 
+/**
+ * Computes the altitude above sea level, in millimeters, from a pressure in
+ * units of 1/256 Pascal. Gaps in the pressure give BMP280_GAP_ALTITUDE. Does
+ * not talk with the sensor.
+ */
+s32 compensate_bmp280_altitude(const struct bmp280_ctx *bmp280, u32 press);
+
+/**
+ * Computes the altitude above sea level, in millimeters.
+ */
+int read_bmp280_processed_altitude(struct bmp280_ctx *bmp280, s32 *altitude);
+
+/**
+ * Gets the sea level pressure altitude is computed against, in Pascal.
+ */
+u32 get_bmp280_sea_level_pressure(struct bmp280_ctx *bmp280);
+
+/**
+ * Sets the sea level pressure altitude is computed against, in Pascal.
+ * Returns -EINVAL if it is out of the sensor's range, see
+ * BMP280_SEA_LEVEL_PRESSURE_MIN and BMP280_SEA_LEVEL_PRESSURE_MAX.
+ */
+int set_bmp280_sea_level_pressure(struct bmp280_ctx *bmp280, u32 pressure);
+
 #endif  // BMP280_H_
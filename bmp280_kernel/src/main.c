@@ -1,27 +1,31 @@
 /**
  * This file is the main entry point for the module.
- * It sets up an I2C driver for the BMP280 as a kernel module. On the probe
- * method, it exposes an IIO device.
- * This file contains all the module definition and I2C driver code. The logic
- * for IIO support is in `bmp280-iio.c`, while the logic for talking with the
- * BMP280 sensor is in `bmp280.c`.
+ * It sets up I2C and SPI drivers for the BMP280 as a kernel module. On the
+ * probe methods, it creates a register map over the bus the sensor sits on,
+ * and exposes an IIO device on top of it.
+ * This file contains all the module definition, and the I2C and SPI driver
+ * code. The logic for IIO support is in `bmp280-iio.c`, while the logic for
+ * talking with the BMP280 sensor, over either bus, is in `bmp280.c`.
  */
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/err.h>
 #include <linux/i2c.h>
 #include <linux/mod_devicetable.h>
 #include <linux/module.h>
-#include <linux/moduleparam.h>
 #include <linux/of.h>
+#include <linux/pm.h>
 #include <linux/printk.h>
-#include <linux/stat.h>
+#include <linux/regmap.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
 
 #include "bmp280.h"
 
 MODULE_AUTHOR("Nguyen Nhan");
 MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION("An IIO compatible, I2C driver for the Bosch BMP280 "
-		   "temperature and pressure sensor.");
+MODULE_DESCRIPTION("An IIO compatible, I2C and SPI driver for the Bosch "
+		   "BMP280 temperature and pressure sensor.");
 
 /**
  * The industrialio and industrialio-triggered-buffer kernel modules are hard
@@ -29,15 +33,6 @@ MODULE_DESCRIPTION("An IIO compatible, I2C driver for the Bosch BMP280 "
  */
 MODULE_SOFTDEP("pre: industrialio industrialio-triggered-buffer");
 
-/**
- * Expected I2C address. Can be configured as a module parameter if your sensor
- * somehow has a different address.
- * E.g. `sudo insmod bmp280-iio.ko bmp280_i2c_address=<addr>`
- */
-static unsigned short bmp280_i2c_address = 0x76;
-module_param(bmp280_i2c_address, ushort, S_IRUGO);
-MODULE_PARM_DESC(bmp280_i2c_address, "I2C address for the BMP280 sensor");
-
 /**
  * Traditional device table matching approach.
  * Listed here for completness only, since we rely mostly on the device tree.
@@ -51,7 +46,8 @@ static const struct i2c_device_id bmp280_iio_i2c_driver_ids[] = {
 MODULE_DEVICE_TABLE(i2c, bmp280_iio_i2c_driver_ids);
 
 /**
- * Device Tree (OF = open firmware) based matching ids.
+ * Device Tree (OF = open firmware) based matching ids, shared by the I2C and
+ * SPI drivers. Which driver binds depends on the bus the node sits on.
  */
 static const struct of_device_id bmp280_iio_of_driver_ids[] = {
   {
@@ -71,22 +67,27 @@ static struct i2c_driver bmp280_iio_driver = {
   .driver = {
     .name = "leonardo,bmp280-iio",
     .of_match_table = of_match_ptr(bmp280_iio_of_driver_ids),
+    .pm = pm_ptr(&bmp280_iio_pm_ops),
   },
 };
 
 /**
  * I2C driver probe.
- * Performs a sanity check on the client address, then calls up initialization
- * and registration with the IIO subsystem.
+ * Calls up initialization and registration with the IIO subsystem.
+ * We trust the device tree (or device id table) match, so any number of
+ * sensors can be bound at once, on any address, bus or mux channel. Each of
+ * them gets its own IIO device. setup_bmp280 checks the chip id, which
+ * catches a wrong address.
  */
 static int bmp280_iio_probe(struct i2c_client *client) {
-  pr_info("Probing the i2c driver.\n");
-  if (client->addr != bmp280_i2c_address) {
-    pr_err("Probed with unexpected I2C address 0x%02x. Expecting 0x%02x\n",
-	   client->addr, bmp280_i2c_address);
-    return -1;
+  pr_info("Probing the i2c driver at %s, address 0x%02x.\n",
+	  dev_name(&client->adapter->dev), client->addr);
+  struct regmap *regmap = devm_regmap_init_i2c(client, &bmp280_regmap_config);
+  if (IS_ERR(regmap)) {
+    pr_err("Failed to setup I2C register map.\n");
+    return PTR_ERR(regmap);
   }
-  int status = register_bmp280_iio_device(client);
+  int status = register_bmp280_iio_device(&client->dev, regmap, client->name);
   if (status) {
     return status;
   }
@@ -105,8 +106,153 @@ static void bmp280_iio_remove(struct i2c_client *client) {
   pr_info("Removing the i2c driver.\n");
 }
 
+#if IS_ENABLED(CONFIG_SPI_MASTER)
+
+/**
+ * SPI device id table. SPI matches device tree nodes on the compatible string
+ * without its vendor prefix.
+ */
+static const struct spi_device_id bmp280_iio_spi_driver_ids[] = {
+  {
+    .name = "bmp280-iio",
+  },
+  { /* sentinel */ },
+};
+MODULE_DEVICE_TABLE(spi, bmp280_iio_spi_driver_ids);
+
+/**
+ * SPI register writes. On SPI, bit 7 of the register address is the
+ * read/write bit, and it must be 0 for writes. Our regmap only writes one
+ * register at a time, as an address and value pair.
+ */
+static int bmp280_regmap_spi_write(void *context, const void *data,
+				   size_t count) {
+  struct spi_device *spi = context;
+  u8 buffer[2];
+  if (count != sizeof(buffer)) {
+    return -EINVAL;
+  }
+  memcpy(buffer, data, sizeof(buffer));
+  buffer[0] &= ~0x80;
+  return spi_write_then_read(spi, buffer, sizeof(buffer), NULL, 0);
+}
+
+/**
+ * SPI register reads. Every register we read already has bit 7 set, which is
+ * the read command, so the address goes out as is. The sensor then keeps
+ * sending the following registers for as long as we clock, so a bulk read is
+ * a single transfer.
+ */
+static int bmp280_regmap_spi_read(void *context, const void *reg,
+				  size_t reg_size, void *val, size_t val_size) {
+  struct spi_device *spi = context;
+  return spi_write_then_read(spi, reg, reg_size, val, val_size);
+}
+
+/**
+ * Register map bus over SPI. The generic SPI regmap sets the read flag on
+ * reads, but cannot clear bit 7 on writes, so we bring our own.
+ */
+static const struct regmap_bus bmp280_regmap_spi_bus = {
+  .write = bmp280_regmap_spi_write,
+  .read = bmp280_regmap_spi_read,
+  .reg_format_endian_default = REGMAP_ENDIAN_BIG,
+  .val_format_endian_default = REGMAP_ENDIAN_BIG,
+};
+
+static int bmp280_iio_spi_probe(struct spi_device *spi);
+static void bmp280_iio_spi_remove(struct spi_device *spi);
+
+static struct spi_driver bmp280_iio_spi_driver = {
+  .probe = bmp280_iio_spi_probe,
+  .remove = bmp280_iio_spi_remove,
+  .id_table = bmp280_iio_spi_driver_ids,
+  .driver = {
+    .name = "leonardo,bmp280-iio",
+    .of_match_table = of_match_ptr(bmp280_iio_of_driver_ids),
+    .pm = pm_ptr(&bmp280_iio_pm_ops),
+  },
+};
+
+/**
+ * SPI driver probe.
+ * Same as the I2C one, over an SPI register map. The sensor picks its
+ * interface from the level of its chip select line, so it switches to SPI on
+ * the first transfer. The bus speed and mode (0 or 3) come from the device
+ * tree.
+ */
+static int bmp280_iio_spi_probe(struct spi_device *spi) {
+  pr_info("Probing the spi driver at %s, %u Hz.\n", dev_name(&spi->dev),
+	  spi->max_speed_hz);
+  spi->bits_per_word = 8;
+  int status = spi_setup(spi);
+  if (status) {
+    pr_err("Failed to setup SPI device: %d\n", status);
+    return status;
+  }
+  struct regmap *regmap = devm_regmap_init(&spi->dev, &bmp280_regmap_spi_bus,
+					   spi, &bmp280_regmap_config);
+  if (IS_ERR(regmap)) {
+    pr_err("Failed to setup SPI register map.\n");
+    return PTR_ERR(regmap);
+  }
+  status = register_bmp280_iio_device(&spi->dev, regmap, spi->modalias);
+  if (status) {
+    return status;
+  }
+  pr_info("Probed spi driver successfully.\n");
+  return 0;
+}
+
 /**
- * This macro gets replaced by a module __init/__exit function pair,
- * that does nothing other than registering/unregistering the I2C driver.
-*/
-module_i2c_driver(bmp280_iio_driver);
+ * SPI driver remove. Like the I2C one, everything is device managed.
+ */
+static void bmp280_iio_spi_remove(struct spi_device *spi) {
+  pr_info("Removing the spi driver.\n");
+}
+
+static int bmp280_iio_register_spi_driver(void) {
+  return spi_register_driver(&bmp280_iio_spi_driver);
+}
+
+static void bmp280_iio_unregister_spi_driver(void) {
+  spi_unregister_driver(&bmp280_iio_spi_driver);
+}
+
+#else
+
+static int bmp280_iio_register_spi_driver(void) {
+  return 0;
+}
+
+static void bmp280_iio_unregister_spi_driver(void) {
+}
+
+#endif
+
+/**
+ * Module init. Registers both drivers, so sensors bind on whichever bus the
+ * device tree puts them on.
+ */
+static int __init bmp280_iio_init(void) {
+  int status = i2c_add_driver(&bmp280_iio_driver);
+  if (status) {
+    return status;
+  }
+  status = bmp280_iio_register_spi_driver();
+  if (status) {
+    i2c_del_driver(&bmp280_iio_driver);
+  }
+  return status;
+}
+
+/**
+ * Module exit. Unregisters both drivers, which removes every sensor.
+ */
+static void __exit bmp280_iio_exit(void) {
+  bmp280_iio_unregister_spi_driver();
+  i2c_del_driver(&bmp280_iio_driver);
+}
+
+module_init(bmp280_iio_init);
+module_exit(bmp280_iio_exit);
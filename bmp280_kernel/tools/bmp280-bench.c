@@ -0,0 +1,395 @@
+/**
+ * This file implements `bmp280-bench`, which captures from one or more BMP280
+ * IIO devices at once, for a fixed time, and prints one CSV row of results:
+ * samples per second, gaps and dropped samples, trigger to userspace latency
+ * percentiles, CPU time per sample, and bus bytes per sample. It does not
+ * pick the trigger or its rate, see bmp280-bench.sh for the sweeps, and
+ * `bmp280-bench -h`. `bmp280-bench -H` prints the CSV header.
+ * Latencies are the time from a scan's timestamp until the read that got it
+ * returned, so they need the devices to timestamp with the monotonic clock,
+ * which this sets unless told to keep the configuration. They include the
+ * time the scan waited for the rest of its batch, so use a batch of 1 to
+ * measure the driver alone. CPU time is for the whole system, from
+ * /proc/stat, so it includes this tool, and the bus bytes come from the
+ * driver's debugfs statistics. Either is left empty when not available.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmp280-reader.h"
+
+/**
+ * Most devices captured at once.
+ */
+#define BMP280_BENCH_MAX_DEVICES 16
+
+/**
+ * Set by SIGINT and SIGTERM, to end the capture early.
+ */
+static volatile sig_atomic_t bmp280_bench_stopping;
+
+static void bmp280_bench_stop(int signal) {
+  (void)signal;
+  bmp280_bench_stopping = 1;
+}
+
+/**
+ * Names of the -m masks, indexed by enum bmp280_capture.
+ */
+static const char * const bmp280_bench_masks[] = {
+  "processed", "raw", "all",
+};
+
+static void bmp280_bench_usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [-d device]... [-m mask] [-t seconds] [-b batch] "
+	  "[-l length] [-k] [-H]\n"
+	  "  -d  IIO device, repeat for several, default iio:device0\n"
+	  "  -m  channels to capture: processed, raw or all, default "
+	  "processed\n"
+	  "  -t  capture time, in seconds, default 10\n"
+	  "  -b  samples per read, and buffer watermark, default 1\n"
+	  "  -l  buffer length, in samples, default 1024\n"
+	  "  -k  keep the buffer configuration, and just read\n"
+	  "  -H  print the CSV header, and exit\n",
+	  name);
+}
+
+static uint64_t bmp280_bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reads a whole, short file into buf, as a string. Returns whether it could.
+ */
+static bool read_bmp280_bench_file(const char *path, char *buf, size_t size) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    return false;
+  }
+  size_t n = fread(buf, 1, size - 1, file);
+  bool ok = !ferror(file);
+  fclose(file);
+  buf[n] = '\0';
+  return ok;
+}
+
+static bool write_bmp280_bench_file(const char *path, const char *value) {
+  FILE *file = fopen(path, "we");
+  if (!file) {
+    return false;
+  }
+  bool ok = fputs(value, file) >= 0;
+  return fclose(file) == 0 && ok;
+}
+
+/**
+ * Reads one counter from the device's debugfs `stats` file. Returns whether
+ * it could, e.g. not without root, or with an older driver.
+ */
+static bool read_bmp280_bench_stat(const char *device, const char *name,
+				   uint64_t *value) {
+  char path[PATH_MAX];
+  char buf[1024];
+  snprintf(path, sizeof(path), "/sys/kernel/debug/iio/%s/stats", device);
+  if (!read_bmp280_bench_file(path, buf, sizeof(buf))) {
+    return false;
+  }
+  size_t length = strlen(name);
+  for (char *line = buf; line && *line; line = strchr(line, '\n')) {
+    line += *line == '\n';
+    if (!strncmp(line, name, length) && line[length] == ' ') {
+      *value = strtoull(line + length + 1, NULL, 10);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Adds up one counter over all devices. Returns whether every device had it.
+ */
+static bool sum_bmp280_bench_stat(const char * const *devices,
+				  size_t device_count, const char *name,
+				  uint64_t *sum) {
+  *sum = 0;
+  for (size_t i = 0; i < device_count; i++) {
+    uint64_t value;
+    if (!read_bmp280_bench_stat(devices[i], name, &value)) {
+      return false;
+    }
+    *sum += value;
+  }
+  return true;
+}
+
+/**
+ * Reads the CPU time spent outside of the idle task so far, all CPUs added
+ * up, in clock ticks. Returns whether it could.
+ */
+static bool read_bmp280_bench_busy_ticks(uint64_t *busy) {
+  char buf[256];
+  unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+  if (!read_bmp280_bench_file("/proc/stat", buf, sizeof(buf)) ||
+      sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+	     &system, &idle, &iowait, &irq, &softirq, &steal) != 8) {
+    return false;
+  }
+  *busy = user + nice + system + irq + softirq + steal;
+  return true;
+}
+
+/**
+ * Whether device timestamps its scans with the monotonic clock.
+ */
+static bool is_bmp280_bench_monotonic(const char *device) {
+  char path[PATH_MAX];
+  char buf[32];
+  snprintf(path, sizeof(path),
+	   "/sys/bus/iio/devices/%s/current_timestamp_clock", device);
+  return read_bmp280_bench_file(path, buf, sizeof(buf)) &&
+    !strncmp(buf, "monotonic", strlen("monotonic"));
+}
+
+static int compare_bmp280_bench_latency(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Prints the p-th percentile of the n sorted latencies, in microseconds, or
+ * nothing without any.
+ */
+static void print_bmp280_bench_percentile(const int64_t *latencies, size_t n,
+					  double p) {
+  if (n) {
+    size_t i = (size_t)ceil(p / 100 * n);
+    printf("%.1f", latencies[i ? i - 1 : 0] / 1000.0);
+  }
+}
+
+/**
+ * Latencies of every sample captured so far, in nanoseconds.
+ */
+struct bmp280_bench_latencies {
+  int64_t *values;
+  size_t count;
+  size_t capacity;
+};
+
+static bool add_bmp280_bench_latency(struct bmp280_bench_latencies *latencies,
+				     int64_t ns) {
+  if (latencies->count == latencies->capacity) {
+    size_t capacity = latencies->capacity ? 2 * latencies->capacity : 4096;
+    int64_t *values = realloc(latencies->values, capacity * sizeof(*values));
+    if (!values) {
+      return false;
+    }
+    latencies->values = values;
+    latencies->capacity = capacity;
+  }
+  latencies->values[latencies->count++] = ns;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *devices[BMP280_BENCH_MAX_DEVICES];
+  size_t device_count = 0;
+  enum bmp280_capture capture = BMP280_CAPTURE_PROCESSED;
+  double seconds = 10;
+  unsigned int batch = 1;
+  unsigned int length = 1024;
+  bool keep = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:m:t:b:l:kHh")) != -1) {
+    if (opt == 'd' && device_count < BMP280_BENCH_MAX_DEVICES) {
+      devices[device_count++] = optarg;
+    } else if (opt == 'd') {
+      fprintf(stderr, "At most %d devices.\n", BMP280_BENCH_MAX_DEVICES);
+      return 2;
+    } else if (opt == 'm') {
+      size_t i = 0;
+      while (i <= BMP280_CAPTURE_ALL &&
+	     strcmp(optarg, bmp280_bench_masks[i])) {
+	i++;
+      }
+      if (i > BMP280_CAPTURE_ALL) {
+	bmp280_bench_usage(argv[0]);
+	return 2;
+      }
+      capture = i;
+    } else if (opt == 't') {
+      seconds = strtod(optarg, NULL);
+    } else if (opt == 'b') {
+      batch = strtoul(optarg, NULL, 10);
+    } else if (opt == 'l') {
+      length = strtoul(optarg, NULL, 10);
+    } else if (opt == 'k') {
+      keep = true;
+    } else if (opt == 'H') {
+      printf("sensors,mask,samples,samples_per_s,gaps,dropped,lat_p50_us,"
+	     "lat_p90_us,lat_p99_us,lat_max_us,cpu_us_per_sample,"
+	     "bus_bytes_per_sample\n");
+      return 0;
+    } else {
+      bmp280_bench_usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!device_count) {
+    devices[device_count++] = "iio:device0";
+  }
+  if (!batch || length < batch) {
+    fprintf(stderr, "The batch must fit in the buffer.\n");
+    return 2;
+  }
+  struct sigaction action = { .sa_handler = bmp280_bench_stop };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  struct bmp280_reader readers[BMP280_BENCH_MAX_DEVICES];
+  struct pollfd fds[BMP280_BENCH_MAX_DEVICES];
+  size_t started = 0;
+  size_t opened = 0;
+  int status = 0;
+  bool monotonic = true;
+  for (size_t i = 0; i < device_count && !status; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path),
+	     "/sys/bus/iio/devices/%s/current_timestamp_clock", devices[i]);
+    if (!keep) {
+      // The clock cannot change while the buffer runs.
+      stop_bmp280_capture(devices[i]);
+      write_bmp280_bench_file(path, "monotonic");
+    }
+    monotonic = monotonic && is_bmp280_bench_monotonic(devices[i]);
+    status = keep ? 0 : start_bmp280_capture(devices[i], capture, length, batch);
+    if (status) {
+      fprintf(stderr, "Failed to start the capture on %s: %s\n", devices[i],
+	      strerror(-status));
+      break;
+    }
+    started += !keep;
+    status = open_bmp280_reader(&readers[i], devices[i], batch);
+    if (status) {
+      fprintf(stderr, "Failed to open %s: %s\n", devices[i], strerror(-status));
+      break;
+    }
+    opened++;
+    fds[i] = (struct pollfd){ .fd = readers[i].fd, .events = POLLIN };
+  }
+  if (!monotonic && !status) {
+    fprintf(stderr, "Not every device timestamps with the monotonic clock, "
+	    "leaving the latencies out.\n");
+  }
+
+  uint64_t bytes_before = 0, bytes_after = 0;
+  uint64_t dropped_before = 0, dropped_after = 0;
+  uint64_t busy_before = 0, busy_after = 0;
+  bool have_bytes = sum_bmp280_bench_stat(devices, device_count, "bus_bytes",
+					  &bytes_before);
+  bool have_dropped = sum_bmp280_bench_stat(devices, device_count,
+					    "samples_dropped", &dropped_before);
+  bool have_busy = read_bmp280_bench_busy_ticks(&busy_before);
+  struct bmp280_bench_latencies latencies = { 0 };
+  uint64_t samples = 0;
+  uint64_t gaps = 0;
+  uint64_t start_ns = bmp280_bench_now_ns();
+  uint64_t end_ns = start_ns + (uint64_t)(seconds * 1e9);
+  uint64_t now_ns = start_ns;
+  while (!status && !bmp280_bench_stopping && now_ns < end_ns) {
+    int timeout_ms = (int)((end_ns - now_ns + 999999) / 1000000);
+    int ready = poll(fds, device_count, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+      status = -errno;
+      fprintf(stderr, "Failed to wait for samples: %s\n", strerror(errno));
+    }
+    for (size_t i = 0; ready > 0 && i < device_count && !status; i++) {
+      if (!(fds[i].revents & POLLIN)) {
+	continue;
+      }
+      ssize_t n = read_bmp280_samples(&readers[i]);
+      uint64_t read_ns = bmp280_bench_now_ns();
+      if (n == -EINTR || n == -EAGAIN) {
+	continue;
+      } else if (n < 0) {
+	fprintf(stderr, "Failed to read samples from %s: %s\n", devices[i],
+		strerror(-n));
+	status = n;
+	break;
+      }
+      const struct bmp280_samples *batch_samples = &readers[i].samples;
+      for (size_t j = 0; j < batch_samples->count; j++) {
+	gaps += isnan(batch_samples->temp[j]);
+	if (monotonic &&
+	    !add_bmp280_bench_latency(&latencies, (int64_t)read_ns -
+				      batch_samples->timestamp[j])) {
+	  status = -ENOMEM;
+	}
+      }
+      samples += batch_samples->count;
+    }
+    now_ns = bmp280_bench_now_ns();
+  }
+  double elapsed = (now_ns - start_ns) / 1e9;
+  have_busy = have_busy && read_bmp280_bench_busy_ticks(&busy_after);
+  have_bytes = have_bytes &&
+    sum_bmp280_bench_stat(devices, device_count, "bus_bytes", &bytes_after);
+  have_dropped = have_dropped &&
+    sum_bmp280_bench_stat(devices, device_count, "samples_dropped",
+			  &dropped_after);
+
+  for (size_t i = 0; i < opened; i++) {
+    close_bmp280_reader(&readers[i]);
+  }
+  for (size_t i = 0; i < started; i++) {
+    stop_bmp280_capture(devices[i]);
+  }
+  if (status) {
+    free(latencies.values);
+    return 1;
+  }
+
+  qsort(latencies.values, latencies.count, sizeof(*latencies.values),
+	compare_bmp280_bench_latency);
+  printf("%zu,%s,%" PRIu64 ",%.1f,%" PRIu64 ",", device_count,
+	 bmp280_bench_masks[capture], samples, elapsed ? samples / elapsed : 0,
+	 gaps);
+  if (have_dropped) {
+    printf("%" PRIu64, dropped_after - dropped_before);
+  }
+  putchar(',');
+  print_bmp280_bench_percentile(latencies.values, latencies.count, 50);
+  putchar(',');
+  print_bmp280_bench_percentile(latencies.values, latencies.count, 90);
+  putchar(',');
+  print_bmp280_bench_percentile(latencies.values, latencies.count, 99);
+  putchar(',');
+  print_bmp280_bench_percentile(latencies.values, latencies.count, 100);
+  putchar(',');
+  if (have_busy && samples) {
+    double tick_us = 1e6 / sysconf(_SC_CLK_TCK);
+    printf("%.1f", (busy_after - busy_before) * tick_us / samples);
+  }
+  putchar(',');
+  if (have_bytes && samples) {
+    printf("%.1f", (double)(bytes_after - bytes_before) / samples);
+  }
+  putchar('\n');
+  free(latencies.values);
+  return 0;
+}
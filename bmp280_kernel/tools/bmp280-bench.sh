@@ -0,0 +1,202 @@
+#!/bin/bash
+# Benchmark sweeps for the driver, over sensor counts, trigger rates and
+# channel masks. Prints one CSV row per combination, see bmp280-bench.c for
+# the columns. Needs root, the module built next to this directory, and
+# i2c-tools.
+#
+# By default, the sensors are emulated with i2c-stub, seeded with the
+# datasheet calibration and readings, and captured with an hrtimer trigger,
+# so this runs on any machine. The stub's status register never shows a
+# conversion, so the driver's own trigger cannot lock onto it.
+# With -n, the sensors already bound to the driver, e.g. through the device
+# tree overlay, are captured instead, and the rate `own` means each sensor's
+# own trigger, at its current sampling frequency.
+#
+# A soak test is a single long run, e.g. `-s 2 -r 100 -m processed -t 3600`,
+# then checking its gaps and dropped samples.
+set -eu
+
+usage() {
+  cat >&2 <<EOF
+Usage: $0 [-n] [-s counts] [-r rates] [-m masks] [-t seconds] [-b batch]
+  -n  native mode, with the sensors already bound to the driver
+  -s  sensor counts, default "1 2 4", or "1" in native mode
+  -r  trigger rates in Hz, default "10 50 100 200", or "own 10 50 100" in
+      native mode
+  -m  channel masks, default "processed raw all"
+  -t  seconds per combination, default 10
+  -b  samples per read, and buffer watermark, default 1
+EOF
+  exit 2
+}
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+BENCH=$DIR/bmp280-bench
+MODULE=$DIR/../bmp280-iio.ko
+TRIGGER=bmp280-bench
+STUB_ADDRS=(0x70 0x71 0x72 0x73 0x74 0x75 0x76 0x77)
+
+native=0
+counts=
+rates=
+masks="processed raw all"
+seconds=10
+batch=1
+while getopts "ns:r:m:t:b:h" opt; do
+  case $opt in
+    n) native=1 ;;
+    s) counts=$OPTARG ;;
+    r) rates=$OPTARG ;;
+    m) masks=$OPTARG ;;
+    t) seconds=$OPTARG ;;
+    b) batch=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+if [ "$native" = 1 ]; then
+  counts=${counts:-1}
+  rates=${rates:-"own 10 50 100"}
+else
+  counts=${counts:-"1 2 4"}
+  rates=${rates:-"10 50 100 200"}
+fi
+
+if [ "$(id -u)" != 0 ]; then
+  echo "Needs root, for debugfs, configfs and binding the sensors." >&2
+  exit 1
+fi
+if [ ! -x "$BENCH" ]; then
+  echo "Build the tools first, with \`make tools\`." >&2
+  exit 1
+fi
+
+devices=()
+saved_triggers=()
+stub_bus=
+trigger_dir=
+
+cleanup() {
+  for i in "${!saved_triggers[@]}"; do
+    echo "${saved_triggers[$i]}" > \
+      "/sys/bus/iio/devices/${devices[$i]}/trigger/current_trigger" || true
+  done
+  if [ -n "$trigger_dir" ]; then
+    rmdir "/sys/kernel/config/iio/triggers/hrtimer/$TRIGGER" || true
+  fi
+  if [ -n "$stub_bus" ]; then
+    for addr in "${STUB_ADDRS[@]}"; do
+      if [ -e "/sys/bus/i2c/devices/$stub_bus-00${addr#0x}" ]; then
+	echo "$addr" > "/sys/bus/i2c/devices/i2c-$stub_bus/delete_device"
+      fi
+    done
+    rmmod i2c_stub || true
+  fi
+}
+trap cleanup EXIT
+
+if [ ! -d /sys/module/bmp280_iio ]; then
+  insmod "$MODULE"
+fi
+
+max_count=0
+for count in $counts; do
+  if [ "$count" -gt "$max_count" ]; then
+    max_count=$count
+  fi
+done
+
+if [ "$native" = 1 ]; then
+  for dev in /sys/bus/iio/devices/iio:device*; do
+    case $(cat "$dev/name") in
+      *bmp280*) devices+=("$(basename "$dev")") ;;
+    esac
+  done
+else
+  if [ "$max_count" -gt "${#STUB_ADDRS[@]}" ]; then
+    echo "At most ${#STUB_ADDRS[@]} emulated sensors." >&2
+    exit 1
+  fi
+  if [ -d /sys/module/i2c_stub ]; then
+    echo "i2c-stub is already loaded, unload it first." >&2
+    exit 1
+  fi
+  addrs=("${STUB_ADDRS[@]:0:$max_count}")
+  modprobe i2c-stub chip_addr=$(IFS=,; echo "${addrs[*]}")
+  for bus in /sys/bus/i2c/devices/i2c-*; do
+    if [ "$(cat "$bus/name")" = "SMBus stub driver" ]; then
+      stub_bus=${bus##*/i2c-}
+    fi
+  done
+  if [ -z "$stub_bus" ]; then
+    echo "Could not find the i2c-stub adapter." >&2
+    exit 1
+  fi
+  # Datasheet calibration, at 0x88, then its example readings, at 0xf7:
+  # 25.08 C and 100653.25 Pa.
+  calibration=(0x70 0x6b 0x43 0x67 0x18 0xfc 0x7d 0x8e 0x41 0xd6 0xd0 0x0b
+	       0x27 0x0b 0x8c 0x00 0xf9 0xff 0x8c 0x3c 0xf8 0xc6 0x70 0x17)
+  readings=(0x65 0x5a 0xc0 0x7e 0xed 0x00)
+  for addr in "${addrs[@]}"; do
+    for i in "${!calibration[@]}"; do
+      i2cset -y "$stub_bus" "$addr" $((0x88 + i)) "${calibration[$i]}"
+    done
+    for i in "${!readings[@]}"; do
+      i2cset -y "$stub_bus" "$addr" $((0xf7 + i)) "${readings[$i]}"
+    done
+    echo "leonardo,bmp280-iio $addr" > \
+      "/sys/bus/i2c/devices/i2c-$stub_bus/new_device"
+    dev=(/sys/bus/i2c/devices/$stub_bus-00${addr#0x}/iio:device*)
+    if [ ! -e "${dev[0]}" ]; then
+      echo "The driver did not bind to the sensor at $addr." >&2
+      exit 1
+    fi
+    devices+=("$(basename "${dev[0]}")")
+  done
+fi
+if [ "${#devices[@]}" -lt "$max_count" ]; then
+  echo "Found ${#devices[@]} sensors, need $max_count." >&2
+  exit 1
+fi
+for dev in "${devices[@]}"; do
+  saved_triggers+=("$(cat "/sys/bus/iio/devices/$dev/trigger/current_trigger")")
+done
+
+for rate in $rates; do
+  if [ "$rate" != own ] && [ -z "$trigger_dir" ]; then
+    modprobe iio-trig-hrtimer
+    mkdir "/sys/kernel/config/iio/triggers/hrtimer/$TRIGGER"
+    for trig in /sys/bus/iio/devices/trigger*; do
+      if [ "$(cat "$trig/name")" = "$TRIGGER" ]; then
+	trigger_dir=$trig
+      fi
+    done
+  fi
+  if [ "$rate" = own ] && [ "$native" = 0 ]; then
+    echo "The rate own only works in native mode." >&2
+    exit 1
+  fi
+done
+
+echo "rate,$("$BENCH" -H)"
+for count in $counts; do
+  for rate in $rates; do
+    if [ "$rate" != own ]; then
+      echo "$rate" > "$trigger_dir/sampling_frequency"
+    fi
+    args=()
+    for ((i = 0; i < count; i++)); do
+      dev=${devices[$i]}
+      if [ "$rate" = own ]; then
+	trigger=${saved_triggers[$i]}
+      else
+	trigger=$TRIGGER
+      fi
+      echo 0 > "/sys/bus/iio/devices/$dev/buffer/enable"
+      echo "$trigger" > "/sys/bus/iio/devices/$dev/trigger/current_trigger"
+      args+=(-d "$dev")
+    done
+    for mask in $masks; do
+      echo "$rate,$("$BENCH" "${args[@]}" -m "$mask" -t "$seconds" -b "$batch")"
+    done
+  done
+done
@@ -0,0 +1,259 @@
+/**
+ * This file implements `bmp280-compensate-bench`, a microbenchmark of the
+ * pressure compensation engines, built from the driver's own
+ * bmp280-compensate.c. For each engine, it prints how long a sample takes,
+ * compensated one call at a time and in batches, and how its results differ
+ * from the s64 reference engine's: how many differ, and by how much at most.
+ * Samples are random raw values, with the datasheet's calibration, that
+ * compensate to within the sensor's operating range. With -f, the
+ * differences are taken over the whole input space instead: random
+ * calibration words and raw values, in or out of range. Build it with
+ * `-fsanitize=undefined` to also catch the formulas overflowing, see the
+ * README. See `bmp280-compensate-bench -h`.
+ */
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmp280-compensate.h"
+
+/**
+ * Calibration of the datasheet's example, Section 3.12, which compensates its
+ * raw example readings, 519888 and 415148, to 25.08 C and 100653.25 Pa.
+ */
+static const struct bmp280_calibration bmp280_datasheet_calibration = {
+  .dig_T = { 27504, 26435, (u16)-1000 },
+  .dig_P = { 36477, (u16)-10685, 3024, 2855, 140, (u16)-7, 15500,
+	     (u16)-14600, 6000 },
+};
+
+/**
+ * Number of random calibrations the -f samples are spread over.
+ */
+#define BMP280_BENCH_CALIBRATIONS 256
+
+/**
+ * Names of the engines, indexed by enum bmp280_pressure_compensation.
+ */
+static const char * const bmp280_bench_engines[] = {
+  "s64", "s32",
+};
+
+/**
+ * Keeps the compensated values alive, so the compiler cannot drop the work.
+ */
+static volatile u32 bmp280_bench_sink;
+
+static void bmp280_bench_usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [-n samples] [-i passes] [-s seed] [-f]\n"
+	  "  -n  random samples, default 100000\n"
+	  "  -i  timed passes over them, default 20\n"
+	  "  -s  random seed, default 1\n"
+	  "  -f  compare the engines over the whole input space\n",
+	  name);
+}
+
+/**
+ * splitmix64, so runs with the same seed get the same samples everywhere.
+ */
+static u64 next_bmp280_bench_random(u64 *state) {
+  u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * A raw 20 bit reading, with its 4 LS padding bits, as the driver reads it.
+ */
+static s32 next_bmp280_bench_raw(u64 *state) {
+  return (s32)(next_bmp280_bench_random(state) & 0xfffff) << 4;
+}
+
+static double bmp280_bench_now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills raw_temp and raw_press with n random readings that compensate, with
+ * coeffs, to -40 to 85 C and 300 to 1100 hPa, the sensor's operating range.
+ */
+static void fill_bmp280_bench_samples(const struct bmp280_coeffs *coeffs,
+				      u64 *state, s32 *raw_temp,
+				      s32 *raw_press, size_t n) {
+  for (size_t i = 0; i < n;) {
+    s32 t = next_bmp280_bench_raw(state);
+    s32 p = next_bmp280_bench_raw(state);
+    s32 temp = compensate_bmp280_raw_temperature(coeffs, t);
+    u32 press = compensate_bmp280_raw_pressure(
+      coeffs, BMP280_PRESSURE_COMPENSATION_S64, t, p) / 256;
+    if (temp >= -4000 && temp <= 8500 && press >= 30000 && press <= 110000) {
+      raw_temp[i] = t;
+      raw_press[i] = p;
+      i++;
+    }
+  }
+}
+
+/**
+ * Differences of one engine from the reference one, over some samples.
+ */
+struct bmp280_bench_diff {
+  size_t count;
+  u32 max;
+};
+
+static void add_bmp280_bench_diff(struct bmp280_bench_diff *diff, u32 value,
+				  u32 reference) {
+  u32 d = value > reference ? value - reference : reference - value;
+  diff->count += d != 0;
+  diff->max = d > diff->max ? d : diff->max;
+}
+
+/**
+ * Compares every engine with the reference one over the samples, all
+ * compensated with coeffs.
+ */
+static void compare_bmp280_bench_engines(const struct bmp280_coeffs *coeffs,
+					 const s32 *raw_temp,
+					 const s32 *raw_press, size_t n,
+					 struct bmp280_bench_diff *diffs) {
+  for (size_t i = 0; i < n; i++) {
+    u32 reference = compensate_bmp280_raw_pressure(
+      coeffs, BMP280_PRESSURE_COMPENSATION_S64, raw_temp[i], raw_press[i]);
+    for (int engine = 0; engine < BMP280_PRESSURE_COMPENSATION_ENGINES;
+	 engine++) {
+      u32 value = compensate_bmp280_raw_pressure(coeffs, engine, raw_temp[i],
+						 raw_press[i]);
+      add_bmp280_bench_diff(&diffs[engine], value, reference);
+    }
+  }
+}
+
+/**
+ * Times passes over the samples with engine, one call per sample, or one
+ * batch for all of them. Returns the best pass, in nanoseconds per sample.
+ */
+static double time_bmp280_bench_engine(const struct bmp280_coeffs *coeffs,
+				       int engine, bool batch,
+				       const s32 *raw_temp,
+				       const s32 *raw_press, u32 *press,
+				       size_t n, unsigned int passes) {
+  double best = 0;
+  for (unsigned int pass = 0; pass < passes; pass++) {
+    double start = bmp280_bench_now_s();
+    if (batch) {
+      compensate_bmp280_batch(coeffs, engine, raw_temp, raw_press, NULL, press,
+			      n);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+	press[i] = compensate_bmp280_raw_pressure(coeffs, engine, raw_temp[i],
+						  raw_press[i]);
+      }
+    }
+    double elapsed = bmp280_bench_now_s() - start;
+    bmp280_bench_sink += press[n - 1];
+    best = !pass || elapsed < best ? elapsed : best;
+  }
+  return best * 1e9 / n;
+}
+
+int main(int argc, char **argv) {
+  size_t n = 100000;
+  unsigned int passes = 20;
+  u64 seed = 1;
+  bool full = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:i:s:fh")) != -1) {
+    if (opt == 'n') {
+      n = strtoul(optarg, NULL, 10);
+    } else if (opt == 'i') {
+      passes = strtoul(optarg, NULL, 10);
+    } else if (opt == 's') {
+      seed = strtoull(optarg, NULL, 10);
+    } else if (opt == 'f') {
+      full = true;
+    } else {
+      bmp280_bench_usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!n || !passes) {
+    fprintf(stderr, "Needs at least one sample and one pass.\n");
+    return 2;
+  }
+  s32 *raw_temp = malloc(n * sizeof(*raw_temp));
+  s32 *raw_press = malloc(n * sizeof(*raw_press));
+  u32 *press = malloc(n * sizeof(*press));
+  if (!raw_temp || !raw_press || !press) {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  struct bmp280_coeffs coeffs;
+  compute_bmp280_coeffs(&bmp280_datasheet_calibration, &coeffs);
+  s32 example_temp = compensate_bmp280_raw_temperature(&coeffs, 519888 << 4);
+  u32 example_press = compensate_bmp280_raw_pressure(
+    &coeffs, BMP280_PRESSURE_COMPENSATION_S64, 519888 << 4, 415148 << 4);
+  printf("datasheet example: %.2f C, %.2f Pa\n", example_temp / 100.0,
+	 example_press / 256.0);
+
+  u64 state = seed;
+  struct bmp280_bench_diff diffs[BMP280_PRESSURE_COMPENSATION_ENGINES];
+  memset(diffs, 0, sizeof(diffs));
+  if (full) {
+    // A new calibration for every chunk of samples.
+    size_t chunk = n / BMP280_BENCH_CALIBRATIONS ?
+      n / BMP280_BENCH_CALIBRATIONS : n;
+    for (size_t start = 0; start < n; start += chunk) {
+      struct bmp280_calibration calib;
+      for (int i = 0; i < 3; i++) {
+	calib.dig_T[i] = (u16)next_bmp280_bench_random(&state);
+      }
+      for (int i = 0; i < 9; i++) {
+	calib.dig_P[i] = (u16)next_bmp280_bench_random(&state);
+      }
+      struct bmp280_coeffs random_coeffs;
+      compute_bmp280_coeffs(&calib, &random_coeffs);
+      size_t count = n - start < chunk ? n - start : chunk;
+      for (size_t i = start; i < start + count; i++) {
+	raw_temp[i] = next_bmp280_bench_raw(&state);
+	raw_press[i] = next_bmp280_bench_raw(&state);
+      }
+      compare_bmp280_bench_engines(&random_coeffs, raw_temp + start,
+				   raw_press + start, count, diffs);
+    }
+  }
+  // Timings always use in range samples, which is what the driver sees.
+  fill_bmp280_bench_samples(&coeffs, &state, raw_temp, raw_press, n);
+  if (!full) {
+    compare_bmp280_bench_engines(&coeffs, raw_temp, raw_press, n, diffs);
+  }
+
+  printf("%zu samples, %s\n", n, full ?
+	 "differences over the whole input space" :
+	 "within the operating range");
+  printf("%-12s %10s %10s %10s %12s\n", "engine", "ns/call", "ns/batch",
+	 "differ", "max diff Pa");
+  for (int engine = 0; engine < BMP280_PRESSURE_COMPENSATION_ENGINES;
+       engine++) {
+    double call_ns = time_bmp280_bench_engine(&coeffs, engine, false, raw_temp,
+					      raw_press, press, n, passes);
+    double batch_ns = time_bmp280_bench_engine(&coeffs, engine, true, raw_temp,
+					       raw_press, press, n, passes);
+    printf("%-12s %10.2f %10.2f %10zu %12.2f\n", bmp280_bench_engines[engine],
+	   call_ns, batch_ns, diffs[engine].count, diffs[engine].max / 256.0);
+  }
+  free(raw_temp);
+  free(raw_press);
+  free(press);
+  return 0;
+}
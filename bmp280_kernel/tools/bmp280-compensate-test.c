@@ -0,0 +1,335 @@
+/**
+ * This file implements `bmp280-compensate-test`, the tests of the driver's
+ * compensation formulas, built from bmp280-compensate.c like the benchmark.
+ * It checks every engine against the datasheet's example, sweeps a grid over
+ * the operating range, and then fuzzes the calibration values and raw
+ * readings, comparing s32 with the s64 reference: it must stay within a few
+ * Pascals of it, within the operating range. It also checks the altitude
+ * against the barometric formula, in floating point. Prints every failed
+ * check, and exits with 1 if there was any.
+ * `make -C tools test` builds it with the undefined behavior sanitizer, so a
+ * signed overflow in the formulas also fails it. Only calibrations within
+ * the datasheet's ranges, see is_bmp280_test_calibration_in_range, must not
+ * overflow. The fuzzed calibrations out of them are only counted, as the
+ * formulas may wrap around with them. See `bmp280-compensate-test -h`.
+ */
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bmp280-compensate.h"
+
+/**
+ * Calibration of the datasheet's example, Section 3.12, and its raw readings,
+ * without the LS 4 padding bits.
+ */
+static const struct bmp280_calibration bmp280_datasheet_calibration = {
+  .dig_T = { 27504, 26435, (u16)-1000 },
+  .dig_P = { 36477, (u16)-10685, 3024, 2855, 140, (u16)-7, 15500,
+	     (u16)-14600, 6000 },
+};
+#define BMP280_TEST_RAW_TEMP 519888
+#define BMP280_TEST_RAW_PRESS 415148
+
+/**
+ * What the example compensates to: 25.08 C, and 100653.25 Pa with the 64 bit
+ * formula, in 1/256 Pa. The 32 bit one only resolves whole Pascals, and gives
+ * 100656 Pa.
+ */
+#define BMP280_TEST_TEMP 2508
+#define BMP280_TEST_PRESS_S64 25767233
+#define BMP280_TEST_PRESS_S32 (100656 << 8)
+
+/**
+ * Raw value ranges swept by test_bmp280_grid, and fuzzed by test_bmp280_fuzz,
+ * without the LS 4 padding bits.
+ * They cover about -40 to 85 degrees Celcius, and 300 to 1100 hPa, for
+ * typical calibration values.
+ */
+#define BMP280_TEST_RAW_TEMP_MIN 0x58000
+#define BMP280_TEST_RAW_TEMP_MAX 0x98000
+#define BMP280_TEST_RAW_PRESS_MIN 0x30000
+#define BMP280_TEST_RAW_PRESS_MAX 0xa0000
+#define BMP280_TEST_GRID_STEPS 16
+
+/**
+ * The most s32 may differ from s64 within the operating range, in 1/256
+ * Pascal. It truncates to whole Pascals partway through, which costs up to
+ * about 7 Pa.
+ */
+#define BMP280_TEST_S32_TOLERANCE (8 << 8)
+
+/**
+ * The most the fixed point altitude may differ from the floating point
+ * formula, in millimeters.
+ */
+#define BMP280_TEST_ALTITUDE_TOLERANCE_MM 5
+
+/**
+ * Number of raw samples compensated with each fuzzed calibration.
+ */
+#define BMP280_TEST_SAMPLES_PER_CALIBRATION 256
+
+static unsigned long bmp280_test_checks;
+static unsigned long bmp280_test_failures;
+static unsigned long bmp280_test_out_of_range;
+
+static void bmp280_test_usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [-n calibrations] [-s seed]\n"
+	  "  -n  fuzzed calibrations, default 4096\n"
+	  "  -s  random seed, default 1\n",
+	  name);
+}
+
+/**
+ * Counts a check, and prints it if it failed, so a run shows all failures.
+ */
+static bool check_bmp280_test(bool ok, const char *format, ...) {
+  bmp280_test_checks++;
+  if (!ok) {
+    bmp280_test_failures++;
+    va_list args;
+    va_start(args, format);
+    printf("FAIL: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+  }
+  return ok;
+}
+
+/**
+ * splitmix64, so runs with the same seed fuzz the same values everywhere.
+ */
+static u64 next_bmp280_test_random(u64 *state) {
+  u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * A raw 20 bit reading from min to max, with its 4 LS padding bits, as the
+ * driver reads it.
+ */
+static s32 next_bmp280_test_raw(u64 *state, s32 min, s32 max) {
+  return (min + (s32)(next_bmp280_test_random(state) % (max - min + 1))) << 4;
+}
+
+/**
+ * Whether a compensated sample is within the sensor's operating range, -40
+ * to 85 C and 300 to 1100 hPa.
+ */
+static bool is_bmp280_test_in_range(s32 temp, u32 press) {
+  return temp >= -4000 && temp <= 8500 && press / 256 >= 30000 &&
+    press / 256 <= 110000;
+}
+
+/**
+ * Compensates one raw sample with both engines, and checks s32 against the
+ * reference one. s32 is only held to BMP280_TEST_S32_TOLERANCE within the
+ * operating range, where the datasheet vouches for it.
+ */
+static void check_bmp280_test_engines(const struct bmp280_coeffs *coeffs,
+				      s32 raw_temp, s32 raw_press) {
+  u32 reference = compensate_bmp280_raw_pressure(
+    coeffs, BMP280_PRESSURE_COMPENSATION_S64, raw_temp, raw_press);
+  s32 temp = compensate_bmp280_raw_temperature(coeffs, raw_temp);
+  if (!is_bmp280_test_in_range(temp, reference)) {
+    return;
+  }
+  u32 s32_press = compensate_bmp280_raw_pressure(
+    coeffs, BMP280_PRESSURE_COMPENSATION_S32, raw_temp, raw_press);
+  u32 diff = s32_press > reference ?
+    s32_press - reference : reference - s32_press;
+  check_bmp280_test(diff <= BMP280_TEST_S32_TOLERANCE,
+		    "s32 gives %u/256 Pa for 0x%x 0x%x, s64 %u/256 Pa",
+		    s32_press, raw_temp, raw_press, reference);
+}
+
+/**
+ * Every engine on the datasheet's example, one sample at a time and in a
+ * batch.
+ */
+static void test_bmp280_datasheet_example(void) {
+  static const u32 expected[] = {
+    [BMP280_PRESSURE_COMPENSATION_S64] = BMP280_TEST_PRESS_S64,
+    [BMP280_PRESSURE_COMPENSATION_S32] = BMP280_TEST_PRESS_S32,
+  };
+  struct bmp280_coeffs coeffs;
+  compute_bmp280_coeffs(&bmp280_datasheet_calibration, &coeffs);
+  s32 raw_temp = BMP280_TEST_RAW_TEMP << 4;
+  s32 raw_press = BMP280_TEST_RAW_PRESS << 4;
+  s32 temp = compensate_bmp280_raw_temperature(&coeffs, raw_temp);
+  check_bmp280_test(temp == BMP280_TEST_TEMP,
+		    "datasheet example gives %d/100 C, not %d/100 C", temp,
+		    BMP280_TEST_TEMP);
+  for (int engine = 0; engine < BMP280_PRESSURE_COMPENSATION_ENGINES;
+       engine++) {
+    u32 press = compensate_bmp280_raw_pressure(&coeffs, engine, raw_temp,
+					       raw_press);
+    check_bmp280_test(press == expected[engine],
+		      "datasheet example gives %u/256 Pa with engine %d, not "
+		      "%u/256 Pa", press, engine, expected[engine]);
+    s32 batch_temp;
+    u32 batch_press;
+    compensate_bmp280_batch(&coeffs, engine, &raw_temp, &raw_press,
+			    &batch_temp, &batch_press, 1);
+    check_bmp280_test(batch_temp == temp && batch_press == press,
+		      "datasheet example batch gives %d/100 C and %u/256 Pa "
+		      "with engine %d", batch_temp, batch_press, engine);
+  }
+}
+
+/**
+ * A grid of raw samples over the operating range, with the datasheet's
+ * calibration.
+ */
+static void test_bmp280_grid(void) {
+  struct bmp280_coeffs coeffs;
+  compute_bmp280_coeffs(&bmp280_datasheet_calibration, &coeffs);
+  for (int t = 0; t < BMP280_TEST_GRID_STEPS; t++) {
+    for (int p = 0; p < BMP280_TEST_GRID_STEPS; p++) {
+      s32 raw_temp = BMP280_TEST_RAW_TEMP_MIN +
+	(BMP280_TEST_RAW_TEMP_MAX - BMP280_TEST_RAW_TEMP_MIN) * t /
+	(BMP280_TEST_GRID_STEPS - 1);
+      s32 raw_press = BMP280_TEST_RAW_PRESS_MIN +
+	(BMP280_TEST_RAW_PRESS_MAX - BMP280_TEST_RAW_PRESS_MIN) * p /
+	(BMP280_TEST_GRID_STEPS - 1);
+      check_bmp280_test_engines(&coeffs, raw_temp << 4, raw_press << 4);
+    }
+  }
+}
+
+/**
+ * The most a calibration word within the datasheet's ranges differs from the
+ * example's, as a fraction of it. The datasheet does not give ranges for the
+ * calibration words, only their types, but real sensors' calibrations stay
+ * well within 1/8 of its example.
+ */
+#define BMP280_TEST_CALIBRATION_SPREAD 8
+
+/**
+ * Whether every calibration word is within the datasheet's ranges, i.e.
+ * within 1/BMP280_TEST_CALIBRATION_SPREAD of the example's. The formulas
+ * must not overflow with those, within the operating range.
+ */
+static bool
+is_bmp280_test_calibration_in_range(const struct bmp280_calibration *calib) {
+  const struct bmp280_calibration *base = &bmp280_datasheet_calibration;
+  for (int i = 0; i < 12; i++) {
+    const u16 *words = i < 3 ? calib->dig_T : calib->dig_P;
+    const u16 *base_words = i < 3 ? base->dig_T : base->dig_P;
+    int index = i < 3 ? i : i - 3;
+    s32 value = bmp280_calibration_value(words, index);
+    s32 base_value = bmp280_calibration_value(base_words, index);
+    if (abs(value - base_value) >
+	abs(base_value) / BMP280_TEST_CALIBRATION_SPREAD) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * A calibration word within the datasheet's ranges.
+ */
+static u16 fuzz_bmp280_test_word(u64 *state, const u16 *words, int index) {
+  s32 value = bmp280_calibration_value(words, index);
+  s32 spread = abs(value) / BMP280_TEST_CALIBRATION_SPREAD;
+  s32 offset = (s32)(next_bmp280_test_random(state) % (2 * spread + 1)) -
+    spread;
+  return (u16)(value + offset);
+}
+
+/**
+ * Random calibrations, and raw readings over the operating range. Half the
+ * calibrations are typical ones, within the datasheet's ranges, and the
+ * other half are random words, which almost never are. Those out of range
+ * are only counted: the formulas may overflow with them, which is harmless
+ * in the kernel, where signed integers wrap around, but would stop the
+ * sanitized tests.
+ */
+static void test_bmp280_fuzz(u64 *state, unsigned long calibrations) {
+  for (unsigned long c = 0; c < calibrations; c++) {
+    const struct bmp280_calibration *base = &bmp280_datasheet_calibration;
+    bool typical = c % 2 == 0;
+    struct bmp280_calibration calib;
+    for (int i = 0; i < 3; i++) {
+      calib.dig_T[i] = typical ? fuzz_bmp280_test_word(state, base->dig_T, i) :
+	(u16)next_bmp280_test_random(state);
+    }
+    for (int i = 0; i < 9; i++) {
+      calib.dig_P[i] = typical ? fuzz_bmp280_test_word(state, base->dig_P, i) :
+	(u16)next_bmp280_test_random(state);
+    }
+    if (!is_bmp280_test_calibration_in_range(&calib)) {
+      bmp280_test_out_of_range++;
+      continue;
+    }
+    struct bmp280_coeffs coeffs;
+    compute_bmp280_coeffs(&calib, &coeffs);
+    for (int i = 0; i < BMP280_TEST_SAMPLES_PER_CALIBRATION; i++) {
+      s32 raw_temp = next_bmp280_test_raw(state, BMP280_TEST_RAW_TEMP_MIN,
+					  BMP280_TEST_RAW_TEMP_MAX);
+      s32 raw_press = next_bmp280_test_raw(state, BMP280_TEST_RAW_PRESS_MIN,
+					   BMP280_TEST_RAW_PRESS_MAX);
+      check_bmp280_test_engines(&coeffs, raw_temp, raw_press);
+    }
+  }
+}
+
+/**
+ * The altitude against the barometric formula, over the operating range and
+ * the sea level pressures the driver accepts, and pressures of 0.
+ */
+static void test_bmp280_altitude(void) {
+  check_bmp280_test(compute_bmp280_altitude(0, 101325) ==
+		    BMP280_ALTITUDE_UNDEFINED, "altitude of 0 Pa is defined");
+  check_bmp280_test(compute_bmp280_altitude(101325 << 8, 0) ==
+		    BMP280_ALTITUDE_UNDEFINED,
+		    "altitude against 0 Pa is defined");
+  for (u32 press = 30000 << 8; press <= 110000 << 8; press += 997) {
+    for (u32 reference = 30000; reference <= 110000; reference += 7919) {
+      double expected =
+	44330000.0 * (1 - pow(press / 256.0 / reference, 1 / 5.255));
+      s32 altitude = compute_bmp280_altitude(press, reference);
+      check_bmp280_test(fabs(altitude - expected) <=
+			BMP280_TEST_ALTITUDE_TOLERANCE_MM,
+			"altitude of %u/256 Pa against %u Pa is %d mm, not "
+			"%.0f mm", press, reference, altitude, expected);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned long calibrations = 4096;
+  u64 seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+    if (opt == 'n') {
+      calibrations = strtoul(optarg, NULL, 10);
+    } else if (opt == 's') {
+      seed = strtoull(optarg, NULL, 10);
+    } else {
+      bmp280_test_usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  u64 state = seed;
+  test_bmp280_datasheet_example();
+  test_bmp280_grid();
+  test_bmp280_fuzz(&state, calibrations);
+  test_bmp280_altitude();
+  printf("%lu checks, %lu failed\n", bmp280_test_checks,
+	 bmp280_test_failures);
+  printf("%lu fuzzed calibrations out of the datasheet's ranges, allowed to "
+	 "wrap around, not checked\n", bmp280_test_out_of_range);
+  return bmp280_test_failures ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * This file implements `bmp280-read`, a command line tool that captures
+ * samples from a BMP280 IIO device, and prints them as CSV: timestamp in
+ * nanoseconds, temperature in degrees Celcius, pressure in Pascal, and
+ * altitude in meters. See `bmp280-read -h`.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmp280-reader.h"
+
+/**
+ * Set by SIGINT and SIGTERM, to stop the capture cleanly.
+ */
+static volatile sig_atomic_t bmp280_read_stopping;
+
+static void bmp280_read_stop(int signal) {
+  (void)signal;
+  bmp280_read_stopping = 1;
+}
+
+static void bmp280_read_usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [-d device] [-r] [-k] [-n samples] [-b batch] "
+	  "[-l length]\n"
+	  "  -d  IIO device, default iio:device0\n"
+	  "  -r  capture raw values, and compensate them here\n"
+	  "  -k  keep the buffer configuration, and just read\n"
+	  "  -n  stop after this many samples, default 0 for no limit\n"
+	  "  -b  samples per read, and buffer watermark, default 64\n"
+	  "  -l  buffer length, in samples, default 1024\n",
+	  name);
+}
+
+/**
+ * Prints one value, or nothing for NAN, so gaps show up as empty fields.
+ */
+static void bmp280_read_print(double value, int precision) {
+  if (!isnan(value)) {
+    printf("%.*f", precision, value);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *device = "iio:device0";
+  enum bmp280_capture capture = BMP280_CAPTURE_PROCESSED;
+  bool keep = false;
+  unsigned long limit = 0;
+  unsigned int batch = 64;
+  unsigned int length = 1024;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:rkn:b:l:h")) != -1) {
+    if (opt == 'd') {
+      device = optarg;
+    } else if (opt == 'r') {
+      capture = BMP280_CAPTURE_RAW;
+    } else if (opt == 'k') {
+      keep = true;
+    } else if (opt == 'n') {
+      limit = strtoul(optarg, NULL, 10);
+    } else if (opt == 'b') {
+      batch = strtoul(optarg, NULL, 10);
+    } else if (opt == 'l') {
+      length = strtoul(optarg, NULL, 10);
+    } else {
+      bmp280_read_usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!batch || length < batch) {
+    fprintf(stderr, "The batch must fit in the buffer.\n");
+    return 2;
+  }
+  // No SA_RESTART, so a signal interrupts the blocking read.
+  struct sigaction action = { .sa_handler = bmp280_read_stop };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  int status = keep ? 0 : start_bmp280_capture(device, capture, length, batch);
+  if (status) {
+    fprintf(stderr, "Failed to start the capture: %s\n", strerror(-status));
+    return 1;
+  }
+  struct bmp280_reader reader;
+  status = open_bmp280_reader(&reader, device, batch);
+  if (status) {
+    fprintf(stderr, "Failed to open %s: %s\n", device, strerror(-status));
+  }
+  unsigned long count = 0;
+  if (!status) {
+    printf("timestamp,temperature,pressure,altitude\n");
+  }
+  while (!status && !bmp280_read_stopping && (!limit || count < limit)) {
+    ssize_t n = read_bmp280_samples(&reader);
+    if (n == -EINTR || n == -EAGAIN) {
+      continue;
+    } else if (n < 0) {
+      fprintf(stderr, "Failed to read samples: %s\n", strerror(-n));
+      status = n;
+      break;
+    }
+    const struct bmp280_samples *samples = &reader.samples;
+    for (size_t i = 0; i < samples->count && (!limit || count < limit);
+	 i++, count++) {
+      printf("%" PRId64 ",", samples->timestamp[i]);
+      bmp280_read_print(samples->temp[i], 2);
+      putchar(',');
+      bmp280_read_print(samples->press[i], 3);
+      putchar(',');
+      bmp280_read_print(samples->altitude[i], 3);
+      putchar('\n');
+    }
+  }
+  fflush(stdout);
+  // Also fine after a failed open, which leaves nothing to free.
+  close_bmp280_reader(&reader);
+  if (!keep) {
+    stop_bmp280_capture(device);
+  }
+  return status ? 1 : 0;
+}
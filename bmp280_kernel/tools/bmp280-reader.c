@@ -0,0 +1,500 @@
+/**
+ * This file implements the userspace reader for BMP280 IIO buffer captures,
+ * see bmp280-reader.h.
+ * Each batch is decoded one value at a time, in its own loop over the scans,
+ * with the layout already resolved. The loops have no calls and a fixed
+ * stride, so the compiler can unroll and vectorize them, which keeps
+ * decoding far below the cost of reading the chardev.
+ * The driver's buffers are kfifos, which have no mmap or DMABUF interface,
+ * so data comes through read(), as many scans per call as fit in the batch.
+ */
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmp280-reader.h"
+
+/**
+ * Where the IIO devices are in sysfs.
+ */
+#define BMP280_SYSFS_DEVICES "/sys/bus/iio/devices"
+
+/**
+ * Raw value of skipped measurements and of scans the driver failed to read,
+ * and the gap values of the processed channels, see src/bmp280.h.
+ */
+#define BMP280_RAW_SKIPPED 0x800000
+#define BMP280_GAP_TEMP INT32_MIN
+#define BMP280_GAP_PRESS 0
+#define BMP280_GAP_ALTITUDE INT32_MIN
+
+/**
+ * Sea level pressure used when the device does not have the altitude
+ * channel's calibbias, in Pascal, and the range the driver accepts for it,
+ * see src/bmp280.h.
+ */
+#define BMP280_SEA_LEVEL_PRESSURE_DEFAULT 101325
+#define BMP280_SEA_LEVEL_PRESSURE_MIN 30000
+#define BMP280_SEA_LEVEL_PRESSURE_MAX 110000
+
+/**
+ * Scan element names, within `scan_elements`, by enum bmp280_element.
+ */
+static const char * const bmp280_element_names[BMP280_ELEMENTS] = {
+  [BMP280_ELEMENT_RAW_TEMP] = "in_temp3",
+  [BMP280_ELEMENT_TEMP] = "in_temp",
+  [BMP280_ELEMENT_RAW_PRESS] = "in_pressure9",
+  [BMP280_ELEMENT_PRESS] = "in_pressure",
+  [BMP280_ELEMENT_ALTITUDE] = "in_distance",
+  [BMP280_ELEMENT_TIMESTAMP] = "in_timestamp",
+};
+
+/**
+ * Reads a sysfs file of device into buf, as a NUL terminated string.
+ * Returns how many bytes were read, or a negative errno.
+ */
+static ssize_t read_bmp280_sysfs(const char *device, const char *file,
+				 char *buf, size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), BMP280_SYSFS_DEVICES "/%s/%s", device, file);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  ssize_t n = read(fd, buf, size - 1);
+  int status = -errno;
+  close(fd);
+  if (n < 0) {
+    return status;
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+/**
+ * Writes value to a sysfs file of device. Returns 0, or a negative errno.
+ */
+static int write_bmp280_sysfs(const char *device, const char *file,
+			      const char *value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), BMP280_SYSFS_DEVICES "/%s/%s", device, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  ssize_t n = write(fd, value, strlen(value));
+  int status = n < 0 ? -errno : 0;
+  close(fd);
+  return status;
+}
+
+/**
+ * Writes an unsigned integer to a sysfs file of device.
+ */
+static int write_bmp280_sysfs_uint(const char *device, const char *file,
+				   unsigned int value) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u", value);
+  return write_bmp280_sysfs(device, file, buf);
+}
+
+/**
+ * Enables or disables a scan element of device.
+ */
+static int enable_bmp280_element(const char *device,
+				 enum bmp280_element element, bool enable) {
+  char file[64];
+  snprintf(file, sizeof(file), "scan_elements/%s_en",
+	   bmp280_element_names[element]);
+  return write_bmp280_sysfs(device, file, enable ? "1" : "0");
+}
+
+int start_bmp280_capture(const char *device, enum bmp280_capture capture,
+			 unsigned int length, unsigned int watermark) {
+  // The layout and buffer settings cannot change while the buffer runs.
+  int status = stop_bmp280_capture(device);
+  if (status) {
+    return status;
+  }
+  for (int i = 0; i < BMP280_ELEMENTS; i++) {
+    bool enable = i == BMP280_ELEMENT_TIMESTAMP ||
+      capture == BMP280_CAPTURE_ALL ||
+      (capture == BMP280_CAPTURE_RAW ?
+       i == BMP280_ELEMENT_RAW_TEMP || i == BMP280_ELEMENT_RAW_PRESS :
+       i == BMP280_ELEMENT_TEMP || i == BMP280_ELEMENT_PRESS);
+    status = enable_bmp280_element(device, i, enable);
+    // Older drivers do not have every element, which is fine if unused, or
+    // when capturing all of them.
+    if (status && (status != -ENOENT ||
+		   (enable && capture != BMP280_CAPTURE_ALL))) {
+      return status;
+    }
+  }
+  status = write_bmp280_sysfs_uint(device, "buffer/length", length);
+  if (!status) {
+    status = write_bmp280_sysfs_uint(device, "buffer/watermark", watermark);
+  }
+  if (!status) {
+    status = write_bmp280_sysfs(device, "buffer/enable", "1");
+  }
+  return status;
+}
+
+int stop_bmp280_capture(const char *device) {
+  return write_bmp280_sysfs(device, "buffer/enable", "0");
+}
+
+/**
+ * Reads the sea level pressure of device's altitude channel, in Pascal. Falls
+ * back to the default one if the device does not have it, or if it is not a
+ * pressure the driver would accept, so altitudes are never computed against
+ * 0 or garbage.
+ */
+static u32 read_bmp280_sea_level_pressure(const char *device) {
+  char buf[32];
+  if (read_bmp280_sysfs(device, "in_distance_calibbias", buf,
+			sizeof(buf)) <= 0) {
+    return BMP280_SEA_LEVEL_PRESSURE_DEFAULT;
+  }
+  char *end;
+  errno = 0;
+  unsigned long pressure = strtoul(buf, &end, 10);
+  if (errno || end == buf || (*end && *end != '\n') ||
+      pressure < BMP280_SEA_LEVEL_PRESSURE_MIN ||
+      pressure > BMP280_SEA_LEVEL_PRESSURE_MAX) {
+    return BMP280_SEA_LEVEL_PRESSURE_DEFAULT;
+  }
+  return pressure;
+}
+
+/**
+ * Reads the layout of a scan element from its `_en`, `_index` and `_type`
+ * files, e.g. `le:s32/32>>0`. Elements the device does not have are left
+ * disabled.
+ */
+static int read_bmp280_element_layout(const char *device,
+				      enum bmp280_element element,
+				      struct bmp280_element_layout *layout) {
+  const char *name = bmp280_element_names[element];
+  char file[64];
+  char buf[64];
+  memset(layout, 0, sizeof(*layout));
+  snprintf(file, sizeof(file), "scan_elements/%s_en", name);
+  ssize_t n = read_bmp280_sysfs(device, file, buf, sizeof(buf));
+  if (n == -ENOENT) {
+    return 0;
+  } else if (n < 0) {
+    return n;
+  }
+  layout->enabled = atoi(buf) != 0;
+  if (!layout->enabled) {
+    return 0;
+  }
+  snprintf(file, sizeof(file), "scan_elements/%s_index", name);
+  n = read_bmp280_sysfs(device, file, buf, sizeof(buf));
+  if (n < 0) {
+    return n;
+  }
+  layout->index = strtoul(buf, NULL, 10);
+  snprintf(file, sizeof(file), "scan_elements/%s_type", name);
+  n = read_bmp280_sysfs(device, file, buf, sizeof(buf));
+  if (n < 0) {
+    return n;
+  }
+  char endianness[3];
+  char sign;
+  if (sscanf(buf, "%2[bl]e:%c%u/%u", endianness, &sign, &layout->realbits,
+	     &layout->storagebits) != 4) {
+    return -EINVAL;
+  }
+  const char *shift = strstr(buf, ">>");
+  layout->shift = shift ? strtoul(shift + 2, NULL, 10) : 0;
+  layout->big_endian = endianness[0] == 'b';
+  layout->is_signed = sign == 's';
+  if (layout->storagebits != 16 && layout->storagebits != 32 &&
+      layout->storagebits != 64) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Computes each enabled element's offset, and the size of each scan, the way
+ * the IIO core lays them out: elements in scan index order, each aligned to
+ * its own size, and the scan padded to a multiple of the largest one.
+ */
+static void compute_bmp280_scan_layout(struct bmp280_reader *reader) {
+  size_t offset = 0;
+  size_t largest = 1;
+  unsigned int last_index = 0;
+  for (int i = 0; i < BMP280_ELEMENTS; i++) {
+    if (reader->elements[i].enabled && reader->elements[i].index > last_index) {
+      last_index = reader->elements[i].index;
+    }
+  }
+  for (unsigned int index = 0; index <= last_index; index++) {
+    for (int i = 0; i < BMP280_ELEMENTS; i++) {
+      struct bmp280_element_layout *layout = &reader->elements[i];
+      if (!layout->enabled || layout->index != index) {
+	continue;
+      }
+      size_t bytes = layout->storagebits / 8;
+      offset = (offset + bytes - 1) / bytes * bytes;
+      layout->offset = offset;
+      offset += bytes;
+      largest = bytes > largest ? bytes : largest;
+    }
+  }
+  reader->scan_bytes = (offset + largest - 1) / largest * largest;
+}
+
+/**
+ * Reads the sensor's calibration values, and derives the compensation
+ * constants from them.
+ */
+static int read_bmp280_coeffs(const char *device, struct bmp280_coeffs *coeffs) {
+  uint8_t words[24];
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), BMP280_SYSFS_DEVICES "/%s/calibration", device);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  ssize_t n = read(fd, words, sizeof(words));
+  int status = n < 0 ? -errno : n == sizeof(words) ? 0 : -EIO;
+  close(fd);
+  if (status) {
+    return status;
+  }
+  // dig_T1 to dig_T3, then dig_P1 to dig_P9, each 16 bits little endian.
+  struct bmp280_calibration calibration;
+  for (int i = 0; i < 3; i++) {
+    calibration.dig_T[i] = words[2 * i] | words[2 * i + 1] << 8;
+  }
+  for (int i = 0; i < 9; i++) {
+    calibration.dig_P[i] = words[6 + 2 * i] | words[6 + 2 * i + 1] << 8;
+  }
+  compute_bmp280_coeffs(&calibration, coeffs);
+  return 0;
+}
+
+int open_bmp280_reader(struct bmp280_reader *reader, const char *device,
+		       size_t batch) {
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
+  reader->batch = batch ? batch : 1;
+  char buf[32];
+  ssize_t found = read_bmp280_sysfs(device, "name", buf, sizeof(buf));
+  if (found < 0) {
+    return found;
+  }
+  int status = 0;
+  for (int i = 0; i < BMP280_ELEMENTS && !status; i++) {
+    status = read_bmp280_element_layout(device, i, &reader->elements[i]);
+  }
+  if (status) {
+    return status;
+  }
+  compute_bmp280_scan_layout(reader);
+  if (!reader->scan_bytes) {
+    // Nothing enabled, nothing to read.
+    return -EINVAL;
+  }
+  const struct bmp280_element_layout *elements = reader->elements;
+  reader->compensate = elements[BMP280_ELEMENT_RAW_TEMP].enabled &&
+    (!elements[BMP280_ELEMENT_TEMP].enabled ||
+     (elements[BMP280_ELEMENT_RAW_PRESS].enabled &&
+      !elements[BMP280_ELEMENT_PRESS].enabled));
+  if (reader->compensate) {
+    status = read_bmp280_coeffs(device, &reader->coeffs);
+    if (status) {
+      return status;
+    }
+  }
+  reader->sea_level_pressure = read_bmp280_sea_level_pressure(device);
+  size_t n = reader->batch;
+  reader->buffer = malloc(n * reader->scan_bytes);
+  reader->raw_temp = malloc(n * sizeof(*reader->raw_temp));
+  reader->raw_press = malloc(n * sizeof(*reader->raw_press));
+  reader->comp_temp = malloc(n * sizeof(*reader->comp_temp));
+  reader->comp_press = malloc(n * sizeof(*reader->comp_press));
+  reader->samples.timestamp = malloc(n * sizeof(*reader->samples.timestamp));
+  reader->samples.temp = malloc(n * sizeof(*reader->samples.temp));
+  reader->samples.press = malloc(n * sizeof(*reader->samples.press));
+  reader->samples.altitude = malloc(n * sizeof(*reader->samples.altitude));
+  if (!reader->buffer || !reader->raw_temp || !reader->raw_press ||
+      !reader->comp_temp || !reader->comp_press ||
+      !reader->samples.timestamp || !reader->samples.temp ||
+      !reader->samples.press || !reader->samples.altitude) {
+    close_bmp280_reader(reader);
+    return -ENOMEM;
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/dev/%s", device);
+  reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (reader->fd < 0) {
+    status = -errno;
+    close_bmp280_reader(reader);
+    return status;
+  }
+  return 0;
+}
+
+/**
+ * Loads a storagebits wide element, in host byte order, without any shift or
+ * mask applied.
+ */
+static inline uint64_t load_bmp280_element(const uint8_t *data,
+					   const struct bmp280_element_layout *layout) {
+  if (layout->storagebits == 16) {
+    uint16_t v;
+    memcpy(&v, data, sizeof(v));
+    return layout->big_endian ? be16toh(v) : le16toh(v);
+  } else if (layout->storagebits == 32) {
+    uint32_t v;
+    memcpy(&v, data, sizeof(v));
+    return layout->big_endian ? be32toh(v) : le32toh(v);
+  }
+  uint64_t v;
+  memcpy(&v, data, sizeof(v));
+  return layout->big_endian ? be64toh(v) : le64toh(v);
+}
+
+/**
+ * Loads one 32 bit element of each of n scans, as stored, into values.
+ */
+static void load_bmp280_element_u32(const uint8_t *data, size_t stride,
+				    const struct bmp280_element_layout *layout,
+				    u32 *values, size_t n) {
+  data += layout->offset;
+  if (layout->storagebits == 32 && !layout->big_endian) {
+    // The common case, kept apart so it compiles to plain strided loads.
+    for (size_t i = 0; i < n; i++) {
+      uint32_t v;
+      memcpy(&v, data + i * stride, sizeof(v));
+      values[i] = le32toh(v);
+    }
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    values[i] = load_bmp280_element(data + i * stride, layout);
+  }
+}
+
+void decode_bmp280_scans(struct bmp280_reader *reader, const uint8_t *data,
+			 size_t n) {
+  const struct bmp280_element_layout *elements = reader->elements;
+  const size_t stride = reader->scan_bytes;
+  struct bmp280_samples *samples = &reader->samples;
+  samples->count = n;
+  // Scratch arrays for the stored values, reused for each element.
+  s32 *temp = reader->comp_temp;
+  u32 *press = reader->comp_press;
+  if (elements[BMP280_ELEMENT_TIMESTAMP].enabled) {
+    const struct bmp280_element_layout *layout =
+      &elements[BMP280_ELEMENT_TIMESTAMP];
+    for (size_t i = 0; i < n; i++) {
+      samples->timestamp[i] =
+	(int64_t)load_bmp280_element(data + i * stride + layout->offset, layout);
+    }
+  } else {
+    memset(samples->timestamp, 0, n * sizeof(*samples->timestamp));
+  }
+  if (reader->compensate) {
+    load_bmp280_element_u32(data, stride, &elements[BMP280_ELEMENT_RAW_TEMP],
+			    (u32 *)reader->raw_temp, n);
+    bool with_press = elements[BMP280_ELEMENT_RAW_PRESS].enabled;
+    if (with_press) {
+      load_bmp280_element_u32(data, stride, &elements[BMP280_ELEMENT_RAW_PRESS],
+			      (u32 *)reader->raw_press, n);
+    }
+    // Same engine as the driver's reference, 64 bit math is cheap here.
+    compensate_bmp280_batch(&reader->coeffs, BMP280_PRESSURE_COMPENSATION_S64,
+			    reader->raw_temp, reader->raw_press, temp,
+			    with_press ? press : NULL, n);
+    // Gaps come through as skipped raw values.
+    for (size_t i = 0; i < n; i++) {
+      bool gap = reader->raw_temp[i] == BMP280_RAW_SKIPPED;
+      temp[i] = gap ? BMP280_GAP_TEMP : temp[i];
+    }
+    for (size_t i = 0; with_press && i < n; i++) {
+      bool gap = reader->raw_temp[i] == BMP280_RAW_SKIPPED ||
+	reader->raw_press[i] == BMP280_RAW_SKIPPED;
+      press[i] = gap ? BMP280_GAP_PRESS : press[i];
+    }
+    if (!with_press) {
+      memset(press, 0, n * sizeof(*press));
+    }
+  }
+  if (elements[BMP280_ELEMENT_TEMP].enabled) {
+    load_bmp280_element_u32(data, stride, &elements[BMP280_ELEMENT_TEMP],
+			    (u32 *)temp, n);
+  }
+  if (elements[BMP280_ELEMENT_PRESS].enabled) {
+    load_bmp280_element_u32(data, stride, &elements[BMP280_ELEMENT_PRESS],
+			    press, n);
+  }
+  bool have_temp = elements[BMP280_ELEMENT_TEMP].enabled || reader->compensate;
+  bool have_press = elements[BMP280_ELEMENT_PRESS].enabled ||
+    (reader->compensate && elements[BMP280_ELEMENT_RAW_PRESS].enabled);
+  for (size_t i = 0; i < n; i++) {
+    samples->temp[i] = !have_temp || temp[i] == BMP280_GAP_TEMP ?
+      NAN : temp[i] / 100.0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    samples->press[i] = !have_press || press[i] == BMP280_GAP_PRESS ?
+      NAN : press[i] / 256.0;
+  }
+  if (elements[BMP280_ELEMENT_ALTITUDE].enabled) {
+    s32 *altitude = reader->raw_press;
+    load_bmp280_element_u32(data, stride, &elements[BMP280_ELEMENT_ALTITUDE],
+			    (u32 *)altitude, n);
+    for (size_t i = 0; i < n; i++) {
+      samples->altitude[i] = altitude[i] == BMP280_GAP_ALTITUDE ?
+	NAN : altitude[i] / 1000.0;
+    }
+  } else {
+    // Same fixed point formula as the driver's altitude channel.
+    for (size_t i = 0; i < n; i++) {
+      samples->altitude[i] = !have_press || press[i] == BMP280_GAP_PRESS ?
+	NAN :
+	compute_bmp280_altitude(press[i], reader->sea_level_pressure) / 1000.0;
+    }
+  }
+}
+
+ssize_t read_bmp280_samples(struct bmp280_reader *reader) {
+  ssize_t n = read(reader->fd, reader->buffer,
+		   reader->batch * reader->scan_bytes);
+  if (n < 0) {
+    return -errno;
+  }
+  size_t scans = n / reader->scan_bytes;
+  decode_bmp280_scans(reader, reader->buffer, scans);
+  return scans;
+}
+
+void close_bmp280_reader(struct bmp280_reader *reader) {
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  free(reader->buffer);
+  free(reader->raw_temp);
+  free(reader->raw_press);
+  free(reader->comp_temp);
+  free(reader->comp_press);
+  free(reader->samples.timestamp);
+  free(reader->samples.temp);
+  free(reader->samples.press);
+  free(reader->samples.altitude);
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
+}
@@ -0,0 +1,151 @@
+#ifndef BMP280_READER_H_
+#define BMP280_READER_H_
+
+/**
+ * Userspace reader for BMP280 IIO buffer captures.
+ * It parses the scan layout from `scan_elements` once, reads the device's
+ * chardev many scans at a time, and decodes each batch into one array per
+ * value, already scaled to degrees Celcius, Pascal and meters. Captures of
+ * the raw values only are compensated here, with the sensor's `calibration`
+ * file and the driver's own bmp280-compensate.c.
+ * Typical use:
+ *
+ *   struct bmp280_reader reader;
+ *   start_bmp280_capture("iio:device0", BMP280_CAPTURE_RAW, 4096, 256);
+ *   open_bmp280_reader(&reader, "iio:device0", 256);
+ *   for (;;) {
+ *     ssize_t n = read_bmp280_samples(&reader);
+ *     // Use reader.samples.temp[0..n), reader.samples.press[0..n), ...
+ *   }
+ *   close_bmp280_reader(&reader);
+ *   stop_bmp280_capture("iio:device0");
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bmp280-compensate.h"
+
+/**
+ * Scan elements the driver can capture, in scan index order.
+ */
+enum bmp280_element {
+  BMP280_ELEMENT_RAW_TEMP,
+  BMP280_ELEMENT_TEMP,
+  BMP280_ELEMENT_RAW_PRESS,
+  BMP280_ELEMENT_PRESS,
+  BMP280_ELEMENT_ALTITUDE,
+  BMP280_ELEMENT_TIMESTAMP,
+  BMP280_ELEMENTS,
+};
+
+/**
+ * Layout of one scan element, as read from its `_type` file in
+ * `scan_elements`, and its offset within each scan.
+ */
+struct bmp280_element_layout {
+  bool enabled;
+  bool is_signed;
+  bool big_endian;
+  unsigned int index;
+  unsigned int realbits;
+  unsigned int storagebits;
+  unsigned int shift;
+  size_t offset;
+};
+
+/**
+ * Values decoded from one batch of scans, one array per value, count of
+ * them. Values the capture does not carry, and gaps, are NAN, and
+ * timestamps 0.
+ */
+struct bmp280_samples {
+  size_t count;
+  int64_t *timestamp;
+  double *temp;
+  double *press;
+  double *altitude;
+};
+
+/**
+ * Reader state. buffer holds up to batch scans of scan_bytes each. raw_temp
+ * to comp_press are scratch arrays for compensating raw captures in batches,
+ * and comp_press holds the pressures of the batch, in 1/256 Pascal, either
+ * way. sea_level_pressure, in Pascal, is used to compute the altitude from
+ * the pressure, when the capture does not carry it.
+ */
+struct bmp280_reader {
+  int fd;
+  size_t batch;
+  size_t scan_bytes;
+  struct bmp280_element_layout elements[BMP280_ELEMENTS];
+  bool compensate;
+  struct bmp280_coeffs coeffs;
+  u32 sea_level_pressure;
+  uint8_t *buffer;
+  s32 *raw_temp;
+  s32 *raw_press;
+  s32 *comp_temp;
+  u32 *comp_press;
+  struct bmp280_samples samples;
+};
+
+/**
+ * Channels start_bmp280_capture enables: the processed temperature and
+ * pressure, the raw values only, which makes the smallest scans and spares
+ * the driver the compensation, or every element the device has. All of them
+ * come with the timestamp.
+ */
+enum bmp280_capture {
+  BMP280_CAPTURE_PROCESSED,
+  BMP280_CAPTURE_RAW,
+  BMP280_CAPTURE_ALL,
+};
+
+/**
+ * Configures and enables the buffer of device, e.g. "iio:device0", with room
+ * for length scans. Readers are woken up once watermark scans are ready,
+ * which the driver also uses as its batch size. Returns 0, or a negative
+ * errno.
+ */
+int start_bmp280_capture(const char *device, enum bmp280_capture capture,
+			 unsigned int length, unsigned int watermark);
+
+/**
+ * Disables the buffer of device. Returns 0, or a negative errno.
+ */
+int stop_bmp280_capture(const char *device);
+
+/**
+ * Opens the chardev of device, e.g. "iio:device0", and parses its scan
+ * layout, for reading up to batch scans at a time. The buffer must already
+ * be configured, since the layout is only read once. Returns 0, or a
+ * negative errno.
+ */
+int open_bmp280_reader(struct bmp280_reader *reader, const char *device,
+		       size_t batch);
+
+/**
+ * Reads the next batch of scans, waiting for at least one, and decodes them
+ * into reader->samples. Returns how many samples were read, or a negative
+ * errno.
+ */
+ssize_t read_bmp280_samples(struct bmp280_reader *reader);
+
+/**
+ * Decodes n scans from data, laid out as the reader's device captures them,
+ * into reader->samples. n must not be more than the reader's batch. This is
+ * what read_bmp280_samples does after each read, for data that comes from
+ * elsewhere, e.g. a file.
+ */
+void decode_bmp280_scans(struct bmp280_reader *reader, const uint8_t *data,
+			 size_t n);
+
+/**
+ * Closes the chardev, and frees the reader's buffers.
+ */
+void close_bmp280_reader(struct bmp280_reader *reader);
+
+#endif  // BMP280_READER_H_